@@ -0,0 +1,381 @@
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <ctime>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "util/logger.h"
+#include "util/utility.h"
+
+#include "preprocessor/libpp.h"
+
+#include "compare.h"
+#include "corpus.h"
+
+using namespace lib::util;
+using namespace pp;
+using namespace pp::bench;
+using namespace std;
+
+namespace {
+
+const StringView kUnknownOptionError = T_("不明なオプション {}が指定された。\n");
+const StringView kNoOptionParameterError = T_("オプション {}の値が指定されていない。\n");
+const StringView kInvalidOptionValueError = T_("オプション {}の値が正しくない。\n");
+const StringView kNoSuchFileError = T_("ファイルが開けない: {}\n");
+const StringView kFileOutputError = T_("出力に失敗した。\n");
+const StringView kNoWorkloadError = T_("--filterに合う入力が無い。\n");
+
+constexpr std::size_t kDefaultScale = 1;
+constexpr std::size_t kDefaultRepetitions = 5;
+constexpr std::uint32_t kDefaultSeed = 1;
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchOptions {
+    String filter;
+    std::size_t scale = kDefaultScale;
+    std::size_t repetitions = kDefaultRepetitions;
+    std::uint32_t seed = kDefaultSeed;
+    String output_filepath;
+    String generate_dir;
+    std::vector<String> pp_args;
+    bool list = false;
+    // --compare
+    String compare_dir;
+    std::vector<String> reference_args;
+    bool has_reference = false;
+    double max_time_ratio = 0.0;
+    bool create_expected = false;
+};
+
+/**
+ * 1つの入力の計測結果。時間はミリ秒。
+ */
+struct BenchResult {
+    std::string name;
+    std::size_t input_bytes = 0;
+    std::size_t output_bytes = 0;
+    std::size_t tokens = 0;
+    std::vector<double> real_times;
+    std::vector<double> cpu_times;
+    std::string error;
+};
+
+template <class T>
+bool parse_number(StringView s, T* result) {
+    const auto narrow = as_narrow(s);
+    const auto [end, ec] = from_chars(narrow.data(), narrow.data() + narrow.size(), *result);
+    return ec == std::errc() && end == narrow.data() + narrow.size();
+}
+
+bool parse_options(const std::vector<String>& args, BenchOptions& opts) {
+    const auto argc = args.size();
+    for (std::size_t i = 1; i < argc; i++) {
+        const String& arg = args[i];
+        if (arg == T_("--list")) {
+            opts.list = true;
+            continue;
+        }
+        if (arg == T_("--create-expected")) {
+            opts.create_expected = true;
+            continue;
+        }
+        if (arg == T_("--reference")) {
+            //  オプションを追加しない基準。--reference-optionでオプションを追加できる。
+            opts.has_reference = true;
+            continue;
+        }
+        if (arg != T_("--filter") && arg != T_("--scale") && arg != T_("--repetitions") && arg != T_("--seed") &&
+            arg != T_("--output") && arg != T_("--generate") && arg != T_("--pp-option") &&
+            arg != T_("--compare") && arg != T_("--reference-option") && arg != T_("--max-time-ratio")) {
+            log_error(kUnknownOptionError, arg);
+            return false;
+        }
+        if ((i + 1) >= argc) {
+            log_error(kNoOptionParameterError, arg);
+            return false;
+        }
+        const String& value = args[++i];
+        bool valid = true;
+        if (arg == T_("--filter")) {
+            opts.filter = value;
+        } else if (arg == T_("--scale")) {
+            valid = parse_number(value, &opts.scale) && opts.scale > 0;
+        } else if (arg == T_("--repetitions")) {
+            valid = parse_number(value, &opts.repetitions) && opts.repetitions > 0;
+        } else if (arg == T_("--seed")) {
+            valid = parse_number(value, &opts.seed);
+        } else if (arg == T_("--output")) {
+            opts.output_filepath = value;
+        } else if (arg == T_("--generate")) {
+            opts.generate_dir = value;
+        } else if (arg == T_("--compare")) {
+            opts.compare_dir = value;
+        } else if (arg == T_("--reference-option")) {
+            opts.reference_args.push_back(value);
+            opts.has_reference = true;
+        } else if (arg == T_("--max-time-ratio")) {
+            valid = parse_number(value, &opts.max_time_ratio) && opts.max_time_ratio > 0.0;
+            opts.has_reference = true;
+        } else {
+            opts.pp_args.push_back(value);
+        }
+        if (!valid) {
+            log_error(kInvalidOptionValueError, arg);
+            return false;
+        }
+    }
+    return true;
+}
+
+void print_usage() {
+    puts("使い方: cpp_bench [options]");
+    puts("Options:\n");
+    puts("--filter <name>\t名前にこの文字列を含む入力だけを計測する。");
+    puts("--scale <n>\t入力の大きさの倍率を指定する。(デフォルトは 1)");
+    puts("--repetitions <n>\t計測する回数を指定する。最初に 1回、計測しないで処理する。(デフォルトは 5)");
+    puts("--seed <n>\t入力を生成する乱数の種を指定する。(デフォルトは 1)");
+    puts("--pp-option <option>\tプリプロセッサーのオプションを追加する。(例: --pp-option -fmemoize-expansion)");
+    puts("--output <file>\t結果の JSONの出力先を指定する。(デフォルトは標準出力)");
+    puts("--generate <dir>\t計測せずに、入力をディレクトリに書き出す。入力ごとにサブディレクトリを作る。");
+    puts("--list\t\t入力の一覧を出力する。");
+    puts("--compare <dir>\tディレクトリの *.cを処理し、同じ名前の *.expectedとトークンの並びを比べる。空白の違いは無視する。");
+    puts("--create-expected\t--compareで、無い *.expectedを今の出力から作る。内容は確かめてから使う。");
+    puts("--reference\t--compareで、--pp-optionを付けない処理の時間も計測する。");
+    puts("--reference-option <option>\t--compareで、時間の基準にする処理のオプションを追加する。");
+    puts("--max-time-ratio <r>\t--compareで、基準の時間の r倍を超えたら失敗とする。");
+}
+
+/**
+ * 字句解析だけを計測する。(cpp --lex-only と同じ処理)
+ */
+void run_scanner(const Corpus& corpus, const BenchOptions& opts, BenchResult& result) {
+    PreprocessRequest request;
+    request.args = opts.pp_args;
+    request.path = internal_from_source(corpus.main_file);
+    request.source = corpus.files.at(corpus.main_file);
+
+    auto lex_result = lex(request);
+    result.tokens = lex_result.statistics.tokens;
+    if (!lex_result.succeeded) {
+        result.error = std::format("{} diagnostics", lex_result.diagnostics.size());
+        if (!lex_result.diagnostics.empty()) {
+            const auto& d = lex_result.diagnostics.front();
+            result.error += std::format("; {}:{}: {}", as_narrow(d.path), d.line, as_narrow(d.message));
+        }
+    }
+}
+
+/**
+ * ライブラリの preprocess()で翻訳単位を処理する。ファイルは全てメモリーから読み込む。
+ */
+void run_preprocessor(const Corpus& corpus, const BenchOptions& opts, BenchResult& result) {
+    //  実在しないディレクトリを基準にして、ディスクのファイルが混ざらないようにする。
+    const Path root = filesystem::current_path() / "cpp_bench_corpus";
+
+    PreprocessRequest request;
+    request.args = opts.pp_args;
+    request.path = internal_string(root / corpus.main_file);
+    request.source = corpus.files.at(corpus.main_file);
+    request.working_dir = internal_string(root);
+    request.read_file = [&](const String& path) -> std::optional<std::string> {
+        auto relative = path_string(path).lexically_normal().lexically_relative(root).generic_string();
+        auto it = corpus.files.find(relative);
+        if (it == corpus.files.end()) {
+            return nullopt;
+        }
+        return it->second;
+    };
+
+    std::string output;
+    auto pp_result = preprocess(request, output);
+    result.output_bytes = output.size();
+    const auto errors = count_if(pp_result.diagnostics.begin(), pp_result.diagnostics.end(),
+            [](const auto& d) { return d.level >= DiagLevel::kError; });
+    if (!pp_result.succeeded || errors != 0) {
+        result.error = std::format("{} errors", errors);
+        for (const auto& d : pp_result.diagnostics) {
+            if (d.level >= DiagLevel::kError) {
+                result.error += std::format("; {}:{}: {}", as_narrow(d.path), d.line, as_narrow(d.message));
+                break;
+            }
+        }
+    }
+}
+
+BenchResult run_workload(const WorkloadInfo& info, const BenchOptions& opts) {
+    BenchResult result;
+    result.name = info.name;
+
+    const auto corpus = generate_corpus(info.workload, opts.scale, opts.seed);
+    result.input_bytes = corpus.total_size();
+
+    //  1回目はキャッシュなどを温めるためで、計測しない。
+    for (std::size_t i = 0; i <= opts.repetitions && result.error.empty(); i++) {
+        const auto start = Clock::now();
+        const auto cpu_start = std::clock();
+        if (info.workload == Workload::kScan) {
+            run_scanner(corpus, opts, result);
+        } else {
+            run_preprocessor(corpus, opts, result);
+        }
+        const auto cpu_end = std::clock();
+        const auto end = Clock::now();
+        if (i != 0) {
+            result.real_times.push_back(chrono::duration<double, milli>(end - start).count());
+            result.cpu_times.push_back(1000.0 * static_cast<double>(cpu_end - cpu_start) / CLOCKS_PER_SEC);
+        }
+    }
+
+    return result;
+}
+
+/**
+ * 結果を JSONで出力する。
+ *
+ * real_time、cpu_timeは中央値。CIで前回の結果と比べられるように、1つの入力を 1つのオブジェクトにする。
+ */
+void write_json(std::ostream& output, const BenchOptions& opts, const std::vector<BenchResult>& results) {
+    std::string json = "{\n  \"context\": {";
+    format_to(back_inserter(json), "\"scale\": {}, \"repetitions\": {}, \"seed\": {}, \"pp_options\": [",
+            opts.scale, opts.repetitions, opts.seed);
+    for (std::size_t i = 0; i < opts.pp_args.size(); i++) {
+        format_to(back_inserter(json), "{}{}", (i == 0) ? "" : ", ", quote_json_string(as_narrow(opts.pp_args[i])));
+    }
+#if defined(NDEBUG)
+    json += "], \"build_type\": \"release\"},\n  \"benchmarks\": [";
+#else
+    json += "], \"build_type\": \"debug\"},\n  \"benchmarks\": [";
+#endif
+    for (std::size_t i = 0; i < results.size(); i++) {
+        const auto& r = results[i];
+        const auto real_time = median(r.real_times);
+        const auto min_time = r.real_times.empty() ? 0.0 : *min_element(r.real_times.begin(), r.real_times.end());
+        const auto bytes_per_second = (real_time > 0.0) ? static_cast<double>(r.input_bytes) * 1000.0 / real_time : 0.0;
+        json += (i == 0) ? "\n" : ",\n";
+        format_to(back_inserter(json),
+                "    {{\"name\": {}, \"input_bytes\": {}, \"output_bytes\": {}, \"tokens\": {}, \"iterations\": {}, "
+                "\"real_time\": {:.3f}, \"real_time_min\": {:.3f}, \"cpu_time\": {:.3f}, \"time_unit\": \"ms\", "
+                "\"bytes_per_second\": {:.0f}, \"error_occurred\": {}",
+                quote_json_string(r.name), r.input_bytes, r.output_bytes, r.tokens, r.real_times.size(),
+                real_time, min_time, median(r.cpu_times), bytes_per_second, r.error.empty() ? "false" : "true");
+        if (!r.error.empty()) {
+            format_to(back_inserter(json), ", \"error_message\": {}", quote_json_string(r.error));
+        }
+        json += "}";
+    }
+    json += "\n  ]\n}\n";
+    output.write(json.data(), json.size());
+}
+
+/**
+ * 入力をディレクトリに書き出す。cppで直接処理したり、他の処理系と比べたりするため。
+ */
+bool generate_corpora(const std::vector<WorkloadInfo>& infos, const BenchOptions& opts) {
+    for (const auto& info : infos) {
+        const auto corpus = generate_corpus(info.workload, opts.scale, opts.seed);
+        const Path dir = path_string(opts.generate_dir) / info.name;
+        for (const auto& [relative, content] : corpus.files) {
+            const Path path = dir / relative;
+            std::error_code ec;
+            filesystem::create_directories(path.parent_path(), ec);
+            ofstream file(path, ios_base::binary);
+            if (!file) {
+                log_error(kNoSuchFileError, internal_string(path));
+                return false;
+            }
+            file.write(content.data(), static_cast<std::streamsize>(content.size()));
+            if (!file) {
+                log_error(kFileOutputError);
+                return false;
+            }
+        }
+        cout << as_narrow(internal_string(dir / corpus.main_file)) << '\n';
+    }
+    return true;
+}
+
+}   // anonymous namespace
+
+#if HOST_PLATFORM == PLATFORM_WINDOWS
+int wmain(int argc, wchar_t* argv[]) {
+#else
+int main(int argc, char* argv[]) {
+#endif
+    vector<String> args;
+    args.reserve(argc);
+    for (int i = 0; i < argc; ++i) {
+        args.push_back(internal_string(argv[i]));
+    }
+
+    setup_console();
+
+    BenchOptions opts;
+    if (!parse_options(args, opts)) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    ofstream output_file;
+    std::ostream* output = &cout;
+    if (!opts.output_filepath.empty() && opts.generate_dir.empty() && !opts.list) {
+        output_file.open(path_string(opts.output_filepath), ios_base::binary);
+        if (!output_file) {
+            log_error(kNoSuchFileError, opts.output_filepath);
+            return EXIT_FAILURE;
+        }
+        output = &output_file;
+    }
+
+    if (!opts.compare_dir.empty()) {
+        const CompareOptions compare_opts{ opts.compare_dir, opts.pp_args, opts.reference_args, opts.has_reference,
+                opts.repetitions, opts.max_time_ratio, opts.create_expected };
+        const int result = run_compare(compare_opts, *output);
+        if (!output->flush()) {
+            log_error(kFileOutputError);
+            return EXIT_FAILURE;
+        }
+        return result;
+    }
+
+    std::vector<WorkloadInfo> infos;
+    for (const auto& info : workloads()) {
+        if (opts.filter.empty() || string_view(info.name).find(as_narrow(opts.filter)) != string_view::npos) {
+            infos.push_back(info);
+        }
+    }
+    if (opts.list) {
+        for (const auto& info : workloads()) {
+            cout << info.name << '\t' << info.description << '\n';
+        }
+        return 0;
+    }
+    if (infos.empty()) {
+        log_error(kNoWorkloadError);
+        return EXIT_FAILURE;
+    }
+    if (!opts.generate_dir.empty()) {
+        return generate_corpora(infos, opts) ? 0 : EXIT_FAILURE;
+    }
+
+    std::vector<BenchResult> results;
+    bool failed = false;
+    for (const auto& info : infos) {
+        results.push_back(run_workload(info, opts));
+        failed = failed || !results.back().error.empty();
+    }
+
+    write_json(*output, opts, results);
+    if (!output->flush()) {
+        log_error(kFileOutputError);
+        return EXIT_FAILURE;
+    }
+
+    return failed ? EXIT_FAILURE : 0;
+}
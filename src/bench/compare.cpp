@@ -0,0 +1,280 @@
+#include "compare.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <ostream>
+#include <sstream>
+
+#include "util/logger.h"
+#include "util/utility.h"
+
+#include "preprocessor/libpp.h"
+
+using namespace lib::util;
+using namespace pp;
+using namespace pp::bench;
+using namespace std;
+
+namespace {
+
+const StringView kNoSuchDirectoryError = T_("ディレクトリが開けない: {}\n");
+const StringView kNoCaseError = T_("{}に入力 (*.c)が無い。\n");
+
+const char* const kSourceExtension = ".c";
+const char* const kExpectedExtension = ".expected";
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * 1つの入力の比較の結果。時間はミリ秒。
+ */
+struct CaseResult {
+    std::string name;
+    bool equivalent = false;
+    double real_time = 0.0;
+    std::optional<double> reference_time;
+    bool too_slow = false;
+    std::string message;
+};
+
+/**
+ * 比べる単位のトークン。空白、改行、コメントは含めない。
+ */
+struct SignificantToken {
+    std::string spelling;
+    std::uint32_t line;
+    std::uint32_t column;
+};
+
+std::optional<std::string> read_file(const Path& path) {
+    ifstream file(path, ios_base::binary);
+    if (!file) {
+        return nullopt;
+    }
+    std::ostringstream content;
+    content << file.rdbuf();
+    return content.str();
+}
+
+/**
+ * textを字句解析する。字句解析に失敗したら、途中までのトークンで比べないように nulloptを返す。
+ */
+std::optional<std::vector<SignificantToken>> significant_tokens(const std::string& text, const Path& path) {
+    PreprocessRequest request;
+    request.path = internal_string(path);
+    request.source = text;
+
+    std::vector<SignificantToken> tokens;
+    const auto result = lex(request, [&tokens](const Token& t) {
+        if (t.type() != TokenType::kWhiteSpace && t.type() != TokenType::kNewLine && t.type() != TokenType::kComment) {
+            tokens.push_back({ t.string(), t.line(), t.column() });
+        }
+    });
+    if (!result.succeeded) {
+        return nullopt;
+    }
+    return tokens;
+}
+
+/**
+ * トークンの並びを比べる。違いが無ければ空文字列を、有れば最初の違いの説明を返す。
+ */
+std::string compare_tokens(const std::vector<SignificantToken>& actual, const std::vector<SignificantToken>& expected) {
+    const auto n = std::min(actual.size(), expected.size());
+    for (std::size_t i = 0; i < n; i++) {
+        if (actual[i].spelling != expected[i].spelling) {
+            return std::format("token {}: expected '{}' at {}:{}, got '{}' at {}:{}",
+                    i, expected[i].spelling, expected[i].line, expected[i].column,
+                    actual[i].spelling, actual[i].line, actual[i].column);
+        }
+    }
+    if (actual.size() != expected.size()) {
+        return std::format("expected {} tokens, got {}", expected.size(), actual.size());
+    }
+    return {};
+}
+
+/**
+ * 入力を 1回処理する。エラーが有れば messageに設定する。
+ */
+std::string preprocess_case(const Path& source, const std::vector<String>& args, std::string& message) {
+    PreprocessRequest request;
+    request.args = args;
+    //  行マーカーは処理系ごとに異なるので、比べない。
+    request.args.push_back(T_("-P"));
+    request.path = internal_string(source);
+    request.working_dir = internal_string(source.parent_path());
+
+    std::string output;
+    auto result = preprocess(request, output);
+    for (const auto& d : result.diagnostics) {
+        if (d.level >= DiagLevel::kError) {
+            message = std::format("{}:{}: {}", as_narrow(d.path), d.line, as_narrow(d.message));
+            break;
+        }
+    }
+    if (!result.succeeded && message.empty()) {
+        message = "preprocessing failed";
+    }
+    return output;
+}
+
+/**
+ * repetitions回処理した時間の中央値を返す。
+ */
+double measure_case(const Path& source, const std::vector<String>& args, std::size_t repetitions) {
+    std::vector<double> times;
+    for (std::size_t i = 0; i < repetitions; i++) {
+        std::string message;
+        const auto start = Clock::now();
+        preprocess_case(source, args, message);
+        times.push_back(chrono::duration<double, milli>(Clock::now() - start).count());
+    }
+    return median(move(times));
+}
+
+CaseResult run_case(const Path& source, const CompareOptions& opts) {
+    CaseResult result;
+    result.name = source.filename().string();
+
+    //  1回目の出力を比べ、時間はその後で計る。1回目は計測しない。
+    std::string error;
+    const auto output = preprocess_case(source, opts.args, error);
+    if (!error.empty()) {
+        result.message = move(error);
+        return result;
+    }
+
+    Path expected_path = source;
+    expected_path.replace_extension(kExpectedExtension);
+    if (opts.create_expected && !filesystem::exists(expected_path)) {
+        ofstream file(expected_path, ios_base::binary);
+        file.write(output.data(), static_cast<std::streamsize>(output.size()));
+        if (!file.flush()) {
+            result.message = std::format("cannot write {}", expected_path.string());
+            return result;
+        }
+    }
+    const auto expected = read_file(expected_path);
+    if (!expected) {
+        result.message = std::format("no expected output {}", expected_path.string());
+        return result;
+    }
+
+    const auto actual_tokens = significant_tokens(output, source);
+    if (!actual_tokens) {
+        result.message = "cannot tokenize the output";
+        return result;
+    }
+    const auto expected_tokens = significant_tokens(*expected, expected_path);
+    if (!expected_tokens) {
+        result.message = std::format("cannot tokenize {}", expected_path.string());
+        return result;
+    }
+    result.message = compare_tokens(*actual_tokens, *expected_tokens);
+    result.equivalent = result.message.empty();
+
+    result.real_time = measure_case(source, opts.args, opts.repetitions);
+    if (opts.has_reference) {
+        //  基準の 1回目はエラーの確認で、計測しない。
+        std::string reference_error;
+        preprocess_case(source, opts.reference_args, reference_error);
+        if (!reference_error.empty()) {
+            result.equivalent = false;
+            result.message = "reference: " + reference_error;
+            return result;
+        }
+        result.reference_time = measure_case(source, opts.reference_args, opts.repetitions);
+        if (opts.max_time_ratio > 0.0 && *result.reference_time > 0.0 &&
+            result.real_time > *result.reference_time * opts.max_time_ratio) {
+            result.too_slow = true;
+            if (result.message.empty()) {
+                result.message = std::format("{:.3f} ms exceeds {:.2f} x reference {:.3f} ms",
+                        result.real_time, opts.max_time_ratio, *result.reference_time);
+            }
+        }
+    }
+    return result;
+}
+
+void write_json(std::ostream& output, const CompareOptions& opts, const std::vector<CaseResult>& results) {
+    const auto passed = count_if(results.begin(), results.end(),
+            [](const auto& r) { return r.equivalent && !r.too_slow; });
+    std::string json = std::format("{{\n  \"context\": {{\"dir\": {}, \"repetitions\": {}, \"max_time_ratio\": {}}},\n",
+            quote_json_string(as_narrow(opts.dir)), opts.repetitions, opts.max_time_ratio);
+    format_to(back_inserter(json), "  \"passed\": {}, \"failed\": {},\n  \"cases\": [", passed, results.size() - passed);
+    for (std::size_t i = 0; i < results.size(); i++) {
+        const auto& r = results[i];
+        json += (i == 0) ? "\n" : ",\n";
+        format_to(back_inserter(json), "    {{\"name\": {}, \"equivalent\": {}, \"real_time\": {:.3f}",
+                quote_json_string(r.name), r.equivalent ? "true" : "false", r.real_time);
+        if (r.reference_time) {
+            format_to(back_inserter(json), ", \"reference_time\": {:.3f}, \"too_slow\": {}",
+                    *r.reference_time, r.too_slow ? "true" : "false");
+        }
+        json += ", \"time_unit\": \"ms\"";
+        if (!r.message.empty()) {
+            format_to(back_inserter(json), ", \"message\": {}", quote_json_string(r.message));
+        }
+        json += "}";
+    }
+    json += "\n  ]\n}\n";
+    output.write(json.data(), json.size());
+}
+
+}   // anonymous namespace
+
+namespace pp::bench {
+
+double median(std::vector<double> values) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    sort(values.begin(), values.end());
+    const auto n = values.size();
+    return (n % 2 == 1) ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2.0;
+}
+
+/**
+ * ディレクトリの入力 (*.c)を順に処理し、期待する出力 (同じ名前の *.expected)とトークンの並びで比べる。
+ *
+ * 空白、改行、コメントの違いは無視する。出力は -Pで行マーカーを含めない。
+ * 基準のオプションが指定されたら、それでも処理して時間を比べ、max_time_ratioを超えたら失敗とする。
+ * 結果は JSONで outputに出力する。全て一致して時間の制限にも収まれば 0を返す。
+ */
+int run_compare(const CompareOptions& opts, std::ostream& output) {
+    const Path dir = filesystem::absolute(path_string(opts.dir)).lexically_normal();
+    std::error_code ec;
+    std::vector<Path> sources;
+    for (const auto& entry : filesystem::directory_iterator(dir, ec)) {
+        if (entry.is_regular_file() && entry.path().extension() == kSourceExtension) {
+            sources.push_back(entry.path());
+        }
+    }
+    if (ec) {
+        log_error(kNoSuchDirectoryError, opts.dir);
+        return EXIT_FAILURE;
+    }
+    if (sources.empty()) {
+        log_error(kNoCaseError, opts.dir);
+        return EXIT_FAILURE;
+    }
+    sort(sources.begin(), sources.end());
+
+    std::vector<CaseResult> results;
+    for (const auto& source : sources) {
+        results.push_back(run_case(source, opts));
+    }
+    write_json(output, opts, results);
+
+    const bool all_passed = all_of(results.begin(), results.end(),
+            [](const auto& r) { return r.equivalent && !r.too_slow; });
+    return all_passed ? 0 : EXIT_FAILURE;
+}
+
+}   // namespace pp::bench
@@ -0,0 +1,35 @@
+#ifndef CC_BENCH_COMPARE_H_
+#define CC_BENCH_COMPARE_H_
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include "util/utility.h"
+
+namespace pp::bench {
+
+/**
+ * 期待する出力との比較の指定。(cpp_bench --compare)
+ */
+struct CompareOptions {
+    // 入力 (*.c)と期待する出力 (*.expected)の有るディレクトリ
+    lib::util::String dir;
+    // 比べるプリプロセッサーのオプション
+    std::vector<lib::util::String> args;
+    // 時間の基準にするプリプロセッサーのオプション。has_referenceが falseなら基準の計測はしない。
+    std::vector<lib::util::String> reference_args;
+    bool has_reference = false;
+    std::size_t repetitions = 1;
+    // 基準の時間に対する比の上限。0なら制限しない。
+    double max_time_ratio = 0.0;
+    // 期待する出力が無ければ、今の出力から作る。既に有るものは置き換えない。
+    bool create_expected = false;
+};
+
+double median(std::vector<double> values);
+int run_compare(const CompareOptions& opts, std::ostream& output);
+
+}   // namespace pp::bench
+
+#endif  // CC_BENCH_COMPARE_H_
@@ -0,0 +1,339 @@
+#include "corpus.h"
+
+#include <format>
+#include <iterator>
+
+using namespace std;
+
+namespace {
+
+using namespace pp::bench;
+
+/**
+ * 生成する入力を処理系によらず同じにするための擬似乱数。(xorshift32)
+ *
+ * 標準の分布クラスは実装によって結果が異なるので使わない。
+ */
+class Random {
+public:
+    explicit Random(std::uint32_t seed)
+        : state_(seed ? seed : 0x9e3779b9u) {
+    }
+
+    std::uint32_t next() {
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 17;
+        state_ ^= state_ << 5;
+        return state_;
+    }
+
+    // [0, n)
+    std::size_t below(std::size_t n) {
+        return (n == 0) ? 0 : (next() % n);
+    }
+
+    bool chance(unsigned percent) {
+        return below(100) < percent;
+    }
+
+private:
+    std::uint32_t state_;
+};
+
+const char* const kIdentifiers[] = {
+    "value", "count", "buffer", "index", "result", "node", "next", "size", "flags", "state",
+};
+
+const char* const kPunctuators[] = {
+    "+", "-", "*", "/", "%", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", "->", "++", "--",
+    "+=", "-=", "<<=", ">>=", "&", "|", "^", "~", "!", "?", ":", "::", "...", "[", "]", "{", "}",
+};
+
+const char* const kNumbers[] = {
+    "0", "42", "0x7fffffff", "0b1010", "3.14159", "1.5e-10", ".5f", "100ULL", "0777", "6.02e+23L",
+};
+
+const char* const kStrings[] = {
+    "\"hello, world\"", "\"tab\\tnewline\\n\"", "u8\"utf-8 \\u00e9\"", "L\"wide\"",
+    "'a'", "'\\n'", "'\\x41'", "U'\\U0001F600'",
+};
+
+template <std::size_t N>
+const char* pick(Random& random, const char* const (&table)[N]) {
+    return table[random.below(N)];
+}
+
+//  NOTE: 実引数の評価順は決まっていないので、1つの式で何度も乱数を引かずに、変数に受けてから使う。
+
+/**
+ * 字句解析だけの入力。ディレクティブもマクロも無く、いろいろな種類のトークン、コメント、行の継続を含む。
+ */
+Corpus generate_scan(std::size_t scale, Random& random) {
+    std::string text;
+    const std::size_t lines = 20000 * scale;
+    for (std::size_t i = 0; i < lines; i++) {
+        switch (random.below(8)) {
+        case 0:
+            format_to(back_inserter(text), "// line comment {} with some words in it\n", i);
+            break;
+        case 1:
+            format_to(back_inserter(text), "/* block comment {}\n   spanning two lines */\n", i);
+            break;
+        case 2: {
+            const auto s1 = pick(random, kStrings);
+            const auto s2 = pick(random, kStrings);
+            format_to(back_inserter(text), "const char* s{} = {} \\\n    {};\n", i, s1, s2);
+            break;
+        }
+        default: {
+            const auto id1 = pick(random, kIdentifiers);
+            const auto num1 = pick(random, kNumbers);
+            const auto op1 = pick(random, kPunctuators);
+            const auto id2 = pick(random, kIdentifiers);
+            const auto op2 = pick(random, kPunctuators);
+            const auto id3 = pick(random, kIdentifiers);
+            const auto num2 = pick(random, kNumbers);
+            format_to(back_inserter(text), "{}_{} = ({} {} {}) {} {}[{}];\n", id1, i, num1, op1, id2, op2, id3, num2);
+            break;
+        }
+        }
+    }
+    return { "scan.c", { { "scan.c", move(text) } } };
+}
+
+/**
+ * オブジェクト形式マクロを大量に定義し、それを参照する行を並べる。マクロの一部は前に定義したマクロを参照する。
+ */
+Corpus generate_object_macros(std::size_t scale, Random& random) {
+    std::string text;
+    const std::size_t macros = 2000 * scale;
+    for (std::size_t i = 0; i < macros; i++) {
+        if (i > 0 && random.chance(50)) {
+            const auto ref = random.below(i);
+            format_to(back_inserter(text), "#define OBJ_{} (OBJ_{} + {})\n", i, ref, i);
+        } else {
+            format_to(back_inserter(text), "#define OBJ_{} ({} * {})\n", i, i, pick(random, kNumbers));
+        }
+    }
+    const std::size_t lines = 20000 * scale;
+    for (std::size_t i = 0; i < lines; i++) {
+        const auto m1 = random.below(macros);
+        const auto m2 = random.below(macros);
+        const auto m3 = random.below(macros);
+        format_to(back_inserter(text), "int v_{} = OBJ_{} + OBJ_{} * OBJ_{};\n", i, m1, m2, m3);
+    }
+    return { "object_macros.c", { { "object_macros.c", move(text) } } };
+}
+
+/**
+ * Boost.PPのように、##で名前を組み立てて関数形式マクロを繰り返し呼び出す。
+ */
+Corpus generate_function_macros(std::size_t scale, Random& random) {
+    constexpr std::size_t kMaxRepeat = 64;
+    std::string text =
+        "#define PP_CAT(a, b) PP_CAT_I(a, b)\n"
+        "#define PP_CAT_I(a, b) a ## b\n"
+        "#define PP_INC(n) PP_CAT(PP_INC_, n)\n"
+        "#define PP_BOOL(n) PP_CAT(PP_BOOL_, n)\n"
+        "#define PP_IF(c, t, f) PP_CAT(PP_IF_, PP_BOOL(c))(t, f)\n"
+        "#define PP_IF_0(t, f) f\n"
+        "#define PP_IF_1(t, f) t\n"
+        "#define PP_COMMA_IF(n) PP_IF(n, PP_COMMA, PP_EMPTY)()\n"
+        "#define PP_COMMA() ,\n"
+        "#define PP_EMPTY()\n"
+        "#define PP_REPEAT(n, m, d) PP_CAT(PP_REPEAT_, n)(m, d)\n"
+        "#define PP_REPEAT_0(m, d)\n"
+        "#define FIELD(n, type) type PP_CAT(field_, n) = PP_INC(n);\n"
+        "#define PARAM(n, type) PP_COMMA_IF(n) type PP_CAT(arg_, n)\n";
+    for (std::size_t i = 0; i <= kMaxRepeat; i++) {
+        format_to(back_inserter(text), "#define PP_INC_{} {}\n", i, i + 1);
+        format_to(back_inserter(text), "#define PP_BOOL_{} {}\n", i, (i == 0) ? 0 : 1);
+    }
+    for (std::size_t i = 1; i <= kMaxRepeat; i++) {
+        format_to(back_inserter(text), "#define PP_REPEAT_{}(m, d) PP_REPEAT_{}(m, d) m({}, d)\n", i, i - 1, i - 1);
+    }
+    const std::size_t lines = 200 * scale;
+    for (std::size_t i = 0; i < lines; i++) {
+        const auto n = 1 + random.below(kMaxRepeat);
+        format_to(back_inserter(text), "struct S{} {{ PP_REPEAT({}, FIELD, int) }};\n", i, n);
+        format_to(back_inserter(text), "void f{}(PP_REPEAT({}, PARAM, long));\n", i, n);
+    }
+    return { "function_macros.c", { { "function_macros.c", move(text) } } };
+}
+
+/**
+ * ##による連結と #による文字列化を、間接的な呼び出しも含めて多用する。
+ */
+Corpus generate_paste_stringize(std::size_t scale, Random& random) {
+    std::string text =
+        "#define CAT(a, b) a ## b\n"
+        "#define CAT3(a, b, c) a ## b ## c\n"
+        "#define XCAT(a, b) CAT(a, b)\n"
+        "#define STR(x) #x\n"
+        "#define XSTR(x) STR(x)\n"
+        "#define FLOAT(a, b) a ## . ## b ## e10\n"
+        "#define DECL(t, n) t XCAT(var_, n) = sizeof(XSTR(CAT3(t, _, n)));\n"
+        "#define NAME(t, n) const char* CAT(name_, n) = STR(t n \"quoted\\n\" 'c');\n";
+    const std::size_t lines = 20000 * scale;
+    for (std::size_t i = 0; i < lines; i++) {
+        const auto t1 = pick(random, kIdentifiers);
+        const auto t2 = pick(random, kIdentifiers);
+        const auto a = random.below(1000);
+        const auto b = random.below(1000);
+        format_to(back_inserter(text), "DECL({}, {}) NAME({}, {}) double d{} = FLOAT({}, {});\n", t1, i, t2, i, i, a, b);
+    }
+    return { "paste_stringize.c", { { "paste_stringize.c", move(text) } } };
+}
+
+/**
+ * 設定マクロによる #if群を入れ子にする。およそ半分のグループは偽で、読み飛ばされる。
+ */
+Corpus generate_conditionals(std::size_t scale, Random& random) {
+    constexpr std::size_t kConfigs = 64;
+    std::string text;
+    for (std::size_t i = 0; i < kConfigs; i++) {
+        if (random.chance(70)) {
+            format_to(back_inserter(text), "#define CFG_{} {}\n", i, random.below(8));
+        }
+    }
+    const std::size_t blocks = 5000 * scale;
+    for (std::size_t i = 0; i < blocks; i++) {
+        std::size_t c[7];
+        for (auto& n : c) {
+            n = random.below(kConfigs);
+        }
+        const auto num1 = pick(random, kNumbers);
+        const auto op = pick(random, kPunctuators);
+        const auto num2 = pick(random, kNumbers);
+        const auto num3 = pick(random, kNumbers);
+        const auto num4 = pick(random, kNumbers);
+        const auto str = pick(random, kStrings);
+        format_to(back_inserter(text),
+                "#if defined(CFG_{}) && CFG_{} > 3 || (CFG_{} << 2) == 8\n"
+                "int a_{} = {} {} {};\n"
+                "#elif CFG_{} % 2 ? CFG_{} : !CFG_{}\n"
+                "#  ifdef CFG_{}\n"
+                "int b_{} = {};\n"
+                "#  else\n"
+                "int c_{} = {};\n"
+                "#  endif\n"
+                "#else\n"
+                "/* skipped {} */ const char* d_{} = {};\n"
+                "#endif\n",
+                c[0], c[1], c[2],
+                i, num1, op, num2,
+                c[3], c[4], c[5],
+                c[6],
+                i, num3,
+                i, num4,
+                i, i, str);
+    }
+    return { "conditionals.c", { { "conditionals.c", move(text) } } };
+}
+
+/**
+ * インクルードガードの有るヘッダーの木。各ヘッダーは後ろのヘッダーをいくつかインクルードするので、
+ * 2回目以降のインクルードはガードで省かれる。
+ */
+Corpus generate_include_tree(std::size_t scale, Random& random) {
+    constexpr std::size_t kFanOut = 4;
+    constexpr std::size_t kDeclarations = 20;
+    Corpus corpus{ "include_tree.c", {} };
+    const std::size_t headers = 200 * scale;
+    for (std::size_t i = 0; i < headers; i++) {
+        std::string text = std::format("#ifndef HEADER_{0}_H_\n#define HEADER_{0}_H_\n\n", i);
+        for (std::size_t j = 0; j < kFanOut && i + 1 < headers; j++) {
+            const auto included = i + 1 + random.below(headers - i - 1);
+            format_to(back_inserter(text), "#include \"h{}.h\"\n", included);
+        }
+        for (std::size_t j = 0; j < kDeclarations; j++) {
+            const auto type = pick(random, kIdentifiers);
+            format_to(back_inserter(text), "extern int h{}_{}({} {});\n", i, j, type, j);
+        }
+        text += "\n#endif\n";
+        corpus.files.insert({ std::format("inc/h{}.h", i), move(text) });
+    }
+    std::string text;
+    for (std::size_t i = 0; i < headers; i++) {
+        format_to(back_inserter(text), "#include \"inc/h{}.h\"\n", i);
+    }
+    text += "int main(void) { return 0; }\n";
+    corpus.files.insert({ corpus.main_file, move(text) });
+    return corpus;
+}
+
+/**
+ * バイナリーファイルを #embedで取り込む。
+ *
+ * 1つのリソースの大きさは execute_embedの上限 (64KiB)までなので、上限の大きさのファイルをいくつも取り込む。
+ */
+Corpus generate_embed(std::size_t scale, Random& random) {
+    constexpr std::size_t kBlobSize = 64 * 1024;
+    Corpus corpus{ "embed.c", {} };
+    std::string text;
+    const std::size_t blobs = 16 * scale;
+    for (std::size_t i = 0; i < blobs; i++) {
+        std::string blob(kBlobSize, '\0');
+        for (auto& c : blob) {
+            c = static_cast<char>(random.next() & 0xff);
+        }
+        corpus.files.insert({ std::format("blob{}.bin", i), move(blob) });
+        format_to(back_inserter(text),
+                "const unsigned char data{0}[] = {{\n#embed \"blob{0}.bin\"\n}};\n"
+                "const unsigned char head{0}[] = {{\n#embed \"blob{0}.bin\" limit(4096)\n}};\n",
+                i);
+    }
+    corpus.files.insert({ corpus.main_file, move(text) });
+    return corpus;
+}
+
+}   // anonymous namespace
+
+namespace pp::bench {
+
+std::size_t Corpus::total_size() const {
+    std::size_t size = 0;
+    for (const auto& [path, content] : files) {
+        size += content.size();
+    }
+    return size;
+}
+
+const std::vector<WorkloadInfo>& workloads() {
+    static const std::vector<WorkloadInfo> infos = {
+        { Workload::kScan, "scan", "字句解析だけ" },
+        { Workload::kObjectMacros, "object_macros", "オブジェクト形式マクロの大量の定義と参照" },
+        { Workload::kFunctionMacros, "function_macros", "Boost.PP風の関数形式マクロの繰り返し" },
+        { Workload::kPasteStringize, "paste_stringize", "##と #の多用" },
+        { Workload::kConditionals, "conditionals", "#if群の入れ子と読み飛ばし" },
+        { Workload::kIncludeTree, "include_tree", "インクルードガードの有るヘッダーの木" },
+        { Workload::kEmbed, "embed", "バイナリーの #embed" },
+    };
+    return infos;
+}
+
+/**
+ * 種類と大きさ (scaleに比例する)と seedが同じなら、同じ入力を生成する。
+ */
+Corpus generate_corpus(Workload workload, std::size_t scale, std::uint32_t seed) {
+    Random random(seed);
+    switch (workload) {
+    case Workload::kScan:
+        return generate_scan(scale, random);
+    case Workload::kObjectMacros:
+        return generate_object_macros(scale, random);
+    case Workload::kFunctionMacros:
+        return generate_function_macros(scale, random);
+    case Workload::kPasteStringize:
+        return generate_paste_stringize(scale, random);
+    case Workload::kConditionals:
+        return generate_conditionals(scale, random);
+    case Workload::kIncludeTree:
+        return generate_include_tree(scale, random);
+    case Workload::kEmbed:
+        return generate_embed(scale, random);
+    }
+    return {};
+}
+
+}   // namespace pp::bench
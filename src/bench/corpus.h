@@ -0,0 +1,52 @@
+#ifndef CC_BENCH_CORPUS_H_
+#define CC_BENCH_CORPUS_H_
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace pp::bench {
+
+/**
+ * ベンチマークの入力の種類。
+ */
+enum class Workload {
+    // 字句解析だけ (pp::lex)
+    kScan,
+    // オブジェクト形式マクロを大量に定義して使う
+    kObjectMacros,
+    // Boost.PPのような関数形式マクロの繰り返しと入れ子
+    kFunctionMacros,
+    // ##と #を多用する
+    kPasteStringize,
+    // #if群の入れ子と偽のグループの読み飛ばし
+    kConditionals,
+    // インクルードガードの有るヘッダーの木
+    kIncludeTree,
+    // バイナリーの #embed
+    kEmbed,
+};
+
+struct WorkloadInfo {
+    Workload workload;
+    const char* name;
+    const char* description;
+};
+
+/**
+ * 生成した入力。ファイルは仮想のディレクトリからの相対パス ('/'区切り)で持つ。
+ */
+struct Corpus {
+    std::string main_file;
+    std::map<std::string, std::string> files;
+
+    std::size_t total_size() const;
+};
+
+const std::vector<WorkloadInfo>& workloads();
+Corpus generate_corpus(Workload workload, std::size_t scale, std::uint32_t seed);
+
+}   // namespace pp::bench
+
+#endif  // CC_BENCH_CORPUS_H_
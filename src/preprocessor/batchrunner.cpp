@@ -0,0 +1,143 @@
+#include "batchrunner.h"
+
+#include <exception>
+#include <filesystem>
+#include <set>
+#include <thread>
+
+#include "util/logger.h"
+#include "util/utility.h"
+
+#include "diagnostics.h"
+#include "preprocessor.h"
+#include "sourcefilestack.h"
+
+using namespace lib::util;
+using namespace std;
+
+namespace {
+
+const pp::StringView kStdinInBatchError = T_("入力ファイルが複数の場合は標準入力 (-)は指定できない。\n");
+const pp::StringView kDuplicateOutputError = T_("出力ファイル {}が重複している。\n");
+const pp::StringView kOutputDirError = T_("出力先のディレクトリ {}を作成できない: {}\n");
+const pp::StringView kTranslationUnitError = T_("{}の処理中にエラーが発生した: {}\n");
+
+}   // anonymous namespace
+
+namespace pp {
+
+BatchRunner::BatchRunner(const Options& opts,
+                         std::shared_ptr<IncludeCache> include_cache,
+                         std::shared_ptr<FileCache> file_cache)
+    : opts_(opts)
+    , include_cache_(include_cache ? move(include_cache) : make_shared<IncludeCache>())
+    , file_cache_(file_cache ? move(file_cache) : make_shared<FileCache>(opts.file_cache_size()))
+    , units_()
+    , next_unit_()
+    , failed_units_() {
+}
+
+BatchRunner::~BatchRunner() {
+}
+
+int BatchRunner::run() {
+    if (!prepare()) {
+        return EXIT_FAILURE;
+    }
+
+    const size_t num_threads = min(max<size_t>(opts_.jobs(), 1), units_.size());
+    if (num_threads <= 1) {
+        worker();
+    } else {
+        vector<thread> threads;
+        threads.reserve(num_threads);
+        for (size_t i = 0; i < num_threads; i++) {
+            threads.emplace_back(&BatchRunner::worker, this);
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    const auto lookups = include_cache_->hits() + include_cache_->misses();
+    log_info(T_("include cache: {} hits / {} lookups"), include_cache_->hits(), lookups);
+    log_info(T_("file cache: {} hits / {} loads"), file_cache_->hits(), file_cache_->hits() + file_cache_->misses());
+
+    return failed_units_ > 0 ? EXIT_FAILURE : 0;
+}
+
+/**
+ * 翻訳単位ごとの入出力ファイルを決める。
+ */
+bool BatchRunner::prepare() {
+    Path out_dir = opts_.output_filepath().empty() ? Path(T_(".")) : Path(path_string(opts_.output_filepath()));
+
+    error_code ec;
+    filesystem::create_directories(out_dir, ec);
+    if (ec) {
+        log_error(kOutputDirError, internal_string(out_dir), ec.message());
+        return false;
+    }
+
+    set<Path> outputs;
+    for (const auto& input : opts_.input_filepaths()) {
+        if (input == T_("-")) {
+            log_error(kStdinInBatchError);
+            return false;
+        }
+
+        Path out_path = out_dir / Path(path_string(input)).filename();
+        out_path.replace_extension(T_(".i"));
+        if (!outputs.insert(out_path).second) {
+            log_error(kDuplicateOutputError, internal_string(out_path));
+            return false;
+        }
+
+        Path err_path = out_path;
+        err_path.replace_extension(T_(".err"));
+        units_.push_back({ input, internal_string(out_path), internal_string(err_path) });
+    }
+
+    if (units_.empty()) {
+        log_error(kNoInputError);
+        return false;
+    }
+
+    return true;
+}
+
+void BatchRunner::worker() {
+    for (;;) {
+        const size_t i = next_unit_++;
+        if (i >= units_.size()) {
+            break;
+        }
+
+        if (!run_translation_unit(units_[i])) {
+            failed_units_++;
+        }
+    }
+}
+
+/**
+ * 翻訳単位を 1つ処理する。
+ *
+ * インクルードの検索結果とインクルードガード、ファイルの内容は、他の翻訳単位と共有する。
+ */
+bool BatchRunner::run_translation_unit(const TranslationUnit& tu) {
+    try {
+        Options opts = opts_.translation_unit_options(tu.input_path, tu.output_path, tu.error_log_path);
+        Diagnostics diag;
+        SourceFileStack sources;
+        Preprocessor pp(opts, diag, sources, include_cache_, file_cache_);
+        return pp.run() == 0;
+    } catch (const exception& e) {
+        log_error(kTranslationUnitError, tu.input_path, e.what());
+    } catch (...) {
+        log_error(kTranslationUnitError, tu.input_path, "unknown exception");
+    }
+
+    return false;
+}
+
+}   // namespace pp
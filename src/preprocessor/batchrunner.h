@@ -0,0 +1,54 @@
+#ifndef CC_PREPROCESSOR_BATCHRUNNER_H_
+#define CC_PREPROCESSOR_BATCHRUNNER_H_
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "pp_config.h"
+#include "filecache.h"
+#include "includecache.h"
+#include "options.h"
+
+namespace pp {
+
+/**
+ * 複数の翻訳単位をまとめて処理する。
+ *
+ * 翻訳単位ごとに Preprocessorを作り、-jで指定された数のスレッドで並行して処理する。
+ * 出力は出力先ディレクトリに、入力ファイル名の拡張子を .i、.errに変えたファイルで行う。
+ */
+class BatchRunner {
+public:
+    explicit BatchRunner(const Options& opts,
+                         std::shared_ptr<IncludeCache> include_cache = nullptr,
+                         std::shared_ptr<FileCache> file_cache = nullptr);
+    BatchRunner(const BatchRunner&) = delete;
+    ~BatchRunner();
+
+    BatchRunner& operator=(const BatchRunner&) = delete;
+
+    int run();
+
+private:
+    struct TranslationUnit {
+        String input_path;
+        String output_path;
+        String error_log_path;
+    };
+
+    bool prepare();
+    void worker();
+    bool run_translation_unit(const TranslationUnit& tu);
+
+    const Options& opts_;
+    std::shared_ptr<IncludeCache> include_cache_;
+    std::shared_ptr<FileCache> file_cache_;
+    std::vector<TranslationUnit> units_;
+    std::atomic<std::size_t> next_unit_;
+    std::atomic<std::size_t> failed_units_;
+};
+
+}   // namespace pp
+
+#endif  // CC_PREPROCESSOR_BATCHRUNNER_H_
@@ -0,0 +1,76 @@
+#include "dependencies.h"
+
+#include <filesystem>
+#include <ostream>
+
+#include "util/utility.h"
+
+using namespace lib::util;
+using namespace std;
+
+namespace {
+
+/**
+ * makeのルールに書けるようにする。空白と '#'はエスケープし、'$'は重ねる。
+ */
+std::string escape_make_path(std::string_view path) {
+    std::string result;
+    result.reserve(path.size());
+    for (auto c : path) {
+        if (c == ' ' || c == '\t' || c == '#') {
+            result += '\\';
+        } else if (c == '$') {
+            result += '$';
+        }
+        result += c;
+    }
+    return result;
+}
+
+}   // anonymous namespace
+
+namespace pp {
+
+DependencyCollector::DependencyCollector()
+    : paths_()
+    , path_set_() {
+}
+
+DependencyCollector::~DependencyCollector() {
+}
+
+void DependencyCollector::add(const String& path) {
+    auto normalized = internal_string(filesystem::path(path_string(path)).lexically_normal());
+    if (path_set_.insert(normalized).second) {
+        paths_.push_back(move(normalized));
+    }
+}
+
+void DependencyCollector::clear() {
+    paths_.clear();
+    path_set_.clear();
+}
+
+/**
+ * "target: dep1 dep2 ..." の形式で出力する。1行に 1ファイルずつ、行を継続して書く。
+ */
+void DependencyCollector::write_make(std::ostream& output, const String& target) const {
+    output << escape_make_path(as_narrow(target)) << ':';
+    for (const auto& path : paths_) {
+        output << " \\\n  " << escape_make_path(as_narrow(path));
+    }
+    output << '\n';
+}
+
+/**
+ * {"target": "...", "dependencies": ["...", ...]} の形式で出力する。
+ */
+void DependencyCollector::write_json(std::ostream& output, const String& target) const {
+    output << "{\"target\": " << quote_json_string(as_narrow(target)) << ", \"dependencies\": [";
+    for (size_t i = 0; i < paths_.size(); i++) {
+        output << ((i == 0) ? "\n  " : ",\n  ") << quote_json_string(as_narrow(paths_[i]));
+    }
+    output << "\n]}\n";
+}
+
+}   // namespace pp
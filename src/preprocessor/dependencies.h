@@ -0,0 +1,42 @@
+#ifndef CC_PREPROCESSOR_DEPENDENCIES_H_
+#define CC_PREPROCESSOR_DEPENDENCIES_H_
+
+#include <iosfwd>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "pp_config.h"
+
+namespace pp {
+
+/**
+ * 翻訳単位が依存するファイル。(-M、-MD)
+ *
+ * 処理中に読んだファイル (入力ファイル、#include、__has_includeで見つかったファイル、#embedのリソース)を、
+ * 見つかった順に重複無く集める。パスは正規化してから比べる。
+ */
+class DependencyCollector {
+public:
+    DependencyCollector();
+    DependencyCollector(const DependencyCollector&) = delete;
+    ~DependencyCollector();
+
+    DependencyCollector& operator=(const DependencyCollector&) = delete;
+
+    const std::vector<String>& paths() const { return paths_; }
+
+    void add(const String& path);
+    void clear();
+
+    void write_make(std::ostream& output, const String& target) const;
+    void write_json(std::ostream& output, const String& target) const;
+
+private:
+    std::vector<String> paths_;
+    std::unordered_set<String> path_set_;
+};
+
+}   // namespace pp
+
+#endif  // CC_PREPROCESSOR_DEPENDENCIES_H_
@@ -1,7 +1,9 @@
 #include "diagnostics.h"
 
+#include <algorithm>
 #include <format>
 #include <iostream>
+#include <iterator>
 
 #include "util/utility.h"
 #include "input.h"
@@ -19,6 +21,71 @@ const char* const kLevelTag[] = {
     "致命的エラー",
 };
 
+//  JSON Lines、SARIFでのレベルの名前。
+const char* const kLevelName[] = {
+    "debug",
+    "info",
+    "warning",
+    "error",
+    "fatal",
+};
+
+const char* const kSarifLevel[] = {
+    "note",
+    "note",
+    "warning",
+    "error",
+    "error",
+};
+
+const char* const kCategoryName[] = {
+    "general",
+    "macro",
+    "expression",
+    "directive",
+    "limit",
+    "embed",
+    "lexical",
+    "reserved-identifier",
+};
+
+const char* const kSarifHeader =
+    "{\"$schema\": \"https://json.schemastore.org/sarif-2.1.0.json\", \"version\": \"2.1.0\", \"runs\": [\n"
+    "{\"tool\": {\"driver\": {\"name\": \"cpp\"}}, \"results\": [\n";
+const char* const kSarifFooter = "\n]}\n]}\n";
+
+/**
+ * 書式の {}を順に引数で置き換える。{{と }}はそれぞれ 1文字にする。書式指定は無視する。
+ */
+std::string substitute_arguments(std::string_view format, const std::vector<std::string_view>& args) {
+    std::string result;
+    result.reserve(format.size() + 32);
+    std::size_t next_arg = 0;
+    for (std::size_t i = 0; i < format.size(); i++) {
+        const char c = format[i];
+        if (c == '{' && i + 1 < format.size() && format[i + 1] == '{') {
+            result += '{';
+            i++;
+        } else if (c == '}' && i + 1 < format.size() && format[i + 1] == '}') {
+            result += '}';
+            i++;
+        } else if (c == '{') {
+            auto close = format.find('}', i);
+            if (close == std::string_view::npos) {
+                result += format.substr(i);
+                break;
+            }
+            if (next_arg < args.size()) {
+                result += args[next_arg++];
+            }
+            i = close;
+        } else {
+            result += c;
+        }
+    }
+    return result;
+}
+
 }   // namespace
 
 namespace pp {
@@ -60,6 +127,7 @@ const StringView kSameMacroParameterIdError = T_("マクロの仮引数の識別
 const StringView kBadMacroArgumentError = T_("マクロの引数リストが閉じていない。");
 const StringView kUnmatchedNumberOfArguments = T_("マクロに渡された引数の数({})が仮引数の数({})と合わない。");
 const StringView kVaArgsRequiresAtLeastOneArgument = T_("可変引数は少なくとも 1つの引数を必要とする。");
+const StringView kMacroExpansionTooDeepError = T_("マクロ {}の呼び出しの入れ子が {}段を超えたので展開しない。");
 
 const StringView kInvalidConstantExpressionError = T_("整数定数式でなければならない。");
 const StringView kConstantNumberIsNotAIntegerError = T_("{}は整数ではないか、ここでは取り扱えない。");
@@ -111,6 +179,131 @@ const StringView kEmptyCharacterConstant = T_("文字定数が空である。");
 const StringView kUnclosedCharacterConstant = T_("文字定数が閉じていない。");
 const StringView kUnclosedStringLiteral = T_("文字列リテラルが閉じていない。");
 
+const StringView kIncludeFileNotFoundError = T_("ファイルが開けない: {}");
+
+const StringView kSuppressedMessagesInfo = T_("この後、同じメッセージを {}件省略した。");
+
+namespace {
+
+struct MessageInfoEntry {
+    const StringView* message;
+    DiagMessageInfo info;
+};
+
+/**
+ * メッセージの番号。番号は一度割り当てたら変えない。メッセージを削除したら、その番号は使わない。
+ */
+const MessageInfoEntry kMessageInfo[] = {
+    { &kPredefinedMacroNameError,                       { 1001, DiagCategory::kMacro } },
+    { &kMacroRedefinitionWarning,                       { 1002, DiagCategory::kMacro } },
+    { &kFuncTypeMacroUsageWarning,                      { 1003, DiagCategory::kMacro } },
+    { &kMustBeMacroName,                                { 1004, DiagCategory::kMacro } },
+    { &kUndefineNondefinedMacroWarning,                 { 1005, DiagCategory::kMacro } },
+    { &kOpPragmaUsedAsMacroName,                        { 1006, DiagCategory::kMacro } },
+    { &kOpPragmaParameterTypeMismatch,                  { 1007, DiagCategory::kMacro } },
+    { &kVaArgsIdentifierUsageError,                     { 1008, DiagCategory::kMacro } },
+    { &kVaOptIdentifierUsageError,                      { 1009, DiagCategory::kMacro } },
+    { &kOpStringizeNeedsParameterError,                 { 1010, DiagCategory::kMacro } },
+    { &kOpConcatNeedsParameterError,                    { 1011, DiagCategory::kMacro } },
+    { &kGeneratedInvalidPpTokenError,                   { 1012, DiagCategory::kMacro } },
+    { &kGeneratedInvalidPpTokenError2,                  { 1013, DiagCategory::kMacro } },
+    { &kBadElipsisError,                                { 1014, DiagCategory::kMacro } },
+    { &kBadMacroParameterFormError,                     { 1015, DiagCategory::kMacro } },
+    { &kSameMacroParameterIdError,                      { 1016, DiagCategory::kMacro } },
+    { &kBadMacroArgumentError,                          { 1017, DiagCategory::kMacro } },
+    { &kUnmatchedNumberOfArguments,                     { 1018, DiagCategory::kMacro } },
+    { &kVaArgsRequiresAtLeastOneArgument,               { 1019, DiagCategory::kMacro } },
+    { &kMacroExpansionTooDeepError,                     { 1020, DiagCategory::kMacro } },
+    { &kInvalidMacroName,                               { 1021, DiagCategory::kMacro } },
+    { &kStdcReservedMacroName,                          { 1022, DiagCategory::kMacro } },
+
+    { &kInvalidConstantExpressionError,                 { 2001, DiagCategory::kExpression } },
+    { &kConstantNumberIsNotAIntegerError,               { 2002, DiagCategory::kExpression } },
+    { &kInvalidOperatorError,                           { 2003, DiagCategory::kExpression } },
+    { &kIntegerConstantOutOfRangeError,                 { 2004, DiagCategory::kExpression } },
+    { &kIntegerConstantFormatError,                     { 2005, DiagCategory::kExpression } },
+    { &kDivideByZeroError,                              { 2006, DiagCategory::kExpression } },
+    { &kIdsAreEvaluatedToZero,                          { 2007, DiagCategory::kExpression } },
+    { &kUnclosedBracketError,                           { 2008, DiagCategory::kExpression } },
+    { &kConditionalInclusionOperatorUsageError,         { 2009, DiagCategory::kExpression } },
+    { &kOpHasCAttributeIdentifierUsageError,            { 2010, DiagCategory::kExpression } },
+    { &kOpHasCAttributeNeedsAnAttribute,                { 2011, DiagCategory::kExpression } },
+    { &kOpHasIncludeIdentifierUsageError,               { 2012, DiagCategory::kExpression } },
+    { &kOpHasIncludeParameterTypeMismatchError,         { 2013, DiagCategory::kExpression } },
+    { &kOpHasEmbedParameterTypeMismatchError,           { 2014, DiagCategory::kExpression } },
+
+    { &kNoCorrespondingIfError,                         { 3001, DiagCategory::kDirective } },
+    { &kUnterminatedIfError,                            { 3002, DiagCategory::kDirective } },
+    { &kElifGroupAfterElseError,                        { 3003, DiagCategory::kDirective } },
+    { &kRedundantTokens,                                { 3004, DiagCategory::kDirective } },
+    { &kInvalidHeaderName,                              { 3005, DiagCategory::kDirective } },
+    { &kPragmaIsIgnoredWarning,                         { 3006, DiagCategory::kDirective } },
+    { &kNoIdentifierSpecifiedError,                     { 3007, DiagCategory::kDirective } },
+    { &kLineNeedsDecimalConstantError,                  { 3008, DiagCategory::kDirective } },
+    { &kLineOutOfRangeError,                            { 3009, DiagCategory::kDirective } },
+    { &kIncludeFileNotFoundError,                       { 3010, DiagCategory::kDirective } },
+
+    { &kMinSpecSourceFileInclusionWarning,              { 4001, DiagCategory::kLimit } },
+    { &kMinSpecConditionalInclusionWarning,             { 4002, DiagCategory::kLimit } },
+    { &kMinSpecMacroParametersWarning,                  { 4003, DiagCategory::kLimit } },
+    { &kMinSpecMacroArgumentsWarning,                   { 4004, DiagCategory::kLimit } },
+
+    { &kNoEmbedResourceIdentifierError,                 { 5001, DiagCategory::kEmbed } },
+    { &kEmbedResoruceNotFoundError,                     { 5002, DiagCategory::kEmbed } },
+    { &kEmbedResoruceOpeningFailureError,               { 5003, DiagCategory::kEmbed } },
+    { &kEmbedResoruceReadingFailureError,               { 5004, DiagCategory::kEmbed } },
+    { &kEmbedUsingDefinedInLimitParameterError,         { 5005, DiagCategory::kEmbed } },
+    { &kEmbedLimitParameterLessThan0Error,              { 5006, DiagCategory::kEmbed } },
+    { &kEmbedResourceWidthCanBeDividedByEmbedElementWidth, { 5007, DiagCategory::kEmbed } },
+    { &kBadEmbedParameterError,                         { 5008, DiagCategory::kEmbed } },
+    { &kBadPrefixedEmbedParameterError,                 { 5009, DiagCategory::kEmbed } },
+    { &kSameEmbedParameterSpecifiedError,               { 5010, DiagCategory::kEmbed } },
+    { &kEmbedParameterClauseUnspecifiedError,           { 5011, DiagCategory::kEmbed } },
+
+    { &kUnknownEscapeSequenceWarning,                   { 6001, DiagCategory::kLexical } },
+    { &kInvalidHexadecimalEscapeSequenceFormatError,    { 6002, DiagCategory::kLexical } },
+    { &kInvalidUniversalCharacterNameCodePointError,    { 6003, DiagCategory::kLexical } },
+    { &kInvalidUniversalCharacterNameFormatError,       { 6004, DiagCategory::kLexical } },
+    { &kInvalidIdentifierStartError,                    { 6005, DiagCategory::kLexical } },
+    { &kInvalidIdentifierContinueError,                 { 6006, DiagCategory::kLexical } },
+    { &kUnclosedHeaderNameError,                        { 6007, DiagCategory::kLexical } },
+    { &kEmptyCharacterConstant,                         { 6008, DiagCategory::kLexical } },
+    { &kUnclosedCharacterConstant,                      { 6009, DiagCategory::kLexical } },
+    { &kUnclosedStringLiteral,                          { 6010, DiagCategory::kLexical } },
+
+    { &kStdcReservedIdentifierDoubleUnderscore,         { 7001, DiagCategory::kReservedIdentifier } },
+    { &kStdcReservedIdentifierUnderscoreAndUppercase,   { 7002, DiagCategory::kReservedIdentifier } },
+    { &kStdcReservedIdentifierUnderscore,               { 7003, DiagCategory::kReservedIdentifier } },
+    { &kStdcReservedIdentifierE,                        { 7004, DiagCategory::kReservedIdentifier } },
+    { &kStdcReservedIdentifierFe,                       { 7005, DiagCategory::kReservedIdentifier } },
+    { &kStdcReservedIdentifierPriScn,                   { 7006, DiagCategory::kReservedIdentifier } },
+    { &kStdcReservedIdentifierLc,                       { 7007, DiagCategory::kReservedIdentifier } },
+    { &kStdcReservedIdentifierSig,                      { 7008, DiagCategory::kReservedIdentifier } },
+    { &kStdcReservedIdentifierAtomic,                   { 7009, DiagCategory::kReservedIdentifier } },
+    { &kStdcReservedIdentifierIntMax,                   { 7010, DiagCategory::kReservedIdentifier } },
+    { &kStdcReservedIdentifierTime,                     { 7011, DiagCategory::kReservedIdentifier } },
+
+    { &kSuppressedMessagesInfo,                         { 9001, DiagCategory::kGeneral } },
+};
+
+}   // namespace
+
+/**
+ * メッセージの番号と分類を返す。メッセージは定数なので、文字列の位置で探す。
+ */
+DiagMessageInfo find_message_info(StringView message) {
+    for (const auto& entry : kMessageInfo) {
+        if (entry.message->data() == message.data()) {
+            return entry.info;
+        }
+    }
+    return { 0, DiagCategory::kGeneral };
+}
+
+const char* category_name(DiagCategory category) {
+    return kCategoryName[enum_ordinal(category)];
+}
+
 
 Location Location::from_source(SourceFile* source, const Token& token) {
     uint32_t l;
@@ -135,17 +328,72 @@ Location Location::from_source(SourceFile* source, const Token& token) {
 
 Diagnostics::Diagnostics()
     : output_()
+    , handler_()
+    , exit_on_fatal_error_(false)
     , warning_count_()
-    , error_count_() {
+    , error_count_()
+    , message_limit_()
+    , format_(DiagnosticFormat::kText)
+    , sarif_started_()
+    , sarif_results_()
+    , records_()
+    , arguments_()
+    , argument_ends_()
+    , messages_()
+    , message_ids_()
+    , paths_()
+    , path_ids_()
+    , reported_() {
 }
 
 Diagnostics::~Diagnostics() {
+    try {
+        end_output();
+    } catch (...) {
+        // IGNORE
+    }
 }
 
+/**
+ * 出力先を変える。それまでに記録したメッセージは、前の出力先に出力する。
+ */
 void Diagnostics::set_output(std::ostream* output) {
+    end_output();
     output_ = output;
 }
 
+/**
+ * 診断メッセージを、テキストで出力する代わりに handlerに渡す。
+ */
+void Diagnostics::set_handler(DiagnosticHandler handler) {
+    finish();
+    handler_ = move(handler);
+}
+
+/**
+ * 致命的エラーでプロセスを終了するか。しない場合は FatalErrorを送出する。(デフォルトは終了しない)
+ *
+ * 終了しなければ、Preprocessor::run()が FatalErrorを受け取って翻訳単位の処理をやめる。
+ * 同じプロセスで続けて他の翻訳単位を処理できる。
+ */
+void Diagnostics::exit_on_fatal_error(bool value) {
+    exit_on_fatal_error_ = value;
+}
+
+/**
+ * 同じ書式のメッセージを出力する数の上限。0は無制限。(デフォルトは無制限)
+ */
+void Diagnostics::message_limit(std::size_t value) {
+    message_limit_ = value;
+}
+
+/**
+ * テキストで出力するときの形式。(デフォルトは kText)
+ */
+void Diagnostics::format(DiagnosticFormat value) {
+    format_ = value;
+}
+
 int Diagnostics::warning_count() const {
     return warning_count_;
 }
@@ -154,35 +402,243 @@ int Diagnostics::error_count() const {
     return error_count_;
 }
 
-void Diagnostics::output_diagnostic(
+/**
+ * 記録したメッセージを出力する。
+ */
+void Diagnostics::flush() {
+    write_records();
+    if (output_) {
+        output_->flush();
+    }
+}
+
+void Diagnostics::add_record(
         DiagLevel level,
         SourceFile* source, const Location& location,
-        StringView format, const std::format_args& args) {
-    if (!output_) {
+        StringView message, std::uint32_t first_argument) {
+    if (level < kMinDiagLevel || level > kMaxDiagLevel) {
+        discard_arguments(first_argument);
+        throw invalid_argument("level");
+    }
+    if (!handler_ && !output_) {
+        discard_arguments(first_argument);
         throw runtime_error(__func__);
     }
 
-    if (level < kMinDiagLevel || level > kMaxDiagLevel) {
-        throw invalid_argument("level");
+    PendingDiagnostic record{
+        level,
+        message_id(message),
+        path_id(source),
+        location.line(), location.column(),
+        first_argument,
+        static_cast<std::uint32_t>(argument_ends_.size() - first_argument) };
+
+    //  同じメッセージは出力しない。位置が分からない (0行目)ものは同じかどうか分からないので全て出力する。
+    if (record.line != 0) {
+        const auto arguments_begin = (first_argument == 0) ? 0 : argument_ends_[first_argument - 1];
+        std::string key = std::format("{}:{}:{}:{}:", record.message_id, record.path_id, record.line, record.column);
+        for (auto i = first_argument; i < argument_ends_.size(); i++) {
+            key += std::to_string(argument_ends_[i] - arguments_begin);
+            key += ':';
+        }
+        key.append(arguments_, arguments_begin);
+        if (!reported_.insert(move(key)).second) {
+            discard_arguments(first_argument);
+            return;
+        }
+    }
+
+    auto& state = messages_[record.message_id];
+    if (message_limit_ != 0 && state.count >= message_limit_ && level != DiagLevel::kFatalError) {
+        if (state.suppressed_count++ == 0) {
+            state.suppressed_path_id = record.path_id;
+            state.suppressed_line = record.line;
+            state.suppressed_column = record.column;
+        }
+        discard_arguments(first_argument);
+        return;
+    }
+    ++state.count;
+
+    records_.push_back(record);
+    if (records_.size() >= kFlushThreshold) {
+        flush();
+    }
+}
+
+void Diagnostics::discard_arguments(std::uint32_t first_argument) {
+    arguments_.resize((first_argument == 0) ? 0 : argument_ends_[first_argument - 1]);
+    argument_ends_.resize(first_argument);
+}
+
+/**
+ * 書式ごとの番号。書式は定数なので、文字列の位置で区別する。
+ */
+std::uint32_t Diagnostics::message_id(StringView message) {
+    auto [it, inserted] = message_ids_.insert({ message.data(), static_cast<std::uint32_t>(messages_.size()) });
+    if (inserted) {
+        messages_.push_back(MessageState{ message, find_message_info(message), 0, 0, 0, 0, 0 });
+    }
+    return it->second;
+}
+
+/**
+ * ファイルのパスの番号。パスはファイルごとに 1度だけ複製する。
+ */
+std::uint32_t Diagnostics::path_id(SourceFile* source) {
+    static const String kNoSourcePath(T_("<init>"));
+    const String& path = source ? source->source_path() : kNoSourcePath;
+    auto it = path_ids_.find(path);
+    if (it != path_ids_.end()) {
+        return it->second;
+    }
+    const auto id = static_cast<std::uint32_t>(paths_.size());
+    paths_.push_back(path);
+    path_ids_.insert({ path, id });
+    return id;
+}
+
+std::string Diagnostics::format_message(const PendingDiagnostic& record) const {
+    std::vector<std::string_view> args;
+    args.reserve(record.num_arguments);
+    for (auto i = record.first_argument; i < record.first_argument + record.num_arguments; i++) {
+        const auto begin = (i == 0) ? 0 : argument_ends_[i - 1];
+        args.push_back(std::string_view(arguments_).substr(begin, argument_ends_[i] - begin));
+    }
+    auto message = substitute_arguments(as_narrow(messages_[record.message_id].format), args);
+    //  テキスト以外では、メッセージの末尾の改行は含めない。
+    if (format_ != DiagnosticFormat::kText || handler_) {
+        while (!message.empty() && message.back() == '\n') {
+            message.pop_back();
+        }
+    }
+    return message;
+}
+
+void Diagnostics::write_text(std::string& log, const PendingDiagnostic& record) const {
+    std::format_to(std::back_inserter(log), "{}:{}:{}: {}: {}\n",
+            as_narrow(paths_[record.path_id]), record.line, record.column,
+            kLevelTag[enum_ordinal(record.level)], format_message(record));
+}
+
+void Diagnostics::write_json_line(std::string& log, const PendingDiagnostic& record) const {
+    const auto& info = messages_[record.message_id].info;
+    std::format_to(std::back_inserter(log),
+            "{{\"file\": {}, \"line\": {}, \"column\": {}, \"level\": \"{}\", \"id\": {}, \"category\": \"{}\", \"message\": {}}}\n",
+            quote_json_string(as_narrow(paths_[record.path_id])), record.line, record.column,
+            kLevelName[enum_ordinal(record.level)], info.id, category_name(info.category),
+            quote_json_string(format_message(record)));
+}
+
+/**
+ * SARIFの resultを 1つ書く。位置の分からない (0行目)ものは regionを書かない。
+ */
+void Diagnostics::write_sarif_result(std::string& log, const PendingDiagnostic& record) {
+    if (!sarif_started_) {
+        log += kSarifHeader;
+        sarif_started_ = true;
+    }
+    if (sarif_results_++ > 0) {
+        log += ",\n";
+    }
+
+    const auto& info = messages_[record.message_id].info;
+    std::format_to(std::back_inserter(log),
+            "{{\"ruleId\": \"PP{:04}\", \"level\": \"{}\", \"message\": {{\"text\": {}}}, "
+            "\"locations\": [{{\"physicalLocation\": {{\"artifactLocation\": {{\"uri\": {}}}",
+            info.id, kSarifLevel[enum_ordinal(record.level)], quote_json_string(format_message(record)),
+            quote_json_string(as_narrow(paths_[record.path_id])));
+    if (record.line != 0) {
+        std::format_to(std::back_inserter(log), ", \"region\": {{\"startLine\": {}, \"startColumn\": {}}}",
+                record.line, std::max<std::uint32_t>(record.column, 1));
+    }
+    std::format_to(std::back_inserter(log), "}}}}], \"properties\": {{\"category\": \"{}\"}}}}",
+            category_name(info.category));
+}
+
+/**
+ * 記録したメッセージをまとめて整形し、1度に書き込む。
+ */
+void Diagnostics::write_records() {
+    if (records_.empty()) {
+        return;
+    }
+    if (!handler_ && !output_) {
+        throw runtime_error(__func__);
     }
 
-    string s;
-    if (source) {
-        s = source_from_internal(source->source_path());
+    //  出力中に例外が起きても、同じメッセージを 2度出力しないように、先に取り出しておく。
+    auto records = move(records_);
+    records_.clear();
+
+    if (handler_) {
+        for (const auto& record : records) {
+            //  メッセージの末尾の改行は含めない。
+            const auto& info = messages_[record.message_id].info;
+            handler_(DiagnosticRecord{
+                    record.level,
+                    paths_[record.path_id],
+                    record.line, record.column,
+                    internal_from_source(format_message(record)),
+                    info.id, info.category });
+        }
     } else {
-        s = source_from_internal(T_("<init>"));
+        std::string log;
+        for (const auto& record : records) {
+            switch (format_) {
+            case DiagnosticFormat::kText:       write_text(log, record); break;
+            case DiagnosticFormat::kJsonLines:  write_json_line(log, record); break;
+            case DiagnosticFormat::kSarif:      write_sarif_result(log, record); break;
+            }
+        }
+        output_->write(log.data(), log.size());
     }
 
-    auto i = enum_ordinal(level);
+    arguments_.clear();
+    argument_ends_.clear();
+}
 
-    //ErrorOutputIterator it(*error_output_);
-    //format_to(it, "{}:{}:{}: {}: ", s, l, c, kLevelTag[i]);
-    //vformat_to(it, format, args);
-    //format_to(it, "\n");
-    auto log = std::format("{}:{}:{}: {}: {}\n",
-            s, location.line(), location.column(), kLevelTag[i], vformat(as_narrow(format), args));
+/**
+ * 記録したメッセージと、上限を超えて出力しなかったメッセージの数を出力する。
+ */
+void Diagnostics::finish() {
+    if (!handler_ && !output_) {
+        return;
+    }
+    const auto summary_id = message_id(kSuppressedMessagesInfo);
+    for (auto& state : messages_) {
+        if (state.suppressed_count == 0) {
+            continue;
+        }
+        records_.push_back(PendingDiagnostic{
+                DiagLevel::kInfo,
+                summary_id,
+                state.suppressed_path_id,
+                state.suppressed_line, state.suppressed_column,
+                static_cast<std::uint32_t>(argument_ends_.size()), 1 });
+        append_argument(state.suppressed_count);
+        state.suppressed_count = 0;
+    }
+    flush();
+}
+
+/**
+ * 今の出力先への出力を終える。SARIFでは、メッセージが無くても文書を書く。
+ */
+void Diagnostics::end_output() {
+    finish();
+    if (handler_ || !output_ || format_ != DiagnosticFormat::kSarif) {
+        return;
+    }
+    std::string log;
+    if (!sarif_started_) {
+        log += kSarifHeader;
+    }
+    log += kSarifFooter;
     output_->write(log.data(), log.size());
     output_->flush();
+    sarif_started_ = false;
+    sarif_results_ = 0;
 }
 
 
@@ -4,7 +4,14 @@
 #include <cinttypes>
 #include <cstdint>
 #include <cstdio>
+#include <functional>
+#include <format>
 #include <iosfwd>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "util/utility.h"
 
@@ -26,6 +33,43 @@ enum class DiagLevel {
 constexpr auto kMinDiagLevel = DiagLevel::kDebug;
 constexpr auto kMaxDiagLevel = DiagLevel::kFatalError;
 
+/**
+ * 診断メッセージの分類。
+ */
+enum class DiagCategory {
+    kGeneral,
+    kMacro,
+    kExpression,
+    kDirective,
+    kLimit,
+    kEmbed,
+    kLexical,
+    kReservedIdentifier,
+};
+
+/**
+ * 診断メッセージの番号と分類。番号はメッセージの文言が変わっても変えない。(0は番号の無いメッセージ)
+ */
+struct DiagMessageInfo {
+    std::uint32_t id;
+    DiagCategory category;
+};
+
+DiagMessageInfo find_message_info(StringView message);
+const char* category_name(DiagCategory category);
+
+/**
+ * 診断メッセージの出力の形式。
+ */
+enum class DiagnosticFormat {
+    // file:line:column: level: message
+    kText,
+    // 1行に 1つの JSON
+    kJsonLines,
+    // SARIF 2.1.0
+    kSarif,
+};
+
 extern const StringView kPredefinedMacroNameError;
 extern const StringView kMacroRedefinitionWarning;
 extern const StringView kFuncTypeMacroUsageWarning;
@@ -63,6 +107,7 @@ extern const StringView kSameMacroParameterIdError;
 extern const StringView kBadMacroArgumentError;
 extern const StringView kUnmatchedNumberOfArguments;
 extern const StringView kVaArgsRequiresAtLeastOneArgument;
+extern const StringView kMacroExpansionTooDeepError;
 
 extern const StringView kInvalidConstantExpressionError;
 extern const StringView kConstantNumberIsNotAIntegerError;
@@ -119,6 +164,9 @@ extern const StringView kUnclosedHeaderNameError;
 extern const StringView kEmptyCharacterConstant;
 extern const StringView kUnclosedCharacterConstant;
 extern const StringView kUnclosedStringLiteral;
+extern const StringView kIncludeFileNotFoundError;
+
+extern const StringView kSuppressedMessagesInfo;
 
 /**
  */
@@ -148,6 +196,39 @@ private:
 };
 
 /**
+ * 1つの診断メッセージ。
+ */
+struct DiagnosticRecord {
+    DiagLevel level;
+    String path;
+    std::uint32_t line;
+    std::uint32_t column;
+    String message;
+    std::uint32_t id = 0;
+    DiagCategory category = DiagCategory::kGeneral;
+};
+
+using DiagnosticHandler = std::function<void (const DiagnosticRecord&)>;
+
+/**
+ * 致命的エラーでプロセスを終了しないときに送出する。
+ */
+class FatalError
+    : public std::runtime_error {
+public:
+    FatalError()
+        : std::runtime_error("fatal error") {
+    }
+};
+
+/**
+ * 診断メッセージ。
+ *
+ * メッセージはすぐには整形せず、レベル、メッセージの書式、位置と、文字列にした引数を記録しておき、
+ * まとめて整形して出力する。出力するのは、記録が一定の数を超えたとき、致命的エラーのとき、
+ * 出力先を切り替えるとき (終了時を含む)。
+ * 同じ書式、位置、引数のメッセージは 1度だけ出力する。書式ごとに出力する数の上限を指定できる。
+ * JSON Lines、SARIFの形式では、メッセージの番号と分類も出力する。SARIFの文書は出力先を切り替えるときに閉じる。
  */
 class Diagnostics {
 public:
@@ -158,48 +239,125 @@ public:
     Diagnostics& operator=(const Diagnostics&) = delete;
 
     void set_output(std::ostream* output);
+    void set_handler(DiagnosticHandler handler);
+    bool has_handler() const { return static_cast<bool>(handler_); }
+    void exit_on_fatal_error(bool value);
+    void message_limit(std::size_t value);
+    void format(DiagnosticFormat value);
+    void flush();
 
     int warning_count() const;
     int error_count() const;
 
     template <class... Args>
     void debug(SourceFile* source, const Location& location, StringView message, Args... args) {
-        output_diagnostic(DiagLevel::kDebug, source, location, message, std::make_format_args(args...));
+        report(DiagLevel::kDebug, source, location, message, args...);
     }
 
     template <class... Args>
     void info(SourceFile* source, const Location& location, StringView message, Args... args) {
-        output_diagnostic(DiagLevel::kInfo, source, location, message, std::make_format_args(args...));
+        report(DiagLevel::kInfo, source, location, message, args...);
     }
 
     template <class... Args>
     void warning(SourceFile* source, const Location& location, StringView message, Args... args) {
-        output_diagnostic(DiagLevel::kWarning, source, location, message, std::make_format_args(args...));
+        report(DiagLevel::kWarning, source, location, message, args...);
         ++warning_count_;
     }
 
     template <class... Args>
     void error(SourceFile* source, const Location& location, StringView message, Args... args) {
-        output_diagnostic(DiagLevel::kError, source, location, message, std::make_format_args(args...));
+        report(DiagLevel::kError, source, location, message, args...);
         ++error_count_;
     }
 
     template <class... Args>
     [[noreturn]]
     void fatal_error(SourceFile* source, const Location& location, StringView message, Args... args) {
-        output_diagnostic(DiagLevel::kFatalError, source, location, message, std::make_format_args(args...));
-        std::exit(EXIT_FAILURE);
+        report(DiagLevel::kFatalError, source, location, message, args...);
+        if (exit_on_fatal_error_) {
+            end_output();
+            std::exit(EXIT_FAILURE);
+        }
+        finish();
+        ++error_count_;
+        throw FatalError();
     }
 
 private:
-    void output_diagnostic(
-            DiagLevel tag,
-            SourceFile* source, const Location& location,
-            StringView format, const std::format_args& args);
+    //  これ以上記録が溜まったら出力する。
+    static constexpr std::size_t kFlushThreshold = 256;
+
+    /**
+     * 出力を待っているメッセージ。引数は arguments_の [first_argument, first_argument + num_arguments)。
+     */
+    struct PendingDiagnostic {
+        DiagLevel level;
+        std::uint32_t message_id;
+        std::uint32_t path_id;
+        std::uint32_t line;
+        std::uint32_t column;
+        std::uint32_t first_argument;
+        std::uint32_t num_arguments;
+    };
+
+    /**
+     * 書式ごとの状態。上限を超えて出力しなかったときは、最初に出力しなかった位置に件数を報告する。
+     */
+    struct MessageState {
+        StringView format;
+        DiagMessageInfo info;
+        std::size_t count;
+        std::size_t suppressed_count;
+        std::uint32_t suppressed_path_id;
+        std::uint32_t suppressed_line;
+        std::uint32_t suppressed_column;
+    };
+
+    template <class... Args>
+    void report(DiagLevel level, SourceFile* source, const Location& location, StringView message, const Args&... args) {
+        const auto first_argument = static_cast<std::uint32_t>(argument_ends_.size());
+        (append_argument(args), ...);
+        add_record(level, source, location, message, first_argument);
+    }
+
+    template <class T>
+    void append_argument(const T& value) {
+        arguments_ += std::vformat("{}", std::make_format_args(value));
+        argument_ends_.push_back(static_cast<std::uint32_t>(arguments_.size()));
+    }
+
+    void add_record(DiagLevel level, SourceFile* source, const Location& location, StringView message, std::uint32_t first_argument);
+    void discard_arguments(std::uint32_t first_argument);
+    std::uint32_t message_id(StringView message);
+    std::uint32_t path_id(SourceFile* source);
+    std::string format_message(const PendingDiagnostic& record) const;
+    void write_text(std::string& log, const PendingDiagnostic& record) const;
+    void write_json_line(std::string& log, const PendingDiagnostic& record) const;
+    void write_sarif_result(std::string& log, const PendingDiagnostic& record);
+    void write_records();
+    void finish();
+    void end_output();
 
     std::ostream* output_;
+    DiagnosticHandler handler_;
+    bool exit_on_fatal_error_;
     int warning_count_;
     int error_count_;
+    std::size_t message_limit_;
+    DiagnosticFormat format_;
+    // SARIFの文書の先頭を書いたか。書いた後の結果には前に ","を付ける。
+    bool sarif_started_;
+    std::size_t sarif_results_;
+    std::vector<PendingDiagnostic> records_;
+    // 引数を文字列にしてつなげたものと、それぞれの終わりの位置。
+    std::string arguments_;
+    std::vector<std::uint32_t> argument_ends_;
+    std::vector<MessageState> messages_;
+    std::unordered_map<const void*, std::uint32_t> message_ids_;
+    std::vector<String> paths_;
+    std::unordered_map<String, std::uint32_t> path_ids_;
+    std::unordered_set<std::string> reported_;
 };
 
 }   // namespace pp
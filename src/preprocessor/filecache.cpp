@@ -0,0 +1,159 @@
+#include "filecache.h"
+
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+#include "util/utility.h"
+
+using namespace lib::util;
+using namespace std;
+
+namespace {
+
+/**
+ * ファイルの内容を全て読み込む。開けなかったら nullptrを返す。
+ */
+pp::FileSystem::Buffer read_file(const Path& path, uintmax_t size_hint) {
+    ifstream input(path, ios_base::binary);
+    if (!input.is_open()) {
+        return nullptr;
+    }
+
+    auto content = make_shared<string>();
+    content->resize(static_cast<size_t>(size_hint));
+    input.read(content->data(), ssize(*content));
+    content->resize(static_cast<size_t>(input.gcount()));
+
+    //  サイズを調べてから読むまでの間に伸びたかもしれないので、残りも読む。
+    if (!input.eof() && !input.bad()) {
+        ostringstream rest;
+        rest << input.rdbuf();
+        *content += rest.str();
+    }
+    if (input.bad()) {
+        return nullptr;
+    }
+
+    return content;
+}
+
+}   // anonymous namespace
+
+namespace pp {
+
+FileSystem::~FileSystem() {
+}
+
+
+FileCache::FileCache(std::size_t capacity_in_bytes)
+    : mutex_()
+    , entries_()
+    , lru_()
+    , capacity_in_bytes_(capacity_in_bytes)
+    , size_in_bytes_()
+    , hits_()
+    , misses_() {
+}
+
+FileCache::~FileCache() {
+}
+
+std::size_t FileCache::size_in_bytes() const {
+    lock_guard lock(mutex_);
+    return size_in_bytes_;
+}
+
+bool FileCache::exists(const String& path) {
+    return file_exists(path_string(path));
+}
+
+/**
+ * ファイルの内容を返す。開けなかったら nullptrを返す。
+ */
+FileCache::Buffer FileCache::load(const String& path) {
+    const Path& native_path = path_string(path);
+
+    error_code ec;
+    auto last_write_time = filesystem::last_write_time(native_path, ec);
+    if (ec) {
+        return nullptr;
+    }
+    auto file_size = filesystem::file_size(native_path, ec);
+    if (ec) {
+        return nullptr;
+    }
+    //  "a/../b.h"と "b.h"、シンボリックリンクとその先を同じファイルとして扱う。
+    auto key = filesystem::canonical(native_path, ec).native();
+    if (ec) {
+        return nullptr;
+    }
+
+    {
+        lock_guard lock(mutex_);
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            auto& entry = it->second;
+            if (entry.last_write_time == last_write_time && entry.file_size == file_size) {
+                lru_.splice(lru_.begin(), lru_, entry.lru_position);
+                ++hits_;
+                return entry.buffer;
+            }
+
+            //  更新されているので捨てる。
+            size_in_bytes_ -= entry.buffer->size();
+            lru_.erase(entry.lru_position);
+            entries_.erase(it);
+        }
+    }
+
+    //  ファイルの読み込みはロックの外で行う。同じファイルを同時に読むことも有るが、結果は同じ。
+    ++misses_;
+    Buffer buffer = read_file(native_path, file_size);
+    if (!buffer) {
+        return nullptr;
+    }
+
+    if (buffer->size() <= capacity_in_bytes_) {
+        lock_guard lock(mutex_);
+        if (entries_.find(key) == entries_.end()) {
+            lru_.push_front(key);
+            entries_.insert({ key, Entry{ buffer, last_write_time, file_size, lru_.begin() } });
+            size_in_bytes_ += buffer->size();
+            evict();
+        }
+    }
+
+    return buffer;
+}
+
+/**
+ * 上限に収まるまで、最も長く使われていないものから捨てる。
+ */
+void FileCache::evict() {
+    while (size_in_bytes_ > capacity_in_bytes_ && !lru_.empty()) {
+        auto it = entries_.find(lru_.back());
+        size_in_bytes_ -= it->second.buffer->size();
+        entries_.erase(it);
+        lru_.pop_back();
+    }
+}
+
+
+BufferInputStream::StreamBuf::StreamBuf(const char* data, std::size_t size) {
+    //  読み込みしかしないので、const_castしても書き換えられることは無い。
+    char* p = const_cast<char*>(data);
+    setg(p, p, p + size);
+}
+
+BufferInputStream::BufferInputStream(FileSystem::Buffer buffer)
+    : std::istream(nullptr)
+    , buffer_(std::move(buffer))
+    , streambuf_(buffer_->data(), buffer_->size()) {
+    rdbuf(&streambuf_);
+}
+
+BufferInputStream::~BufferInputStream() {
+}
+
+}   // namespace pp
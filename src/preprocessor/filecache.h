@@ -0,0 +1,112 @@
+#ifndef CC_PREPROCESSOR_FILECACHE_H_
+#define CC_PREPROCESSOR_FILECACHE_H_
+
+#include <atomic>
+#include <filesystem>
+#include <istream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <unordered_map>
+
+#include "pp_config.h"
+
+namespace pp {
+
+/**
+ * ソースファイルの読み込み方。
+ *
+ * 通常は FileCacheでディスクから読み込むが、ライブラリとして使う場合は、これを実装して
+ * ディスク以外からも読み込ませることができる。
+ */
+class FileSystem {
+public:
+    using Buffer = std::shared_ptr<const std::string>;
+
+    virtual ~FileSystem();
+
+    virtual bool exists(const String& path) = 0;
+
+    /**
+     * ファイルの内容を返す。読み込めなかったら nullptrを返す。
+     */
+    virtual Buffer load(const String& path) = 0;
+};
+
+/**
+ * ソースファイルの内容のキャッシュ。
+ *
+ * 内容は読み込み専用のバッファーとして参照カウントで共有するので、キャッシュから追い出されても
+ * 使用中のバッファーはそのまま使える。複数の翻訳単位を並行して処理するときにも共有するので、
+ * スレッドセーフにしてある。
+ *
+ * ファイルは正規化した絶対パス (シンボリックリンク、"."、".."を解決したもの)で識別するので、
+ * 別の書き方のパスで同じファイルを読んでも 1つの内容を共有する。更新日時とサイズが変わっていたら読み直す。
+ * 保持する内容の合計が上限を超えたら、最も長く使われていないものから捨てる。
+ */
+class FileCache
+    : public FileSystem {
+public:
+    explicit FileCache(std::size_t capacity_in_bytes);
+    FileCache(const FileCache&) = delete;
+    virtual ~FileCache() override;
+
+    FileCache& operator=(const FileCache&) = delete;
+
+    virtual bool exists(const String& path) override;
+    virtual Buffer load(const String& path) override;
+
+    std::size_t capacity_in_bytes() const { return capacity_in_bytes_; }
+    std::size_t size_in_bytes() const;
+    std::uint64_t hits() const { return hits_; }
+    std::uint64_t misses() const { return misses_; }
+
+private:
+    struct Entry {
+        Buffer buffer;
+        std::filesystem::file_time_type last_write_time;
+        std::uintmax_t file_size;
+        std::list<std::filesystem::path::string_type>::iterator lru_position;
+    };
+
+    void evict();
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::filesystem::path::string_type, Entry> entries_;
+    std::list<std::filesystem::path::string_type> lru_;
+    std::size_t capacity_in_bytes_;
+    std::size_t size_in_bytes_;
+    std::atomic<std::uint64_t> hits_;
+    std::atomic<std::uint64_t> misses_;
+};
+
+/**
+ * FileSystemのバッファーを、コピーせずに istreamとして読むためのもの。
+ *
+ * バッファーの参照を持っておくので、読み終わるまでバッファーが解放されることは無い。
+ */
+class BufferInputStream
+    : public std::istream {
+public:
+    explicit BufferInputStream(FileSystem::Buffer buffer);
+    BufferInputStream(const BufferInputStream&) = delete;
+    virtual ~BufferInputStream() override;
+
+    BufferInputStream& operator=(const BufferInputStream&) = delete;
+
+private:
+    class StreamBuf
+        : public std::streambuf {
+    public:
+        StreamBuf(const char* data, std::size_t size);
+    };
+
+    FileSystem::Buffer buffer_;
+    StreamBuf streambuf_;
+};
+
+}   // namespace pp
+
+#endif  // CC_PREPROCESSOR_FILECACHE_H_
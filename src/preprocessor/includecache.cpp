@@ -0,0 +1,147 @@
+#include "includecache.h"
+
+#include <algorithm>
+#include <mutex>
+
+using namespace lib::util;
+using namespace std;
+
+namespace pp {
+
+IncludeCache::IncludeCache(bool revalidate)
+    : revalidate_(revalidate)
+    , mutex_()
+    , search_path_ids_()
+    , resolutions_()
+    , include_guards_()
+    , hits_()
+    , misses_() {
+}
+
+IncludeCache::~IncludeCache() {
+}
+
+/**
+ * インクルードパスの並びの識別子を返す。同じ並びには同じ識別子を返す。
+ */
+std::size_t IncludeCache::search_path_id(const std::vector<IncludeDir>& include_dirs) {
+    String search_path;
+    for (const auto& dir : include_dirs) {
+        search_path += IncludeDir::type_string(dir.type());
+        search_path += T_(':');
+        search_path += dir.path();
+        search_path += T_('\n');
+    }
+
+    unique_lock lock(mutex_);
+
+    auto it = search_path_ids_.insert({ search_path, search_path_ids_.size() }).first;
+    return it->second;
+}
+
+// static
+String IncludeCache::resolution_key(std::size_t search_path_id, const String& header_name, bool double_quoted, const String& source_dir) {
+    // ダブルクオート形式は、インクルードしたファイルのディレクトリからも探すので、それも含める。
+    auto id = std::to_string(search_path_id);
+    String key(id.begin(), id.end());
+    if (double_quoted) {
+        key.reserve(key.length() + source_dir.length() + 1 + header_name.length());
+        key += T_('|');
+        key += source_dir;
+        key += T_('"');
+    } else {
+        key += T_('<');
+    }
+    key += header_name;
+
+    return key;
+}
+
+std::optional<IncludeCache::Resolution> IncludeCache::find_resolution(const String& key) {
+    {
+        shared_lock lock(mutex_);
+
+        auto it = resolutions_.find(key);
+        if (it != resolutions_.end() && (!revalidate_ || is_valid(it->second))) {
+            ++hits_;
+            return it->second;
+        }
+    }
+
+    if (revalidate_) {
+        //  消されたか、前のディレクトリに同じ名前のファイルが作られたなら、もう一度探させる。
+        unique_lock lock(mutex_);
+        resolutions_.erase(key);
+    }
+
+    ++misses_;
+    return nullopt;
+}
+
+/**
+ * 検索結果がまだ正しいかを確かめる。
+ */
+// static
+bool IncludeCache::is_valid(const Resolution& resolution) {
+    if (!file_exists(path_string(resolution.path))) {
+        return false;
+    }
+    return none_of(resolution.earlier_paths.begin(), resolution.earlier_paths.end(),
+            [](const auto& path) { return file_exists(path_string(path)); });
+}
+
+void IncludeCache::add_resolution(const String& key, const Resolution& resolution) {
+    //  後から作られるかもしれないので、見つからなかったことは記録しない。
+    if (revalidate_ && !resolution.exists) {
+        return;
+    }
+
+    unique_lock lock(mutex_);
+
+    resolutions_.insert({ key, resolution });
+}
+
+std::optional<IncludeCache::IncludeGuard> IncludeCache::find_include_guard(const String& path) {
+    filesystem::file_time_type last_write_time;
+    if (revalidate_) {
+        error_code ec;
+        last_write_time = filesystem::last_write_time(path_string(path), ec);
+        if (ec) {
+            return nullopt;
+        }
+    }
+
+    {
+        shared_lock lock(mutex_);
+
+        auto it = include_guards_.find(path);
+        if (it == include_guards_.end()) {
+            return nullopt;
+        }
+        if (!revalidate_ || it->second.last_write_time == last_write_time) {
+            return it->second.guard;
+        }
+    }
+
+    //  更新されたファイルは、もう一度調べ直す。
+    unique_lock lock(mutex_);
+    include_guards_.erase(path);
+    return nullopt;
+}
+
+void IncludeCache::add_include_guard(const String& path, const IncludeGuard& guard) {
+    filesystem::file_time_type last_write_time;
+    if (revalidate_) {
+        error_code ec;
+        last_write_time = filesystem::last_write_time(path_string(path), ec);
+        if (ec) {
+            return;
+        }
+    }
+
+    unique_lock lock(mutex_);
+
+    include_guards_.insert_or_assign(path, IncludeGuardEntry{ guard, last_write_time });
+}
+
+}   // namespace pp
@@ -0,0 +1,90 @@
+#ifndef CC_PREPROCESSOR_INCLUDECACHE_H_
+#define CC_PREPROCESSOR_INCLUDECACHE_H_
+
+#include <atomic>
+#include <filesystem>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "pp_config.h"
+#include "input.h"
+
+namespace pp {
+
+/**
+ * ヘッダーファイルの検索結果と、インクルードガードの情報を保持するキャッシュ。
+ *
+ * 複数の翻訳単位を並行して処理するときに共有するので、スレッドセーフにしてある。
+ * 検索結果はインクルードパスに依存するので、search_path_id()で得たインクルードパスの識別子ごとに分けて保持する。
+ *
+ * サーバーモードのようにファイルが更新されうる間ずっと使う場合は revalidateを指定する。
+ * 見つかったファイルがまだ有るか、それより前に探したパスにファイルが作られていないか、
+ * インクルードガードを調べたファイルが更新されていないかを、使う度に確認する。
+ * 見つからなかったことは記録しない。
+ */
+class IncludeCache {
+public:
+    /**
+     * ヘッダーファイルの検索結果。見つからなかったことも記録する。
+     */
+    struct Resolution {
+        bool exists;
+        String path;
+        IncludeDir include_dir;
+        std::vector<String> earlier_paths;  // pathより前に探して無かったパス。revalidateのときだけ使う。
+    };
+
+    /**
+     * ファイル全体を囲むインクルードガード。
+     *
+     * ガードの外側には空行しか無いので、ガードのマクロが定義されていれば、その空行の出力 (outside_text)だけで
+     * ファイルを処理したのと同じになる。
+     */
+    struct IncludeGuard {
+        std::string macro_name;
+        std::string outside_text;
+    };
+
+    explicit IncludeCache(bool revalidate = false);
+    IncludeCache(const IncludeCache&) = delete;
+    ~IncludeCache();
+
+    IncludeCache& operator=(const IncludeCache&) = delete;
+
+    bool revalidates() const { return revalidate_; }
+
+    std::size_t search_path_id(const std::vector<IncludeDir>& include_dirs);
+    static String resolution_key(std::size_t search_path_id, const String& header_name, bool double_quoted, const String& source_dir);
+
+    std::optional<Resolution> find_resolution(const String& key);
+    void add_resolution(const String& key, const Resolution& resolution);
+
+    std::optional<IncludeGuard> find_include_guard(const String& path);
+    void add_include_guard(const String& path, const IncludeGuard& guard);
+
+    std::uint64_t hits() const { return hits_; }
+    std::uint64_t misses() const { return misses_; }
+
+private:
+    struct IncludeGuardEntry {
+        IncludeGuard guard;
+        std::filesystem::file_time_type last_write_time;
+    };
+
+    static bool is_valid(const Resolution& resolution);
+
+    bool revalidate_;
+    mutable std::shared_mutex mutex_;
+    std::unordered_map<String, std::size_t> search_path_ids_;
+    std::unordered_map<String, Resolution> resolutions_;
+    std::unordered_map<String, IncludeGuardEntry> include_guards_;
+    mutable std::atomic<std::uint64_t> hits_;
+    mutable std::atomic<std::uint64_t> misses_;
+};
+
+}   // namespace pp
+
+#endif  // CC_PREPROCESSOR_INCLUDECACHE_H_
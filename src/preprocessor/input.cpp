@@ -1,9 +1,11 @@
 #include "input.h"
 
 #include <cassert>
+#include <exception>
 #include <sstream>
 #include <vector>
 
+#include "profiler.h"
 #include "sourcefilestack.h"
 
 using namespace std;
@@ -57,6 +59,11 @@ SourceFile::~SourceFile() {
 }
 
 Token SourceFile::next_token() {
+    ProfileScope profile_scope(ProfilePhase::kScan);
+    if (auto profiler = Profiler::current()) {
+        profiler->count(ProfileCounter::kTokens, 1);
+        profiler->count_file_token(!groups_.empty() && !groups_.top()->processing);
+    }
     Token t = scanner_.next_token();
     if (line_ != t.line()) {
         line_ = t.line();
@@ -139,15 +146,15 @@ TokenStream::TokenStream(Source& input_source)
     : input_source_(input_source)
     , lookahead_(kNumLookahead)
     , p_()
-    , queue_()
-    , q_() {
+    , pending_() {
     for (size_t i = 0; i < lookahead_.size(); ++i) {
         consume();
     }
 }
 
 TokenStream::~TokenStream() {
-    assert(q_ == queue_.size());
+    //  致命的エラーで巻き戻すときは、差し込まれたトークンが読まれずに残っている。
+    assert(pending_.empty() || std::uncaught_exceptions() > 0);
 }
 
 Source* TokenStream::input_source() const {
@@ -155,8 +162,12 @@ Source* TokenStream::input_source() const {
 }
 
 void TokenStream::consume() {
-    if (q_ < queue_.size()) {
-        ++q_;
+    if (!pending_.empty()) {
+        // 空のトークン列は insertで積まないので、末尾は常に読まれていないトークンを持つ。
+        PendingTokens& front = pending_.back();
+        if (++front.next == front.tokens.size()) {
+            pending_.pop_back();
+        }
     } else {
         lookahead_[p_] = input_source_.get().next_token();
         p_ = (p_ + 1) % kNumLookahead;
@@ -164,21 +175,48 @@ void TokenStream::consume() {
 }
 
 void TokenStream::insert(TokenList&& tokens) {
-    queue_ = move(tokens);
-    q_ = 0;
+    // 既に差し込まれていて読まれていないトークンはそのまま残し、その前に積む。
+    // トークン列はコピーせずにそのまま引き取る。
+    if (tokens.empty()) {
+        return;
+    }
+    pending_.push_back({ move(tokens), 0 });
+}
+
+/**
+ * insertで差し込まれて、まだ読まれていないトークンがあるか。あれば peek(1)はそのトークンになる。
+ */
+bool TokenStream::has_inserted() const {
+    return !pending_.empty();
+}
+
+/**
+ * 差し込まれて、まだ読まれていないトークンを捨てる。処理を途中でやめるときに使う。
+ */
+void TokenStream::discard_inserted() {
+    pending_.clear();
 }
 
 const Token& TokenStream::peek(int i) const {
     assert(i > 0);
 
-    if (q_ < queue_.size()) {
-        return queue_.at(q_ + (i - 1));
-    } else {
-        return lookahead_[(p_ + (i - 1)) % kNumLookahead];
+    size_t n = static_cast<size_t>(i - 1);
+    for (auto it = pending_.rbegin(); it != pending_.rend(); ++it) {
+        const size_t rest = it->tokens.size() - it->next;
+        if (n < rest) {
+            return it->tokens[it->next + n];
+        }
+        n -= rest;
     }
+
+    assert(n < kNumLookahead);
+    return lookahead_[(p_ + n) % kNumLookahead];
 }
 
-void TokenStream::reset_line_number(std::uint32_t new_line_number) {
+/**
+ * 先読みしたトークンの行番号を振り直す。先読みしたトークンの次の行番号を返す。
+ */
+std::uint32_t TokenStream::reset_line_number(std::uint32_t new_line_number) {
     for (int i = 0; i < kNumLookahead; i++) {
         Token& t = lookahead_[(p_ + i) % kNumLookahead];
         t.line(new_line_number);
@@ -187,6 +225,7 @@ void TokenStream::reset_line_number(std::uint32_t new_line_number) {
             new_line_number++;
         }
     }
+    return new_line_number;
 }
 
 }   // namespace pp
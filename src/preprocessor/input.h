@@ -234,16 +234,26 @@ public:
 
     void consume();
     void insert(TokenList&& tokens);
+    bool has_inserted() const;
+    void discard_inserted();
     const Token& peek(int i) const;
 
-    void reset_line_number(std::uint32_t new_line_number);
+    std::uint32_t reset_line_number(std::uint32_t new_line_number);
 
 private:
+    /**
+     * insertで差し込まれた、まだ読まれていないトークン列。
+     * 後から差し込まれたものほど先に読まれるので、pending_の末尾がストリームの先頭になる。
+     */
+    struct PendingTokens {
+        TokenList tokens;
+        std::size_t next;
+    };
+
     std::reference_wrapper<Source> input_source_;
     std::vector<Token> lookahead_;
     std::size_t p_;
-    TokenList queue_;
-    std::size_t q_;
+    std::vector<PendingTokens> pending_;
 };
 
 using TokenStreamPtr = std::shared_ptr<TokenStream>;
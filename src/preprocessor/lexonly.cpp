@@ -0,0 +1,141 @@
+#include "lexonly.h"
+
+#include <format>
+#include <fstream>
+#include <ostream>
+
+#include "util/logger.h"
+#include "util/utility.h"
+
+#include "diagnostics.h"
+#include "input.h"
+#include "options.h"
+#include "preprocessor.h"
+#include "sourcefilestack.h"
+#include "tokenfile.h"
+
+using namespace lib::util;
+using namespace std;
+
+namespace pp {
+
+/**
+ * bufferの内容を字句解析だけして、トークンを数える。マクロの表もディレクティブの処理も使わない。
+ *
+ * on_tokenが有れば、トークンごとに呼ぶ。on_tokenの時間は計らないが、その前後で時計を読む分は字句解析の時間に入る。
+ */
+void lex_buffer(FileSystem::Buffer buffer, const String& path, const Options& opts, Diagnostics& diag,
+        LexStatistics& statistics, const LexTokenCallback& on_token) {
+    const auto size = buffer->size();
+    BufferInputStream input(move(buffer));
+    SourceFileStack sources;
+    SourceFile source(input, path, IncludeDir{ IncludeDir::kSource, String() }, opts, diag, sources);
+
+    auto elapsed = chrono::steady_clock::duration::zero();
+    auto start = chrono::steady_clock::now();
+    std::uint64_t tokens = 0;
+    for (;;) {
+        Token t = source.next_token();
+        if (t.type() == TokenType::kEndOfFile) {
+            break;
+        }
+        ++tokens;
+        ++statistics.tokens_by_type[static_cast<std::size_t>(t.type()) - static_cast<std::size_t>(TokenType::kNull)];
+        if (on_token) {
+            //  出力 (--lex-only=dump)などの時間は含めない。
+            elapsed += chrono::steady_clock::now() - start;
+            on_token(t);
+            start = chrono::steady_clock::now();
+        }
+    }
+    elapsed += chrono::steady_clock::now() - start;
+    statistics.elapsed += elapsed;
+    statistics.tokens += tokens;
+    statistics.bytes += size;
+    ++statistics.files;
+}
+
+/**
+ * 合計と速さ、トークンの種類ごとの数を出力する。現れなかった種類は出力しない。
+ */
+void write_lex_statistics(std::ostream& output, const LexStatistics& statistics) {
+    const auto seconds = chrono::duration<double>(statistics.elapsed).count();
+    const auto per_second = [seconds](std::uint64_t n) {
+        return (seconds > 0.0) ? static_cast<double>(n) / seconds : 0.0;
+    };
+
+    std::string report = std::format("字句解析: {} ファイル、{} バイト、{} トークン、{:.3f} ms\n",
+            statistics.files, statistics.bytes, statistics.tokens, seconds * 1000.0);
+    std::format_to(back_inserter(report), "  {:.2f} MiB/s、{:.0f} トークン/s\n",
+            per_second(statistics.bytes) / (1024.0 * 1024.0), per_second(statistics.tokens));
+    std::format_to(back_inserter(report), "  {:>12}  {}\n", "トークン", "種類");
+    for (std::size_t i = 0; i < kNumTokenTypes; i++) {
+        if (statistics.tokens_by_type[i] != 0) {
+            const auto type = static_cast<TokenType>(static_cast<std::size_t>(TokenType::kNull) + i);
+            std::format_to(back_inserter(report), "  {:>12}  {}\n", statistics.tokens_by_type[i], Token::type_to_string(type));
+        }
+    }
+    output.write(report.data(), report.size());
+}
+
+/**
+ * 入力ファイルを順に字句解析だけする。(cpp --lex-only)
+ *
+ * --lex-only=dumpなら、トークンを cpp --dumpと同じ形式で出力し、統計はエラー出力に出力する。
+ * マクロを展開しないので、展開の番号は全て 0になる。
+ * 出力先は -o、無ければ output。
+ */
+int run_lex_only(const Options& opts, Diagnostics& diag, std::ostream& output, std::ostream& error_output) {
+    ofstream output_file;
+    std::ostream* out = &output;
+    if (!opts.output_filepath().empty()) {
+        output_file.open(path_string(opts.output_filepath()), ios_base::binary);
+        if (!output_file) {
+            log_error(kNoSuchFileError, opts.output_filepath());
+            return EXIT_FAILURE;
+        }
+        out = &output_file;
+    }
+    diag.format(opts.diagnostics_format());
+    diag.set_output(&error_output);
+
+    const bool dump = (opts.lex_only() == LexOnlyOutput::kTokens);
+    FileCache files(opts.file_cache_size());
+    LexStatistics statistics;
+    bool failed = false;
+    for (const auto& path : opts.input_filepaths()) {
+        auto buffer = files.load(path);
+        if (!buffer) {
+            log_error(kNoSuchFileError, path);
+            failed = true;
+            continue;
+        }
+
+        LexTokenCallback on_token;
+        if (dump) {
+            const auto narrow_path = std::string(as_narrow(path));
+            on_token = [out, narrow_path](const Token& t) {
+                *out << narrow_path << ':' << t.line() << ':' << t.column() << '\t'
+                     << Token::type_to_string(t.type()) << "\t0\t" << escape_spelling(t.string()) << '\n';
+            };
+        }
+        try {
+            lex_buffer(move(buffer), path, opts, diag, statistics, on_token);
+        } catch (const FatalError&) {
+            //  メッセージは出力済み。次のファイルに進む。
+            failed = true;
+        }
+    }
+    diag.set_output(nullptr);
+
+    write_lex_statistics(dump ? error_output : *out, statistics);
+    out->flush();
+    if (!*out) {
+        log_error(kFileOutputError);
+        return EXIT_FAILURE;
+    }
+
+    return (failed || diag.error_count() != 0) ? EXIT_FAILURE : 0;
+}
+
+}   // namespace pp
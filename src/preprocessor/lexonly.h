@@ -0,0 +1,48 @@
+#ifndef CC_PREPROCESSOR_LEXONLY_H_
+#define CC_PREPROCESSOR_LEXONLY_H_
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+
+#include "pp_config.h"
+#include "filecache.h"
+#include "token.h"
+
+namespace pp {
+
+class Diagnostics;
+class Options;
+
+constexpr std::size_t kNumTokenTypes =
+        static_cast<std::size_t>(TokenType::kComma) - static_cast<std::size_t>(TokenType::kNull) + 1;
+
+/**
+ * 字句解析だけをした結果。(cpp --lex-only)
+ *
+ * トークンは Scannerが返したもの全てで、空白、改行、コメントも含む。時間は字句解析の時間だけで、ファイルの読み込みとトークンごとのコールバックは含まない。
+ */
+struct LexStatistics {
+    std::uint64_t files = 0;
+    std::uint64_t bytes = 0;
+    std::uint64_t tokens = 0;
+    std::array<std::uint64_t, kNumTokenTypes> tokens_by_type = {};
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::duration::zero();
+
+    std::uint64_t count(TokenType type) const {
+        return tokens_by_type[static_cast<std::size_t>(type) - static_cast<std::size_t>(TokenType::kNull)];
+    }
+};
+
+using LexTokenCallback = std::function<void (const Token& token)>;
+
+void lex_buffer(FileSystem::Buffer buffer, const String& path, const Options& opts, Diagnostics& diag,
+        LexStatistics& statistics, const LexTokenCallback& on_token = nullptr);
+void write_lex_statistics(std::ostream& output, const LexStatistics& statistics);
+int run_lex_only(const Options& opts, Diagnostics& diag, std::ostream& output, std::ostream& error_output);
+
+}   // namespace pp
+
+#endif  // CC_PREPROCESSOR_LEXONLY_H_
@@ -0,0 +1,232 @@
+#include "libpp.h"
+
+#include <filesystem>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <unordered_map>
+
+#include "util/utility.h"
+
+#include "calculator.h"
+#include "filecache.h"
+#include "options.h"
+#include "preprocessor.h"
+#include "sourcefilestack.h"
+
+using namespace lib::util;
+using namespace std;
+
+namespace {
+
+using namespace pp;
+
+const StringView kLibraryOptionError = T_("オプションが正しくない。");
+const StringView kLibraryFileError = T_("入力ファイルを読み込めない。");
+
+constexpr size_t kLibraryFileCacheSize = 64 * 1024 * 1024;
+
+/**
+ * 呼び出し側の文字列に追加していく。
+ */
+class StringAppendStreamBuf
+    : public std::streambuf {
+public:
+    explicit StringAppendStreamBuf(std::string& output)
+        : output_(output) {
+    }
+
+protected:
+    virtual int_type overflow(int_type c) override {
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            output_.push_back(traits_type::to_char_type(c));
+        }
+        return traits_type::not_eof(c);
+    }
+
+    virtual std::streamsize xsputn(const char* s, std::streamsize n) override {
+        output_.append(s, static_cast<size_t>(n));
+        return n;
+    }
+
+private:
+    std::string& output_;
+};
+
+/**
+ * 依頼された入力ファイルの内容とコールバックから読み込む。どちらでもなければディスクから読み込む。
+ */
+class RequestFileSystem
+    : public FileSystem {
+public:
+    RequestFileSystem(const PreprocessRequest& request, const String& main_path)
+        : read_file_(request.read_file)
+        , main_path_(main_path)
+        , main_source_()
+        , loaded_()
+        , disk_() {
+        if (request.source) {
+            main_source_ = make_shared<const std::string>(*request.source);
+        }
+    }
+
+    virtual bool exists(const String& path) override {
+        if (main_source_ && path == main_path_) {
+            return true;
+        }
+        if (read_file_) {
+            return load(path) != nullptr;
+        }
+        return disk().exists(path);
+    }
+
+    virtual Buffer load(const String& path) override {
+        if (main_source_ && path == main_path_) {
+            return main_source_;
+        }
+        if (!read_file_) {
+            return disk().load(path);
+        }
+
+        //  同じファイルで何度もコールバックを呼ばないようにする。
+        auto it = loaded_.find(path);
+        if (it == loaded_.end()) {
+            auto content = read_file_(path);
+            Buffer buffer = content ? make_shared<const std::string>(move(*content)) : nullptr;
+            it = loaded_.insert({ path, move(buffer) }).first;
+        }
+        return it->second;
+    }
+
+private:
+    FileCache& disk() {
+        if (!disk_) {
+            disk_ = make_unique<FileCache>(kLibraryFileCacheSize);
+        }
+        return *disk_;
+    }
+
+    ReadFileCallback read_file_;
+    String main_path_;
+    Buffer main_source_;
+    std::unordered_map<String, Buffer> loaded_;
+    std::unique_ptr<FileCache> disk_;
+};
+
+/**
+ * 依頼のオプションを解析する。入力ファイルは 1つだけで、サーバーなどのモードは使えない。
+ */
+bool parse_request_options(const PreprocessRequest& request, Options& opts) {
+    vector<String> args;
+    args.reserve(request.args.size() + 2);
+    args.push_back(T_("cpp"));
+    args.insert(args.end(), request.args.begin(), request.args.end());
+    args.push_back(request.path);
+
+    Environment env{ request.working_dir, request.environment };
+    return opts.parse_options(args, &env) && !opts.batch_mode() &&
+        opts.server_socket_path().empty() && opts.connect_socket_path().empty();
+}
+
+}   // anonymous namespace
+
+namespace pp {
+
+/**
+ * 1つの翻訳単位を処理し、結果を outputに追加する。
+ *
+ * 診断メッセージは結果として返し、致命的エラーでもプロセスを終了しない。
+ * 別々のスレッドから同時に呼んでも良い。
+ */
+PreprocessResult preprocess(const PreprocessRequest& request, std::string& output) {
+    static once_flag initialized;
+    call_once(initialized, [] {
+        init_calculator();
+        init_preprocessor();
+    });
+
+    PreprocessResult result{ false, {} };
+
+    Options opts;
+    if (!parse_request_options(request, opts)) {
+        result.diagnostics.push_back({ DiagLevel::kFatalError, request.path, 0, 0, String(kLibraryOptionError) });
+        return result;
+    }
+
+    //  出力先の指定は無視して、outputに出力する。
+    const String& input = opts.input_filepath();
+    Options tu_opts = opts.translation_unit_options(input, String(), String());
+
+    //  Preprocessor::run()は入力ファイルを絶対パスで読み込む。
+    auto main_path = internal_string(filesystem::absolute(path_string(input)));
+
+    Diagnostics diag;
+    diag.exit_on_fatal_error(false);
+    diag.set_handler([&result](const DiagnosticRecord& record) {
+        result.diagnostics.push_back(record);
+    });
+
+    StringAppendStreamBuf output_buf(output);
+    std::ostream output_stream(&output_buf);
+    std::ostream error_output_stream(nullptr);
+
+    SourceFileStack sources;
+    Preprocessor pp(tu_opts, diag, sources);
+    pp.file_system(make_shared<RequestFileSystem>(request, main_path));
+    pp.standard_streams(&output_stream, &error_output_stream);
+    if (request.token_sink) {
+        pp.token_sink(request.token_sink);
+    }
+
+    try {
+        result.succeeded = (pp.run() == 0);
+    } catch (const FatalError&) {
+        result.succeeded = false;
+    }
+    //  run()が途中で戻ってもバッファーに残っている診断メッセージを、resultを返す前に handlerに渡す。
+    diag.set_handler(nullptr);
+
+    return result;
+}
+
+/**
+ * 1つのファイルを字句解析だけする。マクロの表もディレクティブの処理も使わない。(cpp --lex-only)
+ *
+ * requestの args (-trigraphsなど)、path、source、read_fileを使う。on_tokenが有ればトークンごとに呼ぶ。
+ * 別々のスレッドから同時に呼んでも良い。
+ */
+LexResult lex(const PreprocessRequest& request, const LexTokenCallback& on_token) {
+    LexResult result{ false, {}, {} };
+
+    Options opts;
+    if (!parse_request_options(request, opts)) {
+        result.diagnostics.push_back({ DiagLevel::kFatalError, request.path, 0, 0, String(kLibraryOptionError) });
+        return result;
+    }
+
+    auto main_path = internal_string(filesystem::absolute(path_string(opts.input_filepath())));
+    RequestFileSystem file_system(request, main_path);
+    auto buffer = file_system.load(main_path);
+    if (!buffer) {
+        result.diagnostics.push_back({ DiagLevel::kFatalError, request.path, 0, 0, String(kLibraryFileError) });
+        return result;
+    }
+
+    Diagnostics diag;
+    diag.set_handler([&result](const DiagnosticRecord& record) {
+        result.diagnostics.push_back(record);
+    });
+
+    try {
+        lex_buffer(move(buffer), main_path, opts, diag, result.statistics, on_token);
+        result.succeeded = (diag.error_count() == 0);
+    } catch (const FatalError&) {
+        result.succeeded = false;
+    }
+    //  バッファーに残っている診断メッセージを handlerに渡す。
+    diag.set_handler(nullptr);
+
+    return result;
+}
+
+}   // namespace pp
@@ -0,0 +1,64 @@
+#ifndef CC_PREPROCESSOR_LIBPP_H_
+#define CC_PREPROCESSOR_LIBPP_H_
+
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "pp_config.h"
+#include "diagnostics.h"
+#include "lexonly.h"
+#include "tokensink.h"
+
+namespace pp {
+
+/**
+ * ヘッダーファイルなどを読み込むコールバック。pathのファイルが無ければ nulloptを返す。
+ */
+using ReadFileCallback = std::function<std::optional<std::string> (const String& path)>;
+
+/**
+ * ライブラリとして使う場合の、1つの翻訳単位の処理の依頼。
+ */
+struct PreprocessRequest {
+    // コマンドラインと同じ形式のオプション (-I、-D、-U、-trigraphs、-f...)。入力ファイルは含めない。
+    std::vector<String> args;
+    // 入力ファイルの名前。__FILE__や診断メッセージで使われる。
+    String path;
+    // 入力ファイルの内容。無ければ pathから読み込む。
+    std::optional<std::string> source;
+    // 相対パスの基準になるディレクトリ。空ならカレントディレクトリ。
+    String working_dir;
+    // インクルードパスを指定する環境変数 (INCLUDEなど)。プロセスの環境変数は使わない。
+    std::map<String, String> environment;
+    // ファイルを読み込むコールバック。無ければディスクから読み込む。
+    ReadFileCallback read_file;
+    // 出力するトークンを受け取るもの。指定すると outputには何も出力しない。
+    TokenSink* token_sink = nullptr;
+};
+
+/**
+ * 処理の結果。
+ */
+struct PreprocessResult {
+    bool succeeded;
+    std::vector<DiagnosticRecord> diagnostics;
+};
+
+/**
+ * 字句解析だけの結果。
+ */
+struct LexResult {
+    bool succeeded;
+    LexStatistics statistics;
+    std::vector<DiagnosticRecord> diagnostics;
+};
+
+PreprocessResult preprocess(const PreprocessRequest& request, std::string& output);
+LexResult lex(const PreprocessRequest& request, const LexTokenCallback& on_token = nullptr);
+
+}   // namespace pp
+
+#endif  // CC_PREPROCESSOR_LIBPP_H_
@@ -0,0 +1,310 @@
+#include "localsocket.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#if HOST_PLATFORM == PLATFORM_WINDOWS
+#include <winsock2.h>
+#include <afunix.h>
+#include "win32util/error.h"
+#else
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+using Handle = pp::LocalSocket::Handle;
+
+#if HOST_PLATFORM == PLATFORM_WINDOWS
+constexpr Handle kInvalidHandle = static_cast<Handle>(INVALID_SOCKET);
+
+[[noreturn]]
+void raise_socket_error(const char* message) {
+    lib::win32util::raise_win32_error(message, static_cast<DWORD>(WSAGetLastError()));
+}
+
+/**
+ * Winsockはプロセスで 1度だけ初期化する。
+ */
+void startup() {
+    struct Startup {
+        Startup() {
+            WSADATA data;
+            if (int e = WSAStartup(MAKEWORD(2, 2), &data); e != 0) {
+                lib::win32util::raise_win32_error("WSAStartup", static_cast<DWORD>(e));
+            }
+        }
+        ~Startup() {
+            WSACleanup();
+        }
+    };
+    static Startup instance;
+}
+
+void close_handle(Handle handle) {
+    closesocket(static_cast<SOCKET>(handle));
+}
+
+/**
+ * 前のサーバーが残したソケットのファイルを消す。ソケットではないファイルは消さずに例外にする。
+ */
+void remove_stale_socket(const filesystem::path& path) {
+    WIN32_FIND_DATAW data;
+    HANDLE h = FindFirstFileW(path.c_str(), &data);
+    if (h == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    FindClose(h);
+    //  AF_UNIXのソケットは、専用のタグの再解析ポイントになっている。
+    if ((data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0 || data.dwReserved0 != IO_REPARSE_TAG_AF_UNIX) {
+        throw system_error(make_error_code(errc::file_exists), "not a socket");
+    }
+    if (!DeleteFileW(path.c_str())) {
+        lib::win32util::raise_win32_error("DeleteFile", GetLastError());
+    }
+}
+#else
+constexpr Handle kInvalidHandle = -1;
+
+[[noreturn]]
+void raise_socket_error(const char* message) {
+    throw system_error(error_code(errno, generic_category()), message);
+}
+
+void startup() {
+}
+
+void close_handle(Handle handle) {
+    ::close(handle);
+}
+
+/**
+ * 前のサーバーが残したソケットのファイルを消す。ソケットではないファイルは消さずに例外にする。
+ */
+void remove_stale_socket(const filesystem::path& path) {
+    struct stat st;
+    if (::lstat(path.c_str(), &st) != 0) {
+        if (errno == ENOENT) {
+            return;
+        }
+        raise_socket_error("lstat");
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        throw system_error(make_error_code(errc::file_exists), "not a socket");
+    }
+    if (::unlink(path.c_str()) != 0) {
+        raise_socket_error("unlink");
+    }
+}
+#endif
+
+sockaddr_un make_address(const filesystem::path& path) {
+#if HOST_PLATFORM == PLATFORM_WINDOWS
+    auto u8path = path.u8string();
+    string name(reinterpret_cast<const char*>(u8path.data()), u8path.size());
+#else
+    string name = path.string();
+#endif
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (name.size() >= sizeof(addr.sun_path)) {
+        throw system_error(make_error_code(errc::filename_too_long), "sockaddr_un");
+    }
+    memcpy(addr.sun_path, name.data(), name.size());
+    return addr;
+}
+
+Handle open_socket() {
+    startup();
+
+    auto s = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (static_cast<Handle>(s) == kInvalidHandle) {
+        raise_socket_error("socket");
+    }
+    return static_cast<Handle>(s);
+}
+
+}   // anonymous namespace
+
+namespace pp {
+
+/**
+ * pathで接続を待つソケットを作る。既にソケットのファイルが有れば消してから作る。
+ * ソケットではないファイルが有れば、消さずに例外にする。
+ */
+// static
+LocalSocket LocalSocket::listen(const std::filesystem::path& path) {
+    auto addr = make_address(path);
+
+    remove_stale_socket(path);
+
+    LocalSocket s(open_socket());
+#if HOST_PLATFORM == PLATFORM_WINDOWS
+    if (::bind(s.handle_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+        raise_socket_error("bind");
+    }
+#else
+    //  ソケットのファイルは作ったユーザーだけが読み書きできるようにする。
+    auto old_mask = ::umask(077);
+    auto result = ::bind(s.handle_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
+    auto bind_errno = errno;
+    ::umask(old_mask);
+    if (result != 0) {
+        errno = bind_errno;
+        raise_socket_error("bind");
+    }
+#endif
+    if (::listen(s.handle_, SOMAXCONN) != 0) {
+        raise_socket_error("listen");
+    }
+    return s;
+}
+
+// static
+LocalSocket LocalSocket::connect(const std::filesystem::path& path) {
+    auto addr = make_address(path);
+
+    LocalSocket s(open_socket());
+    if (::connect(s.handle_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+        raise_socket_error("connect");
+    }
+    return s;
+}
+
+LocalSocket::LocalSocket()
+    : handle_(kInvalidHandle) {
+}
+
+LocalSocket::LocalSocket(Handle handle)
+    : handle_(handle) {
+}
+
+LocalSocket::LocalSocket(LocalSocket&& other) noexcept
+    : handle_(exchange(other.handle_, kInvalidHandle)) {
+}
+
+LocalSocket::~LocalSocket() {
+    close();
+}
+
+LocalSocket& LocalSocket::operator=(LocalSocket&& rhs) noexcept {
+    if (this != &rhs) {
+        close();
+        handle_ = exchange(rhs.handle_, kInvalidHandle);
+    }
+    return *this;
+}
+
+bool LocalSocket::is_open() const {
+    return handle_ != kInvalidHandle;
+}
+
+void LocalSocket::close() {
+    if (is_open()) {
+        close_handle(handle_);
+        handle_ = kInvalidHandle;
+    }
+}
+
+/**
+ * 接続の相手が、このプロセスと同じユーザーか。相手を調べられなければ falseを返す。
+ * Windowsでは調べる方法が無いので、常に trueを返す。
+ */
+bool LocalSocket::is_peer_same_user() const {
+#if HOST_PLATFORM == PLATFORM_WINDOWS
+    return true;
+#elif defined(SO_PEERCRED)
+    ucred cred;
+    socklen_t size = sizeof(cred);
+    if (::getsockopt(handle_, SOL_SOCKET, SO_PEERCRED, &cred, &size) != 0) {
+        return false;
+    }
+    return cred.uid == ::geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    if (::getpeereid(handle_, &uid, &gid) != 0) {
+        return false;
+    }
+    return uid == ::geteuid();
+#endif
+}
+
+LocalSocket LocalSocket::accept() {
+    for (;;) {
+        auto s = ::accept(handle_, nullptr, nullptr);
+        if (static_cast<Handle>(s) != kInvalidHandle) {
+            return LocalSocket(static_cast<Handle>(s));
+        }
+#if HOST_PLATFORM != PLATFORM_WINDOWS
+        if (errno == EINTR) {
+            continue;
+        }
+#endif
+        raise_socket_error("accept");
+    }
+}
+
+/**
+ * sizeバイト読み込む。その前に接続が閉じられたら falseを返す。
+ */
+bool LocalSocket::read(void* data, std::size_t size) {
+    auto p = static_cast<char*>(data);
+    while (size > 0) {
+#if HOST_PLATFORM == PLATFORM_WINDOWS
+        int n = ::recv(handle_, p, static_cast<int>(min<size_t>(size, INT_MAX)), 0);
+#else
+        auto n = ::recv(handle_, p, size, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+#endif
+        if (n < 0) {
+            raise_socket_error("recv");
+        }
+        if (n == 0) {
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+void LocalSocket::write(const void* data, std::size_t size) {
+    auto p = static_cast<const char*>(data);
+    while (size > 0) {
+#if HOST_PLATFORM == PLATFORM_WINDOWS
+        int n = ::send(handle_, p, static_cast<int>(min<size_t>(size, INT_MAX)), 0);
+#else
+#if defined(MSG_NOSIGNAL)
+        //  相手が先に閉じても SIGPIPEで落ちないようにする。
+        auto n = ::send(handle_, p, size, MSG_NOSIGNAL);
+#else
+        auto n = ::send(handle_, p, size, 0);
+#endif
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+#endif
+        if (n < 0) {
+            raise_socket_error("send");
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+}
+
+}   // namespace pp
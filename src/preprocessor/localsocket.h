@@ -0,0 +1,56 @@
+#ifndef CC_PREPROCESSOR_LOCALSOCKET_H_
+#define CC_PREPROCESSOR_LOCALSOCKET_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+#include "config.h"
+
+namespace pp {
+
+/**
+ * ローカルソケット (AF_UNIX)のストリーム接続。
+ *
+ * Windowsでは Windows 10以降の AF_UNIXを使う。エラーは std::system_errorで送出する。
+ *
+ * 接続できるのは、POSIXではソケットを作ったのと同じユーザーだけにする。(ソケットのファイルは作ったユーザーだけがアクセスできるモードで作り、
+ * 相手のユーザーも is_peer_same_user()で確かめる) Windowsでは相手のユーザーを調べられないので、
+ * ソケットのファイルを置いたディレクトリーのアクセス権で制限すること。
+ */
+class LocalSocket {
+public:
+#if HOST_PLATFORM == PLATFORM_WINDOWS
+    using Handle = std::uintptr_t;
+#else
+    using Handle = int;
+#endif
+
+    static LocalSocket listen(const std::filesystem::path& path);
+    static LocalSocket connect(const std::filesystem::path& path);
+
+    LocalSocket();
+    LocalSocket(const LocalSocket&) = delete;
+    LocalSocket(LocalSocket&& other) noexcept;
+    ~LocalSocket();
+
+    LocalSocket& operator=(const LocalSocket&) = delete;
+    LocalSocket& operator=(LocalSocket&& rhs) noexcept;
+
+    bool is_open() const;
+    void close();
+    bool is_peer_same_user() const;
+
+    LocalSocket accept();
+    bool read(void* data, std::size_t size);
+    void write(const void* data, std::size_t size);
+
+private:
+    explicit LocalSocket(Handle handle);
+
+    Handle handle_;
+};
+
+}   // namespace pp
+
+#endif  // CC_PREPROCESSOR_LOCALSOCKET_H_
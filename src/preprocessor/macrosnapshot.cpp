@@ -0,0 +1,379 @@
+#include "macrosnapshot.h"
+
+#include <ostream>
+#include <stdexcept>
+#include <system_error>
+
+#include "util/utility.h"
+
+using namespace lib::util;
+using namespace std;
+
+namespace {
+
+using namespace pp;
+
+[[noreturn]]
+void raise_format_error() {
+    throw runtime_error("invalid macro snapshot");
+}
+
+std::uint64_t hash_content(std::string_view content) {
+    //  FNV-1a
+    std::uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : content) {
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+void append_u32(std::string& buffer, std::uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        buffer.push_back(static_cast<char>(value >> (i * 8)));
+    }
+}
+
+void append_u64(std::string& buffer, std::uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        buffer.push_back(static_cast<char>(value >> (i * 8)));
+    }
+}
+
+void append_string(std::string& buffer, std::string_view value) {
+    append_u32(buffer, static_cast<std::uint32_t>(value.size()));
+    buffer.append(value);
+}
+
+/**
+ * マップしたファイルを先頭から読む。範囲外を読もうとしたら形式が正しくない。
+ */
+class SnapshotReader {
+public:
+    SnapshotReader(const char* data, std::size_t size)
+        : data_(data)
+        , size_(size)
+        , p_() {
+    }
+
+    std::size_t position() const { return p_; }
+    std::size_t remaining() const { return size_ - p_; }
+
+    std::uint32_t u32() {
+        auto bytes = take(4);
+        std::uint32_t value = 0;
+        for (int i = 0; i < 4; i++) {
+            value |= static_cast<std::uint32_t>(static_cast<unsigned char>(bytes[i])) << (i * 8);
+        }
+        return value;
+    }
+
+    std::uint64_t u64() {
+        auto bytes = take(8);
+        std::uint64_t value = 0;
+        for (int i = 0; i < 8; i++) {
+            value |= static_cast<std::uint64_t>(static_cast<unsigned char>(bytes[i])) << (i * 8);
+        }
+        return value;
+    }
+
+    std::string_view string() {
+        auto size = u32();
+        return take(size);
+    }
+
+    /**
+     * 要素の数を読む。1要素が少なくとも element_sizeバイトなので、残りに収まらない数は形式が正しくない。
+     * 読んだ数で先にメモリーを確保しても、ファイルより大きくはならない。
+     */
+    std::uint32_t count(std::size_t element_size) {
+        auto n = u32();
+        if (n > remaining() / element_size) {
+            raise_format_error();
+        }
+        return n;
+    }
+
+    std::string_view take(std::size_t n) {
+        if (n > size_ - p_) {
+            raise_format_error();
+        }
+        std::string_view result(data_ + p_, n);
+        p_ += n;
+        return result;
+    }
+
+private:
+    const char* data_;
+    std::size_t size_;
+    std::size_t p_;
+};
+
+void append_macro(std::string& buffer, const Macro& m) {
+    append_u32(buffer, m.is_function() ? 1 : 0);
+    append_string(buffer, m.source());
+    append_u32(buffer, m.line());
+    append_u32(buffer, m.column());
+    append_u32(buffer, static_cast<std::uint32_t>(m.params().size()));
+    for (const auto& p : m.params()) {
+        append_string(buffer, p);
+    }
+    append_u32(buffer, static_cast<std::uint32_t>(m.replist().size()));
+    for (const auto& t : m.replist()) {
+        append_u32(buffer, static_cast<std::uint32_t>(t.type()));
+        append_u32(buffer, t.line());
+        append_u32(buffer, t.column());
+        append_string(buffer, t.string());
+    }
+}
+
+//  append_macroで書いた、引数 1つと置換リストのトークン 1つの最小のサイズ。
+constexpr std::size_t kMinParamSize = 4;
+constexpr std::size_t kMinTokenSize = 16;
+
+/**
+ * append_macroで書いた定義を、Macroを作らずに読み飛ばす。範囲外を読もうとしたら形式が正しくない。
+ */
+void skip_macro(SnapshotReader& r) {
+    r.u32();
+    r.string();
+    r.u32();
+    r.u32();
+    for (auto n = r.count(kMinParamSize); n > 0; n--) {
+        r.string();
+    }
+    for (auto n = r.count(kMinTokenSize); n > 0; n--) {
+        r.u32();
+        r.u32();
+        r.u32();
+        r.string();
+    }
+}
+
+}   // anonymous namespace
+
+namespace pp {
+
+// static
+MacroSnapshot::Dependency MacroSnapshot::make_dependency(const String& path, const std::string& content) {
+    auto p = path_string(path);
+    return Dependency{
+        path,
+        static_cast<std::int64_t>(filesystem::last_write_time(p).time_since_epoch().count()),
+        static_cast<std::uint64_t>(content.size()),
+        hash_content(content) };
+}
+
+/**
+ * スナップショットを書き込む。定義済みマクロと、_Pragmaなどの特別なマクロは含めない。
+ */
+// static
+void MacroSnapshot::write(std::ostream& output,
+                          const std::vector<std::string>& macro_operations,
+                          const std::vector<Dependency>& dependencies,
+                          const std::vector<std::pair<String, IncludeCache::IncludeGuard>>& include_guards,
+                          const MacroSet& macros) {
+    std::string records;
+    std::string index;
+    std::uint32_t num_macros = 0;
+    bool checks_resource = false;
+    for (const auto& [name, m] : macros) {
+        if (m->is_predefined() ||
+            (m->expantion_method() != MacroExpantionMethod::kDirectlyCopyable &&
+             m->expantion_method() != MacroExpantionMethod::kNormal)) {
+            continue;
+        }
+        append_string(index, name);
+        append_u32(index, static_cast<std::uint32_t>(records.size()));
+        append_macro(records, *m);
+        checks_resource = checks_resource || m->checks_resource();
+        ++num_macros;
+    }
+
+    std::string buffer;
+    append_u32(buffer, kMagic);
+    append_u32(buffer, kVersion);
+    append_u32(buffer, static_cast<std::uint32_t>(macro_operations.size()));
+    for (const auto& op : macro_operations) {
+        append_string(buffer, op);
+    }
+    append_u32(buffer, static_cast<std::uint32_t>(dependencies.size()));
+    for (const auto& d : dependencies) {
+        append_string(buffer, as_narrow(d.path));
+        append_u64(buffer, static_cast<std::uint64_t>(d.last_write_time));
+        append_u64(buffer, d.size);
+        append_u64(buffer, d.hash);
+    }
+    append_u32(buffer, static_cast<std::uint32_t>(include_guards.size()));
+    for (const auto& [path, guard] : include_guards) {
+        append_string(buffer, as_narrow(path));
+        append_string(buffer, guard.macro_name);
+        append_string(buffer, guard.outside_text);
+    }
+    append_u32(buffer, checks_resource ? 1 : 0);
+    append_u32(buffer, num_macros);
+    buffer += index;
+    append_u32(buffer, static_cast<std::uint32_t>(records.size()));
+
+    output.write(buffer.data(), buffer.size());
+    output.write(records.data(), records.size());
+}
+
+/**
+ * マクロの定義以外を読み、マクロは索引だけを作る。
+ *
+ * マクロは使われたときに作るので、ここで全ての定義がマクロの定義の範囲に収まっていることを確かめておく。
+ * 後から take()で形式のエラーにならないようにするため。
+ */
+MacroSnapshot::MacroSnapshot(const std::filesystem::path& path)
+    : file_(path)
+    , macro_operations_()
+    , dependencies_()
+    , include_guards_()
+    , checks_resource_()
+    , index_() {
+    SnapshotReader r(file_.data(), file_.size());
+    if (r.u32() != kMagic || r.u32() != kVersion) {
+        raise_format_error();
+    }
+
+    auto num_ops = r.count(4);
+    for (std::uint32_t i = 0; i < num_ops; i++) {
+        macro_operations_.emplace_back(r.string());
+    }
+
+    auto num_deps = r.count(28);
+    for (std::uint32_t i = 0; i < num_deps; i++) {
+        Dependency d;
+        d.path = internal_from_source(std::string(r.string()));
+        d.last_write_time = static_cast<std::int64_t>(r.u64());
+        d.size = r.u64();
+        d.hash = r.u64();
+        dependencies_.push_back(move(d));
+    }
+
+    auto num_guards = r.count(12);
+    for (std::uint32_t i = 0; i < num_guards; i++) {
+        auto guard_path = internal_from_source(std::string(r.string()));
+        IncludeCache::IncludeGuard guard;
+        guard.macro_name = r.string();
+        guard.outside_text = r.string();
+        include_guards_.push_back({ move(guard_path), move(guard) });
+    }
+
+    checks_resource_ = (r.u32() != 0);
+
+    auto num_macros = r.count(8);
+    std::vector<std::pair<std::string_view, std::uint32_t>> entries;
+    entries.reserve(num_macros);
+    for (std::uint32_t i = 0; i < num_macros; i++) {
+        auto name = r.string();
+        auto offset = r.u32();
+        entries.push_back({ name, offset });
+    }
+
+    auto records_size = r.u32();
+    const auto records_base = r.position();
+    r.take(records_size);
+    index_.reserve(entries.size());
+    for (const auto& [name, offset] : entries) {
+        if (offset >= records_size) {
+            raise_format_error();
+        }
+        SnapshotReader record(file_.data() + records_base + offset, records_size - offset);
+        skip_macro(record);
+        index_.insert({ name, static_cast<std::uint32_t>(records_base + offset) });
+    }
+}
+
+MacroSnapshot::~MacroSnapshot() {
+}
+
+/**
+ * 依存ファイルが変わっていないか。変わっていたら、そのパスを stale_pathに返す。
+ */
+bool MacroSnapshot::is_up_to_date(FileSystem& file_system, String* stale_path) const {
+    for (const auto& d : dependencies_) {
+        auto p = path_string(d.path);
+        error_code ec;
+        auto size = filesystem::file_size(p, ec);
+        auto time = ec ? filesystem::file_time_type() : filesystem::last_write_time(p, ec);
+        if (!ec && size == d.size && time.time_since_epoch().count() == d.last_write_time) {
+            continue;
+        }
+
+        //  更新日時が変わっただけなら、内容は同じかもしれない。
+        auto content = ec ? nullptr : file_system.load(d.path);
+        if (!content || content->size() != d.size || hash_content(*content) != d.hash) {
+            *stale_path = d.path;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MacroSnapshot::contains(const std::string& name) const {
+    return index_.find(name) != index_.end();
+}
+
+/**
+ * nameのマクロを作って返し、索引から除く。無ければ nullptrを返す。
+ *
+ * 作ったマクロは呼び出し側のマクロの表で管理するので、#undefされた後に再び現れることは無い。
+ */
+MacroPtr MacroSnapshot::take(const std::string& name) {
+    auto it = index_.find(name);
+    if (it == index_.end()) {
+        return nullptr;
+    }
+    const auto offset = it->second;
+    index_.erase(it);
+
+    SnapshotReader r(file_.data(), file_.size());
+    r.take(offset);
+
+    const bool is_function = (r.u32() != 0);
+    std::string source(r.string());
+    const auto line = r.u32();
+    const auto column = r.u32();
+
+    Macro::ParamList params(r.count(kMinParamSize));
+    for (auto& p : params) {
+        p = r.string();
+    }
+
+    TokenList replist(r.count(kMinTokenSize));
+    for (auto& t : replist) {
+        auto type = static_cast<TokenType>(r.u32());
+        auto t_line = r.u32();
+        auto t_column = r.u32();
+        t = Token(std::string(r.string()), type, t_line, t_column);
+    }
+
+    Token name_token(name, TokenType::kIdentifier, line, column);
+    if (is_function) {
+        return Macro::create_macro(name, params, replist, source, name_token);
+    }
+    return Macro::create_macro(name, replist, source, name_token);
+}
+
+/**
+ * 残っているマクロを全て作って macrosに加える。macrosに同じ名前のマクロがあれば、そちらを残す。
+ */
+void MacroSnapshot::take_all(MacroSet& macros) {
+    std::vector<std::string> names;
+    names.reserve(index_.size());
+    for (const auto& [name, offset] : index_) {
+        names.emplace_back(name);
+    }
+    for (const auto& name : names) {
+        auto m = take(name);
+        macros.insert({ name, move(m) });
+    }
+}
+
+void MacroSnapshot::drop(const std::string& name) {
+    index_.erase(name);
+}
+
+}   // namespace pp
@@ -0,0 +1,86 @@
+#ifndef CC_PREPROCESSOR_MACROSNAPSHOT_H_
+#define CC_PREPROCESSOR_MACROSNAPSHOT_H_
+
+#include <cstdint>
+#include <filesystem>
+#include <iosfwd>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "pp_config.h"
+#include "filecache.h"
+#include "includecache.h"
+#include "mappedfile.h"
+#include "preprocessor.h"
+
+namespace pp {
+
+/**
+ * ヘッダーを処理した後のマクロの状態。(cpp --emit-macro-snapshot、--use-macro-snapshot)
+ *
+ * 定義済みマクロ以外のマクロ、処理したファイルのインクルードガード、処理したファイルの一覧と、
+ * 処理したときのコマンドラインでのマクロの定義 (-D、-U)を持つ。
+ * ファイルはメモリーにマップし、マクロは名前の索引だけを作っておいて、使われたときに Macroを作る。
+ * インクルードガードの有るファイルは使うときに読み飛ばすので、その中にテキストが有れば作成時にエラーにする。
+ *
+ * 形式: マジックナンバー ("CPPS")、バージョン、コマンドラインでのマクロの定義、依存ファイル、インクルードガード、
+ * __has_include、__has_embedを含むマクロが有るか、マクロの索引、マクロの定義。
+ * 数値はリトルエンディアンで、文字列はサイズと内容。形式が正しくなければ、コンストラクターで std::runtime_errorを送出する。
+ */
+class MacroSnapshot {
+public:
+    static constexpr std::uint32_t kMagic = 0x53505043;     // "CPPS"
+    static constexpr std::uint32_t kVersion = 2;
+
+    /**
+     * スナップショットを作るときに処理したファイル。更新日時とサイズが同じか、内容のハッシュが同じなら有効。
+     */
+    struct Dependency {
+        String path;
+        std::int64_t last_write_time;
+        std::uint64_t size;
+        std::uint64_t hash;
+    };
+
+    static Dependency make_dependency(const String& path, const std::string& content);
+    static void write(std::ostream& output,
+                      const std::vector<std::string>& macro_operations,
+                      const std::vector<Dependency>& dependencies,
+                      const std::vector<std::pair<String, IncludeCache::IncludeGuard>>& include_guards,
+                      const MacroSet& macros);
+
+    explicit MacroSnapshot(const std::filesystem::path& path);
+    MacroSnapshot(const MacroSnapshot&) = delete;
+    ~MacroSnapshot();
+
+    MacroSnapshot& operator=(const MacroSnapshot&) = delete;
+
+    const std::vector<std::string>& macro_operations() const { return macro_operations_; }
+    const std::vector<Dependency>& dependencies() const { return dependencies_; }
+    const std::vector<std::pair<String, IncludeCache::IncludeGuard>>& include_guards() const { return include_guards_; }
+    std::size_t num_macros() const { return index_.size(); }
+    // 置換リストに __has_includeか __has_embedを含むマクロが有るか。(Macro::checks_resource)
+    bool checks_resource() const { return checks_resource_; }
+
+    bool is_up_to_date(FileSystem& file_system, String* stale_path) const;
+    bool contains(const std::string& name) const;
+    MacroPtr take(const std::string& name);
+    void take_all(MacroSet& macros);
+    void drop(const std::string& name);
+
+private:
+    MappedFile file_;
+    std::vector<std::string> macro_operations_;
+    std::vector<Dependency> dependencies_;
+    std::vector<std::pair<String, IncludeCache::IncludeGuard>> include_guards_;
+    bool checks_resource_;
+    // マクロ名から定義の位置。名前はマップしたファイルを指す。
+    std::unordered_map<std::string_view, std::uint32_t> index_;
+};
+
+}   // namespace pp
+
+#endif  // CC_PREPROCESSOR_MACROSNAPSHOT_H_
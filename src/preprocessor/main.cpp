@@ -7,7 +7,11 @@
 #include "util/logger.h"
 #include "util/utility.h"
 
+#include "batchrunner.h"
+#include "lexonly.h"
 #include "preprocessor.h"
+#include "server.h"
+#include "tokenfile.h"
 
 using namespace lib::util;
 using namespace pp;
@@ -35,6 +39,28 @@ int main(int argc, char* argv[]) {
             return EXIT_FAILURE;
         }
 
+        if (!opts.dump_filepath().empty()) {
+            return dump_token_file(opts.dump_filepath(), cout);
+        }
+        if (opts.lex_only() != LexOnlyOutput::kNone) {
+            Diagnostics diag;
+            return run_lex_only(opts, diag, cout, cerr);
+        }
+
+        if (!opts.server_socket_path().empty()) {
+            Server server(opts);
+            return server.run();
+        }
+        if (!opts.connect_socket_path().empty()) {
+            Client client(opts);
+            return client.run(args);
+        }
+
+        if (opts.batch_mode()) {
+            BatchRunner runner(opts);
+            return runner.run();
+        }
+
         Diagnostics diag;
         SourceFileStack sources;
         Preprocessor pp(opts, diag, sources);
@@ -0,0 +1,160 @@
+#include "mappedfile.h"
+
+#include <cstdint>
+#include <system_error>
+#include <utility>
+
+#if HOST_PLATFORM == PLATFORM_WINDOWS
+#include <Windows.h>
+#include "win32util/error.h"
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+#if HOST_PLATFORM == PLATFORM_WINDOWS
+/**
+ * ファイルとマッピングのハンドルは、ビューを作ったら閉じても良い。
+ */
+class ScopedHandle {
+public:
+    explicit ScopedHandle(HANDLE handle)
+        : handle_(handle) {
+    }
+    ScopedHandle(const ScopedHandle&) = delete;
+    ~ScopedHandle() {
+        if (handle_ && handle_ != INVALID_HANDLE_VALUE) {
+            CloseHandle(handle_);
+        }
+    }
+
+    ScopedHandle& operator=(const ScopedHandle&) = delete;
+
+    HANDLE get() const { return handle_; }
+
+private:
+    HANDLE handle_;
+};
+
+std::pair<const char*, std::size_t> map_file(const filesystem::path& path) {
+    ScopedHandle file(CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+    if (file.get() == INVALID_HANDLE_VALUE) {
+        lib::win32util::raise_win32_error("CreateFileW");
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file.get(), &size)) {
+        lib::win32util::raise_win32_error("GetFileSizeEx");
+    }
+    if (size.QuadPart == 0) {
+        return { nullptr, 0 };
+    }
+    if (static_cast<std::uint64_t>(size.QuadPart) > SIZE_MAX) {
+        throw system_error(make_error_code(errc::file_too_large), "MappedFile");
+    }
+
+    ScopedHandle mapping(CreateFileMappingW(file.get(), nullptr, PAGE_READONLY, 0, 0, nullptr));
+    if (!mapping.get()) {
+        lib::win32util::raise_win32_error("CreateFileMappingW");
+    }
+
+    auto view = MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, 0);
+    if (!view) {
+        lib::win32util::raise_win32_error("MapViewOfFile");
+    }
+    return { static_cast<const char*>(view), static_cast<std::size_t>(size.QuadPart) };
+}
+
+void unmap_file(const char* data, std::size_t) {
+    UnmapViewOfFile(data);
+}
+#else
+[[noreturn]]
+void raise_mapping_error(const char* message) {
+    throw system_error(error_code(errno, generic_category()), message);
+}
+
+std::pair<const char*, std::size_t> map_file(const filesystem::path& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        raise_mapping_error("open");
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        int e = errno;
+        ::close(fd);
+        errno = e;
+        raise_mapping_error("fstat");
+    }
+    if (st.st_size == 0) {
+        ::close(fd);
+        return { nullptr, 0 };
+    }
+
+    auto size = static_cast<std::size_t>(st.st_size);
+    void* p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int e = errno;
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        errno = e;
+        raise_mapping_error("mmap");
+    }
+    return { static_cast<const char*>(p), size };
+}
+
+void unmap_file(const char* data, std::size_t size) {
+    ::munmap(const_cast<char*>(data), size);
+}
+#endif
+
+}   // anonymous namespace
+
+namespace pp {
+
+MappedFile::MappedFile()
+    : data_()
+    , size_() {
+}
+
+MappedFile::MappedFile(const std::filesystem::path& path)
+    : data_()
+    , size_() {
+    tie(data_, size_) = map_file(path);
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+    : data_(exchange(other.data_, nullptr))
+    , size_(exchange(other.size_, 0)) {
+}
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& rhs) noexcept {
+    if (this != &rhs) {
+        close();
+        data_ = exchange(rhs.data_, nullptr);
+        size_ = exchange(rhs.size_, 0);
+    }
+    return *this;
+}
+
+void MappedFile::close() {
+    if (data_) {
+        unmap_file(data_, size_);
+        data_ = nullptr;
+        size_ = 0;
+    }
+}
+
+}   // namespace pp
@@ -0,0 +1,39 @@
+#ifndef CC_PREPROCESSOR_MAPPEDFILE_H_
+#define CC_PREPROCESSOR_MAPPEDFILE_H_
+
+#include <cstddef>
+#include <filesystem>
+
+#include "config.h"
+
+namespace pp {
+
+/**
+ * 読み込み専用でメモリーにマップしたファイル。
+ *
+ * エラーは std::system_errorで送出する。空のファイルは data()が nullptrになる。
+ */
+class MappedFile {
+public:
+    MappedFile();
+    explicit MappedFile(const std::filesystem::path& path);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other) noexcept;
+    ~MappedFile();
+
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile& operator=(MappedFile&& rhs) noexcept;
+
+    const char* data() const { return data_; }
+    std::size_t size() const { return size_; }
+
+    void close();
+
+private:
+    const char* data_;
+    std::size_t size_;
+};
+
+}   // namespace pp
+
+#endif  // CC_PREPROCESSOR_MAPPEDFILE_H_
@@ -1,6 +1,10 @@
 #include "options.h"
 
+#include <algorithm>
+#include <fstream>
+#include <limits>
 #include <ranges>
+#include <thread>
 
 #include "util/logger.h"
 
@@ -11,6 +15,48 @@ namespace {
 
 const pp::StringView kUnknownOptionError = T_("不明なオプション {}が指定された。\n");
 const pp::StringView kNoOptionParameterError = T_("オプション {}の値が指定されていない。\n");
+const pp::StringView kInvalidOptionValueError = T_("オプション {}の値が正しくない。\n");
+const pp::StringView kResponseFileError = T_("レスポンスファイル {}を読み込めない。\n");
+const pp::StringView kTextReportFormatError = T_("{}はエラー出力にテキストで出力するので、-fdiagnostics-format=textのときだけ使える。\n");
+
+/**
+ * パスを base_dirからの相対パスとして絶対パスにする。
+ */
+pp::String absolute_path(const pp::String& base_dir, const pp::String& path) {
+    if (path.empty() || path == T_("-")) {
+        return path;
+    }
+
+    Path p = path_string(path);
+    if (p.is_absolute()) {
+        return path;
+    }
+    return internal_string((Path(path_string(base_dir)) / p).lexically_normal());
+}
+
+constexpr std::size_t kDefaultMaxExpansionDepth = 100000;
+constexpr std::size_t kDefaultFileCacheSize = 256 * 1024 * 1024;
+
+bool parse_size(pp::StringView s, std::size_t* result) {
+    if (s.empty()) {
+        return false;
+    }
+
+    std::size_t value = 0;
+    for (auto c : s) {
+        if (c < T_('0') || T_('9') < c) {
+            return false;
+        }
+        auto digit = static_cast<std::size_t>(c - T_('0'));
+        if (value > (std::numeric_limits<std::size_t>::max() - digit) / 10) {
+            return false;
+        }
+        value = value * 10 + digit;
+    }
+
+    *result = value;
+    return true;
+}
 
 }   // anonymous namespace
 
@@ -24,9 +70,26 @@ Options::Options() {
     output_line_directive_ = true;
     output_comment_ = false;
     support_trigraphs_ = false;
+    memoize_expansion_ = false;
+    max_expansion_depth_ = kDefaultMaxExpansionDepth;
+    file_cache_size_ = kDefaultFileCacheSize;
+    token_output_format_ = TokenOutputFormat::kText;
+    emit_macro_snapshot_ = false;
+    dependency_output_ = DependencyOutput::kNone;
+    dependency_format_ = DependencyFormat::kMake;
+    deps_fast_scan_ = false;
+    compact_output_ = false;
+    diagnostics_limit_ = 0;
+    diagnostics_format_ = DiagnosticFormat::kText;
+    time_report_ = false;
+    macro_stats_ = false;
+    lex_only_ = LexOnlyOutput::kNone;
     //system_inculde_dirs_;
     //additional_include_dirs_;
     //macro_operations_;
+    jobs_ = 1;
+    batch_requested_ = false;
+    batch_translation_unit_ = false;
 }
 
 Options::~Options() {
@@ -36,6 +99,10 @@ const String& Options::input_filepath() const {
     return input_filepath_;
 }
 
+const std::vector<String>& Options::input_filepaths() const {
+    return input_filepaths_;
+}
+
 const String& Options::output_filepath() const {
     return output_filepath_;
 }
@@ -56,6 +123,22 @@ bool Options::support_trigraphs() const {
     return support_trigraphs_;
 }
 
+bool Options::memoize_expansion() const {
+    return memoize_expansion_;
+}
+
+std::size_t Options::max_expansion_depth() const {
+    return max_expansion_depth_;
+}
+
+std::size_t Options::file_cache_size() const {
+    return file_cache_size_;
+}
+
+TokenOutputFormat Options::token_output_format() const {
+    return token_output_format_;
+}
+
 const std::vector<String>& Options::system_include_dirs() const {
     return system_include_dirs_;
 }
@@ -68,17 +151,174 @@ const std::vector<MacroDefinitionOperation>& Options::macro_operations() const {
     return macro_operations_;
 }
 
+std::size_t Options::jobs() const {
+    return jobs_;
+}
+
+/**
+ * 複数の翻訳単位をまとめて処理するか。
+ *
+ * 入力ファイルが複数指定されたか、レスポンスファイルで指定された場合。
+ */
+bool Options::batch_mode() const {
+    return !batch_translation_unit_ && (batch_requested_ || input_filepaths_.size() > 1);
+}
+
+/**
+ * まとめて処理している翻訳単位のうちの 1つか。
+ */
+bool Options::batch_translation_unit() const {
+    return batch_translation_unit_;
+}
+
+const String& Options::server_socket_path() const {
+    return server_socket_path_;
+}
+
+const String& Options::connect_socket_path() const {
+    return connect_socket_path_;
+}
+
+const String& Options::dump_filepath() const {
+    return dump_filepath_;
+}
+
+bool Options::emit_macro_snapshot() const {
+    return emit_macro_snapshot_;
+}
+
+const String& Options::macro_snapshot_path() const {
+    return macro_snapshot_path_;
+}
+
+DependencyOutput Options::dependency_output() const {
+    return dependency_output_;
+}
+
+DependencyFormat Options::dependency_format() const {
+    return dependency_format_;
+}
+
+/**
+ * 依存ファイルの出力先。(-MF) 空なら Preprocessorが決める。
+ */
+const String& Options::dependency_filepath() const {
+    return dependency_filepath_;
+}
+
+/**
+ * 依存ファイルのルールのターゲット。(-MT) 空なら Preprocessorが決める。
+ */
+const String& Options::dependency_target() const {
+    return dependency_target_;
+}
+
+/**
+ * 出力しないとき (-M、--emit-macro-snapshot)に、テキスト行のマクロを展開せずに読み飛ばすか。
+ *
+ * 置換リストに __has_include、__has_embedを含むマクロが定義された後は、依存ファイルが変わらないように
+ * テキスト行も展開する。読み飛ばしたテキスト行の診断メッセージ (引数の数の誤りなど)は出ない。
+ */
+bool Options::deps_fast_scan() const {
+    return deps_fast_scan_;
+}
+
+/**
+ * 空白を出力せず、トークンがくっついてしまうところにだけ空白を 1つ入れるか。
+ */
+bool Options::compact_output() const {
+    return compact_output_;
+}
+
+std::size_t Options::diagnostics_limit() const {
+    return diagnostics_limit_;
+}
+
+DiagnosticFormat Options::diagnostics_format() const {
+    return diagnostics_format_;
+}
+
+bool Options::time_report() const {
+    return time_report_;
+}
+
+/**
+ * ファイルごとの処理のトレースの出力先。(--trace-includes) 空なら出力しない。
+ */
+const String& Options::trace_includes_filepath() const {
+    return trace_includes_filepath_;
+}
+
+/**
+ * 展開したマクロごとの統計をエラー出力に出力するか。(--macro-stats)
+ */
+bool Options::macro_stats() const {
+    return macro_stats_;
+}
+
+/**
+ * プリプロセスせずに、入力ファイルを字句解析だけするか。(--lex-only)
+ */
+LexOnlyOutput Options::lex_only() const {
+    return lex_only_;
+}
+
+/**
+ * インクルードパスを指定する環境変数の名前。
+ */
+// static
+const std::vector<String>& Options::include_env_var_names() {
+#if HOST_PLATFORM == PLATFORM_WINDOWS
+    static const std::vector<String> names = { T_("INCLUDE") };
+#else
+    static const std::vector<String> names = { T_("CPATH"), T_("C_INCLUDE_PATH") };
+#endif
+    return names;
+}
+
+/**
+ * まとめて処理する翻訳単位のうちの 1つ用のオプションを作る。
+ */
+Options Options::translation_unit_options(const String& input, const String& output, const String& error_log) const {
+    Options opts(*this);
+    opts.input_filepath_ = input;
+    opts.input_filepaths_ = { input };
+    opts.output_filepath_ = output;
+    opts.error_log_filepath_ = error_log;
+    //  依存ファイルの出力先とターゲットは、翻訳単位ごとに決める。
+    opts.dependency_filepath_.clear();
+    opts.dependency_target_.clear();
+    //  トレースは、出力先 (無ければ入力ファイル名)の拡張子を .trace.jsonにしたものに出力する。
+    if (!trace_includes_filepath_.empty()) {
+        Path p(path_string(output.empty() ? input : output));
+        if (output.empty()) {
+            p = p.filename();
+        }
+        opts.trace_includes_filepath_ = internal_string(p.replace_extension(T_(".trace.json")));
+    }
+    opts.batch_translation_unit_ = true;
+    return opts;
+}
 
 
 
-bool Options::parse_env_var(const Char* name) {
+
+bool Options::parse_env_var(const String& name, const Environment* env) {
 #if HOST_PLATFORM == PLATFORM_WINDOWS
     constexpr auto separator = T_(';');
 #else
     constexpr auto separator = T_(':');
 #endif
 
-    auto inc_path = get_env_var(name);
+    std::optional<String> inc_path;
+    if (env) {
+        auto it = env->variables.find(name);
+        if (it != env->variables.end()) {
+            inc_path = it->second;
+        }
+    } else {
+        inc_path = get_env_var(name.c_str());
+    }
     if (inc_path && !(*inc_path).empty()) {
         auto paths = static_cast<StringView>(*inc_path);
         for (auto r : paths | views::split(separator)) {
@@ -92,24 +332,75 @@ bool Options::parse_env_var(const Char* name) {
     return true;
 }
 
-bool Options::parse_options(const std::vector<String>& args) {
-    if (ssize(args) > numeric_limits<int>::max()) {
-        return false;   // too many options
+/**
+ * レスポンスファイルから入力ファイルを読み込む。
+ *
+ * 1行に 1ファイル。空行と '#'で始まる行は無視する。
+ */
+bool Options::parse_response_file(const String& path, const Environment* env) {
+    ifstream input(path_string(env ? absolute_path(env->working_dir, path) : path));
+    if (!input.is_open()) {
+        log_error(kResponseFileError, path);
+        return false;
     }
 
-    // 環境変数で指定されるインクルードパスは、ここで先に解析する。
-#if HOST_PLATFORM == PLATFORM_WINDOWS
-    if (!parse_env_var(T_("INCLUDE"))) {
-        return false;
+    std::string line;
+    while (getline(input, line)) {
+        auto file = trim_string(internal_from_source(line));
+        if (file.empty() || file[0] == T_('#')) {
+            continue;
+        }
+        if (input_filepath_.empty()) {
+            input_filepath_ = file;
+        }
+        input_filepaths_.push_back(move(file));
     }
-#else
-    if (!parse_env_var(T_("CPATH"))) {
+    if (input.bad()) {
+        log_error(kResponseFileError, path);
         return false;
     }
-    if (!parse_env_var(T_("C_INCLUDE_PATH"))) {
-        return false;
+
+    batch_requested_ = true;
+    return true;
+}
+
+/**
+ * 相対パスを、base_dirからの相対パスとして絶対パスにする。
+ */
+void Options::resolve_paths(const String& base_dir) {
+    input_filepath_ = absolute_path(base_dir, input_filepath_);
+    for (auto& path : input_filepaths_) {
+        path = absolute_path(base_dir, path);
+    }
+    output_filepath_ = absolute_path(base_dir, output_filepath_);
+    error_log_filepath_ = absolute_path(base_dir, error_log_filepath_);
+    macro_snapshot_path_ = absolute_path(base_dir, macro_snapshot_path_);
+    dependency_filepath_ = absolute_path(base_dir, dependency_filepath_);
+    trace_includes_filepath_ = absolute_path(base_dir, trace_includes_filepath_);
+    for (auto& dir : system_include_dirs_) {
+        dir = absolute_path(base_dir, dir);
+    }
+    for (auto& dir : additional_include_dirs_) {
+        dir = absolute_path(base_dir, dir);
+    }
+}
+
+/**
+ * オプションを解析する。
+ *
+ * envが指定されたら、環境変数はそこから取得し、相対パスはその working_dirからのものとして扱う。
+ */
+bool Options::parse_options(const std::vector<String>& args, const Environment* env) {
+    if (ssize(args) > numeric_limits<int>::max()) {
+        return false;   // too many options
+    }
+
+    // 環境変数で指定されるインクルードパスは、ここで先に解析する。
+    for (const auto& name : include_env_var_names()) {
+        if (!parse_env_var(name, env)) {
+            return false;
+        }
     }
-#endif
 
     // 以下、コマンドラインのオプション。
     int argc = static_cast<int>(ssize(args));
@@ -122,6 +413,7 @@ bool Options::parse_options(const std::vector<String>& args) {
                 if (input_filepath_.empty()) {
                     input_filepath_ = arg;
                 }
+                input_filepaths_.push_back(arg);
                 break;
             case 'I': {
                 String path;
@@ -171,11 +463,40 @@ bool Options::parse_options(const std::vector<String>& args) {
                 macro_operations_.push_back({ MacroDefinitionOperationType::kUndefine, name });
                 break;
             }
+            case 'M': {
+                if (arg == T_("-M")) {
+                    dependency_output_ = DependencyOutput::kOnly;
+                } else if (arg == T_("-MD")) {
+                    dependency_output_ = DependencyOutput::kWithPreprocessed;
+                } else if (arg.starts_with(T_("-MF")) || arg.starts_with(T_("-MT"))) {
+                    String value;
+                    if (arg[3] != T_('\0')) {
+                        value = &arg[3];
+                    } else {
+                        if ((i + 1) < argc) {
+                            value = args[i + 1];
+                            i++;
+                        } else {
+                            log_error(kNoOptionParameterError, arg);
+                            return false;
+                        }
+                    }
+                    if (arg[2] == T_('F')) {
+                        dependency_filepath_ = value;
+                    } else {
+                        dependency_target_ = value;
+                    }
+                } else {
+                    log_error(kUnknownOptionError, arg);
+                    return false;
+                }
+                break;
+            }
+            case 'P': {
+                output_line_directive_ = false;
+                break;
+            }
             //  TODO: 将来的には。
-            //case 'P': {
-            //    output_line_directive_ = false;
-            //    break;
-            //}
             //case 'C': {
             //    output_comment_ = true;
             //    break;
@@ -214,37 +535,227 @@ bool Options::parse_options(const std::vector<String>& args) {
                 error_log_filepath_ = path;
                 break;
             }
+            case 'j': {
+                String jobs;
+                if (arg[2] != T_('\0')) {
+                    jobs = &arg[2];
+                } else {
+                    if ((i + 1) < argc) {
+                        jobs = args[i + 1];
+                        i++;
+                    } else {
+                        log_error(kNoOptionParameterError, arg[1]);
+                        return false;
+                    }
+                }
+                if (!parse_size(jobs, &jobs_)) {
+                    log_error(kInvalidOptionValueError, arg[1]);
+                    return false;
+                }
+                if (jobs_ == 0) {
+                    jobs_ = std::max(1u, thread::hardware_concurrency());
+                }
+                break;
+            }
             case 't':
                 if (arg == T_("-trigraphs")) {
                     support_trigraphs_ = true;
                 }
                 break;
+            case 'f':
+                if (arg == T_("-fmemoize-expansion")) {
+                    memoize_expansion_ = true;
+                } else if (arg == T_("-fdeps-fast-scan")) {
+                    deps_fast_scan_ = true;
+                } else if (arg == T_("-fcompact-output")) {
+                    compact_output_ = true;
+                } else if (arg.starts_with(T_("-fmax-expansion-depth="))) {
+                    constexpr auto prefix_len = StringView(T_("-fmax-expansion-depth=")).length();
+                    if (!parse_size(StringView(arg).substr(prefix_len), &max_expansion_depth_)) {
+                        log_error(kInvalidOptionValueError, arg);
+                        return false;
+                    }
+                } else if (arg.starts_with(T_("-ffile-cache-size="))) {
+                    constexpr auto prefix_len = StringView(T_("-ffile-cache-size=")).length();
+                    if (!parse_size(StringView(arg).substr(prefix_len), &file_cache_size_)) {
+                        log_error(kInvalidOptionValueError, arg);
+                        return false;
+                    }
+                } else if (arg.starts_with(T_("-fdiagnostics-limit="))) {
+                    constexpr auto prefix_len = StringView(T_("-fdiagnostics-limit=")).length();
+                    if (!parse_size(StringView(arg).substr(prefix_len), &diagnostics_limit_)) {
+                        log_error(kInvalidOptionValueError, arg);
+                        return false;
+                    }
+                } else if (arg.starts_with(T_("-fdiagnostics-format="))) {
+                    constexpr auto prefix_len = StringView(T_("-fdiagnostics-format=")).length();
+                    auto format = StringView(arg).substr(prefix_len);
+                    if (format == T_("text")) {
+                        diagnostics_format_ = DiagnosticFormat::kText;
+                    } else if (format == T_("jsonl")) {
+                        diagnostics_format_ = DiagnosticFormat::kJsonLines;
+                    } else if (format == T_("sarif")) {
+                        diagnostics_format_ = DiagnosticFormat::kSarif;
+                    } else {
+                        log_error(kInvalidOptionValueError, arg);
+                        return false;
+                    }
+                } else if (arg.starts_with(T_("-fdeps-format="))) {
+                    constexpr auto prefix_len = StringView(T_("-fdeps-format=")).length();
+                    auto format = StringView(arg).substr(prefix_len);
+                    if (format == T_("make")) {
+                        dependency_format_ = DependencyFormat::kMake;
+                    } else if (format == T_("json")) {
+                        dependency_format_ = DependencyFormat::kJson;
+                    } else {
+                        log_error(kInvalidOptionValueError, arg);
+                        return false;
+                    }
+                } else if (arg.starts_with(T_("-ftoken-output="))) {
+                    constexpr auto prefix_len = StringView(T_("-ftoken-output=")).length();
+                    auto format = StringView(arg).substr(prefix_len);
+                    if (format == T_("text")) {
+                        token_output_format_ = TokenOutputFormat::kText;
+                    } else if (format == T_("binary")) {
+                        token_output_format_ = TokenOutputFormat::kBinary;
+                    } else {
+                        log_error(kInvalidOptionValueError, arg);
+                        return false;
+                    }
+                } else {
+                    log_error(kUnknownOptionError, arg);
+                    return false;
+                }
+                break;
             case 'h':
                 return false;
 
+            case '-':
+                if (arg == T_("--server") || arg == T_("--connect") || arg == T_("--dump") ||
+                    arg == T_("--emit-macro-snapshot") || arg == T_("--use-macro-snapshot") ||
+                    arg == T_("--trace-includes")) {
+                    if ((i + 1) >= argc) {
+                        log_error(kNoOptionParameterError, arg);
+                        return false;
+                    }
+                    if (arg == T_("--server")) {
+                        server_socket_path_ = args[i + 1];
+                    } else if (arg == T_("--connect")) {
+                        connect_socket_path_ = args[i + 1];
+                    } else if (arg == T_("--dump")) {
+                        dump_filepath_ = args[i + 1];
+                    } else if (arg == T_("--emit-macro-snapshot")) {
+                        //  ヘッダーを入力ファイルとして処理し、-oにスナップショットを出力する。
+                        emit_macro_snapshot_ = true;
+                        if (input_filepath_.empty()) {
+                            input_filepath_ = args[i + 1];
+                        }
+                        input_filepaths_.push_back(args[i + 1]);
+                    } else if (arg == T_("--trace-includes")) {
+                        trace_includes_filepath_ = args[i + 1];
+                    } else {
+                        macro_snapshot_path_ = args[i + 1];
+                    }
+                    i++;
+                } else if (arg == T_("--time-report")) {
+                    time_report_ = true;
+                } else if (arg == T_("--macro-stats")) {
+                    macro_stats_ = true;
+                } else if (arg == T_("--lex-only")) {
+                    lex_only_ = LexOnlyOutput::kStatistics;
+                } else if (arg == T_("--lex-only=dump")) {
+                    lex_only_ = LexOnlyOutput::kTokens;
+                } else {
+                    log_error(kUnknownOptionError, arg);
+                    return false;
+                }
+                break;
+
             default:
                 log_error(kUnknownOptionError, arg[1]);
                 return false;
             }
+        } else if (arg[0] == T_('@')) {
+            if (!parse_response_file(arg.substr(1), env)) {
+                return false;
+            }
         } else {
             if (input_filepath_.empty()) {
                 input_filepath_ = arg;
             }
+            input_filepaths_.push_back(arg);
         }
     }
 
+    //  報告はエラー出力にテキストで書くので、JSON Lines、SARIFの診断メッセージと混ざらないようにする。
+    if (diagnostics_format_ != DiagnosticFormat::kText) {
+        const StringView report = time_report_ ? T_("--time-report")
+                : macro_stats_ ? T_("--macro-stats")
+                : (lex_only_ == LexOnlyOutput::kTokens) ? T_("--lex-only=dump")
+                : StringView();
+        if (!report.empty()) {
+            log_error(kTextReportFormatError, report);
+            return false;
+        }
+    }
+
+    if (env) {
+        resolve_paths(env->working_dir);
+    }
+
     return true;
 }
 
 void Options::print_usage() {
     puts("使い方: cpp [options] input");
+    puts("        cpp [options] [-j <n>] input... [@file]");
+    puts("        cpp --server <socket> [-j <n>]");
+    puts("        cpp --connect <socket> [options] input");
+    puts("        cpp --dump <file>");
+    puts("        cpp --lex-only[=dump] [options] input... [@file]");
+    puts("        cpp --emit-macro-snapshot <header> -o <file> [options]");
     puts("Options:\n");
     puts("-D <name>[=definition]\tマクロを定義する。");
     puts("-D <name(params)>[=definitiion]\tマクロを定義する。");
     puts("-U <name>\tマクロを削除する。");
     puts("-I <directory>\t\tインクルード検索パスを追加する。");
     puts("-o <file>\t出力先を指定する。(デフォルトは標準出力)");
+    puts("\t\t入力ファイルが複数の場合は出力先のディレクトリを指定する。(デフォルトはカレントディレクトリ)");
     puts("-e <file>\tエラー出力先を指定する。(デフォルトは標準エラー出力)");
+    puts("-P\t\t行マーカー (# 行番号 \"ファイル名\")を出力しない。");
+    puts("-M\t\t依存ファイルの一覧だけを出力する。(出力先は -MF、-oの順。どちらも無ければ標準出力)");
+    puts("-MD\t\tプリプロセスの結果と合わせて、依存ファイルの一覧を出力する。(出力先は -MF。無ければ出力先の拡張子を .dにしたもの)");
+    puts("-MF <file>\t依存ファイルの一覧の出力先を指定する。");
+    puts("-MT <target>\t依存ファイルの一覧のターゲットを指定する。(デフォルトは入力ファイルの拡張子を .oにしたもの)");
+    puts("-fdeps-fast-scan\t-Mで、テキスト行のマクロを展開せずに読み飛ばす。ディレクティブは通常通り処理する。");
+    puts("\t\t__has_include、__has_embedを含むマクロが定義された後は、テキスト行も展開する。");
+    puts("-fdeps-format=<make|json>\t依存ファイルの一覧の形式を指定する。(デフォルトは make)");
+    puts("-fmemoize-expansion\tマクロ引数の展開結果を同じ呼び出しの間で再利用する。");
+    puts("-fmax-expansion-depth=<n>\tマクロ呼び出しの入れ子の深さの上限を指定する。0は無制限。(デフォルトは 100000)");
+    puts("-ffile-cache-size=<bytes>\tソースファイルの内容をキャッシュする量の上限を指定する。(デフォルトは 256MiB)");
+    puts("-fcompact-output\t空白とコメントを出力せず、トークンがくっついてしまうところにだけ空白を入れる。");
+    puts("-fdiagnostics-limit=<n>\t同じ種類の診断メッセージを出力する数の上限を指定する。0は無制限。(デフォルトは 0)");
+    puts("-fdiagnostics-format=<text|jsonl|sarif>\t診断メッセージの形式を指定する。jsonl、sarifではメッセージの番号と分類も出力する。(デフォルトは text)");
+    puts("-ftoken-output=<text|binary>\t出力の形式を指定する。binaryはトークンのレコードの並び。(デフォルトは text)");
+    puts("-j <n>\t\t入力ファイルが複数の場合に、並行して処理する数を指定する。0はコア数。(デフォルトは 1)");
+    puts("@<file>\t\t入力ファイルの一覧をファイルから読み込む。");
+    puts("--server <socket>\tサーバーとして起動し、ソケットで要求を待つ。-jで同時に処理する数を指定する。");
+    puts("\t\t依頼はサーバーの権限で入出力のファイルを読み書きするので、接続はサーバーと同じユーザーに限る。");
+    puts("\t\tPOSIXではソケットを作ったユーザーだけがアクセスできるようにし、相手のユーザーも確かめる。");
+    puts("\t\tWindowsでは相手を確かめられないので、ソケットを置くディレクトリーのアクセス権で制限すること。");
+    puts("--connect <socket>\tサーバーに処理を依頼する。");
+    puts("--dump <file>\t-ftoken-output=binaryで出力したファイルの内容をテキストで出力する。");
+    puts("--emit-macro-snapshot <header>\tヘッダーを処理した後のマクロの状態を -oで指定したファイルに出力する。");
+    puts("\t\tインクルードガードの中にテキストが有るヘッダーは、使うときに読み飛ばすのでスナップショットにできない。");
+    puts("--use-macro-snapshot <file>\t--emit-macro-snapshotで出力した状態から処理を始める。");
+    puts("--time-report\t処理の区分ごとの時間と、時間のかかったマクロ、ファイルをエラー出力に出力する。");
+    puts("\t\t-fdiagnostics-format=textのときだけ使える。");
+    puts("--macro-stats\t展開したマクロごとの回数、展開結果のトークンの数、再走査の回数、入れ子の深さ、時間を、\n"
+         "\t\t自身の時間の長い順にエラー出力に出力する。-fdiagnostics-format=textのときだけ使える。");
+    puts("--lex-only[=dump]\tプリプロセスせずに、入力ファイルを字句解析だけして、トークンの種類ごとの数と速さを出力する。");
+    puts("\t\tdumpなら、トークンを行番号、桁とともに出力し、統計はエラー出力に出力する。(-fdiagnostics-format=textのときだけ)");
+    puts("--trace-includes <file>\tファイルごとの処理の時間とトークンの数を Chromeのトレースの形式で出力する。");
+    puts("\t\t入力ファイルが複数の場合は、出力先の拡張子を .trace.jsonにしたものに出力する。");
     puts("-h\t\tヘルプを出力する。");
 }
 
@@ -1,15 +1,52 @@
 #ifndef CC_PREPROCESSOR_OPTIONS_H_
 #define CC_PREPROCESSOR_OPTIONS_H_
 
+#include <map>
 #include <string>
 #include <vector>
 
 #include "util/utility.h"
 
 #include "pp_config.h"
+#include "diagnostics.h"
 
 namespace pp {
 
+/**
+ * 出力の形式。
+ */
+enum class TokenOutputFormat {
+    kText,
+    kBinary,
+};
+
+/**
+ * 依存ファイルの出力。(-M、-MD)
+ */
+enum class DependencyOutput {
+    kNone,
+    // 依存ファイルだけを出力する。
+    kOnly,
+    // プリプロセスの結果と合わせて出力する。
+    kWithPreprocessed,
+};
+
+enum class DependencyFormat {
+    kMake,
+    kJson,
+};
+
+/**
+ * 字句解析だけをするときの出力。(--lex-only)
+ */
+enum class LexOnlyOutput {
+    kNone,
+    // トークンの種類ごとの数と速さだけを出力する。
+    kStatistics,
+    // トークンを 1行に 1つずつ出力する。
+    kTokens,
+};
+
 enum class MacroDefinitionOperationType {
     kDefine,
     kUndefine,
@@ -37,6 +74,16 @@ private:
     String operand_;
 };
 
+/**
+ * オプションを解析する環境。
+ *
+ * サーバーモードで、クライアントのカレントディレクトリと環境変数で解析するためのもの。
+ */
+struct Environment {
+    String working_dir;
+    std::map<String, String> variables;
+};
+
 /**
  */
 class Options {
@@ -45,32 +92,88 @@ public:
     ~Options();
 
     const String& input_filepath() const;
+    const std::vector<String>& input_filepaths() const;
     const String& output_filepath() const;
     const String& error_log_filepath() const;
     bool output_line_directive() const;
     bool output_comment() const;
     bool support_trigraphs() const;
+    bool memoize_expansion() const;
+    std::size_t max_expansion_depth() const;
+    std::size_t file_cache_size() const;
+    TokenOutputFormat token_output_format() const;
     const std::vector<String>& system_include_dirs() const;
     const std::vector<String>& additional_include_dirs() const;
     const std::vector<MacroDefinitionOperation>& macro_operations() const;
-
-    bool parse_options(const std::vector<String>& args);
+    std::size_t jobs() const;
+    bool batch_mode() const;
+    bool batch_translation_unit() const;
+    const String& server_socket_path() const;
+    const String& connect_socket_path() const;
+    const String& dump_filepath() const;
+    bool emit_macro_snapshot() const;
+    const String& macro_snapshot_path() const;
+    DependencyOutput dependency_output() const;
+    DependencyFormat dependency_format() const;
+    const String& dependency_filepath() const;
+    const String& dependency_target() const;
+    bool deps_fast_scan() const;
+    bool compact_output() const;
+    std::size_t diagnostics_limit() const;
+    DiagnosticFormat diagnostics_format() const;
+    bool time_report() const;
+    const String& trace_includes_filepath() const;
+    bool macro_stats() const;
+    LexOnlyOutput lex_only() const;
+
+    Options translation_unit_options(const String& input, const String& output, const String& error_log) const;
+
+    bool parse_options(const std::vector<String>& args, const Environment* env = nullptr);
     void print_usage();
 
+    static const std::vector<String>& include_env_var_names();
+
 private:
-    bool parse_env_var(const Char* name);
+    bool parse_env_var(const String& name, const Environment* env);
+    bool parse_response_file(const String& path, const Environment* env);
+    void resolve_paths(const String& base_dir);
 
     String input_encoding_;
     String input_filepath_;
+    std::vector<String> input_filepaths_;
     String output_encoding_;
     String output_filepath_;
     String error_log_filepath_;
     bool output_line_directive_;
     bool output_comment_;
     bool support_trigraphs_;
+    bool memoize_expansion_;
+    std::size_t max_expansion_depth_;
+    std::size_t file_cache_size_;
+    TokenOutputFormat token_output_format_;
     std::vector<String> system_include_dirs_;
     std::vector<String> additional_include_dirs_;
     std::vector<MacroDefinitionOperation> macro_operations_;
+    std::size_t jobs_;
+    bool batch_requested_;
+    bool batch_translation_unit_;
+    String server_socket_path_;
+    String connect_socket_path_;
+    String dump_filepath_;
+    bool emit_macro_snapshot_;
+    String macro_snapshot_path_;
+    DependencyOutput dependency_output_;
+    DependencyFormat dependency_format_;
+    String dependency_filepath_;
+    String dependency_target_;
+    bool deps_fast_scan_;
+    bool compact_output_;
+    std::size_t diagnostics_limit_;
+    DiagnosticFormat diagnostics_format_;
+    bool time_report_;
+    String trace_includes_filepath_;
+    bool macro_stats_;
+    LexOnlyOutput lex_only_;
 };
 
 }   // namespace pp
@@ -1,6 +1,7 @@
 #include "preprocessor.h"
 
 #include <array>
+#include <bit>
 #include <cstdarg>
 #include <cstring>
 #include <format>
@@ -14,6 +15,8 @@
 #include "util/logger.h"
 #include "util/utility.h"
 
+#include "macrosnapshot.h"
+
 using namespace lib::util;
 using namespace std;
 
@@ -77,19 +80,63 @@ bool is_elif_group_directive(pp::TokenType type) {
     }
 }
 
+/**
+ * s[pos]以降で最初に現れる '"'か '\\'の位置を返す。無ければ s.length()を返す。
+ *
+ * 8バイトずつまとめて調べる (SWAR)。
+ */
+std::size_t find_escapable(std::string_view s, std::size_t pos) {
+    constexpr uint64_t kOnes = 0x0101010101010101ull;
+    constexpr uint64_t kHighs = 0x8080808080808080ull;
+    constexpr uint64_t kQuotes = kOnes * static_cast<unsigned char>('"');
+    constexpr uint64_t kBackslashes = kOnes * static_cast<unsigned char>('\\');
+
+    if constexpr (std::endian::native == std::endian::little) {
+        for (; pos + sizeof(uint64_t) <= s.length(); pos += sizeof(uint64_t)) {
+            uint64_t v;
+            memcpy(&v, s.data() + pos, sizeof(v));
+
+            // 一致したバイトを 0にして、0のバイトを探す。最下位の 0バイトの検出は正確。
+            const uint64_t q = v ^ kQuotes;
+            const uint64_t b = v ^ kBackslashes;
+            const uint64_t found = (((q - kOnes) & ~q) | ((b - kOnes) & ~b)) & kHighs;
+            if (found != 0) {
+                return pos + (std::countr_zero(found) / 8);
+            }
+        }
+    }
+
+    for (; pos < s.length(); pos++) {
+        if (s[pos] == '"' || s[pos] == '\\') {
+            return pos;
+        }
+    }
+
+    return s.length();
+}
+
+/**
+ * '"'と '\\'をエスケープして resultに追加する。
+ */
+void append_escaped(std::string& result, std::string_view s) {
+    std::size_t pos = 0;
+    while (pos < s.length()) {
+        const auto found = find_escapable(s, pos);
+        result.append(s.data() + pos, found - pos);
+        if (found == s.length()) {
+            break;
+        }
+        result += '\\';
+        result += s[found];
+        pos = found + 1;
+    }
+}
+
 std::string escape_string(const std::string& s) {
     string result;
     result.reserve(s.length());
 
-    for (auto c : s) {
-        if (c == '"') {
-            result += "\\\"";
-        } else if (c == '\\') {
-            result += "\\\\";
-        } else {
-            result += c;
-        }
-    }
+    append_escaped(result, s);
 
     return result;
 }
@@ -330,14 +377,110 @@ std::string strip_digit_separator(std::string_view s) {
     return result;
 }
 
+std::string make_spelling(const TokenList& replist) {
+    size_t len = 0;
+    for (const auto& t : replist) {
+        len += t.string().length();
+    }
+
+    std::string result;
+    result.reserve(len);
+    for (const auto& t : replist) {
+        if (t.type() != TokenType::kComment) {
+            result += t.string();
+        }
+    }
+
+    return result;
+}
+
+bool is_identifier_char(char c) {
+    return isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$' || c == '\\' || (static_cast<unsigned char>(c) >= 0x80);
+}
+
+/**
+ * 続けて出力すると、字句解析し直したときに別のトークンになってしまうか。(-fcompact-output)
+ *
+ * last_is_numberと last_charは前に出力したものが pp-numberかと最後の文字、nextは次に出力するトークン。
+ * 正確な判定ではなく、くっつく可能性があるものは全て trueにする。
+ */
+bool tokens_would_merge(bool last_is_number, char last_char, std::string_view next) {
+    //  2文字以上の区切り子の、先頭の 2文字。"%:%:"は 2つ目と 3つ目の文字。
+    static constexpr std::string_view kPunctuatorPairs[] = {
+        "++", "--", "+=", "-=", "->", "*=", "/=", "%=", "<<", ">>", "<=", ">=", "==", "!=",
+        "&&", "||", "&=", "|=", "^=", "##", "..", "<:", ":>", "<%", "%>", "%:", ":%", "::",
+        "//", "/*",
+    };
+
+    if (next.empty()) {
+        return false;
+    }
+    const char c = next.front();
+    if (last_is_number) {
+        //  pp-numberは最後の文字が何であっても ("1."でも)、識別子の文字と '.'、桁区切りの '\''を取り込む。
+        //  指数部の後なら符号も取り込む。
+        if (is_identifier_char(c) || c == '.' || c == '\'' ||
+            ((c == '+' || c == '-') && string_view("eEpP").find(last_char) != string_view::npos)) {
+            return true;
+        }
+    }
+    if (is_identifier_char(last_char)) {
+        //  識別子や数値が続くか、接頭辞付きの文字列リテラル、文字定数になる。
+        return is_identifier_char(c) || c == '"' || c == '\'';
+    }
+    if (last_char == '.' && isdigit(static_cast<unsigned char>(c))) {
+        return true;
+    }
+    const char pair[] = { last_char, c };
+    return find(begin(kPunctuatorPairs), end(kPunctuatorPairs), string_view(pair, 2)) != end(kPunctuatorPairs);
+}
+
+bool is_pp_number_spelling(std::string_view s) {
+    return !s.empty() &&
+            (isdigit(static_cast<unsigned char>(s[0])) ||
+             (s[0] == '.' && s.size() > 1 && isdigit(static_cast<unsigned char>(s[1]))));
+}
+
+/**
+ * コマンドラインでのマクロの定義と削除を、スナップショットに記録する形にする。
+ */
+std::vector<std::string> macro_operation_strings(const Options& opts) {
+    std::vector<std::string> result;
+    for (const auto& op : opts.macro_operations()) {
+        const char* prefix = (op.operation() == MacroDefinitionOperationType::kDefine) ? "-D" : "-U";
+        result.push_back(prefix + source_string(op.operand()));
+    }
+    return result;
+}
+
+/**
+ * ログ用のメッセージの末尾の改行を除いて、診断メッセージにする。
+ */
+StringView without_new_line(StringView format) {
+    return format.ends_with(T_('\n')) ? format.substr(0, format.size() - 1) : format;
+}
+
 }   // anonymous namespace
 
 namespace pp {
 
+//  この数より多く行が空くなら、空行の代わりに行マーカーを出力する。
+constexpr std::uint32_t kMaxBlankLinesWithoutMarker = 8;
+
+//  --time-reportで出力するマクロとファイルの数。
+constexpr std::size_t kTimeReportTopCount = 20;
+
 const StringView kNoInputError = T_("入力ファイルが指定されていない。\n");
 const StringView kNoSuchFileError = T_("ファイルが開けない: {}\n");
 const StringView kFileOutputError = T_("出力に失敗した。\n");
 const StringView kErrorFileOutputError = T_("エラー出力に失敗した。\n");
+const StringView kNoSnapshotOutputError = T_("スナップショットの出力先 (-o)が指定されていない。\n");
+const StringView kInvalidSnapshotWarning = T_("スナップショットを使わずに処理する ({}): {}\n");
+const StringView kBrokenSnapshotError = T_("スナップショットからマクロを読めない ({}): {}\n");
+const StringView kStaleSnapshotWarning = T_("スナップショットを使わずに処理する (ファイルが更新されている): {}\n");
+const StringView kSnapshotMacroOperationsWarning = T_("スナップショットを使わずに処理する (-D、-Uの指定が作成時と違う): {}\n");
+const StringView kSnapshotTextError = T_("インクルードガードの中にテキストが有るヘッダーは、スナップショットにできない。(スナップショットから始めると出力されない)\n");
+const StringView kProfilerDisabledWarning = T_("プロファイラーを組み込んでいないので、--time-report、--trace-includes、--macro-statsは無視する。\n");
 
 constexpr char kIdentPragma[] = "_Pragma";
 constexpr char kIdentDefined[] = "defined";
@@ -391,6 +534,12 @@ void Macro::reset(const TokenList& replist, const std::string& source, const Tok
     source_ = source;
     line_ = name_token.line();
     column_ = name_token.column();
+    spelling_ = make_spelling(replist);
+    checks_resource_ = any_of(replist.begin(), replist.end(), [](const auto& t) {
+        return t.type() == TokenType::kIdentifier && (t.string() == kIdentHasInclude || t.string() == kIdentHasEmbed);
+    });
+    plain_generation_ = numeric_limits<uint64_t>::max();
+    plain_ = false;
 }
 
 void Macro::reset(const ParamList& params, const TokenList& replist, const std::string& source, const Token& name_token) {
@@ -402,6 +551,12 @@ void Macro::reset(const ParamList& params, const TokenList& replist, const std::
     source_ = source;
     line_ = name_token.line();
     column_ = name_token.column();
+    spelling_ = make_spelling(replist);
+    checks_resource_ = any_of(replist.begin(), replist.end(), [](const auto& t) {
+        return t.type() == TokenType::kIdentifier && (t.string() == kIdentHasInclude || t.string() == kIdentHasEmbed);
+    });
+    plain_generation_ = numeric_limits<uint64_t>::max();
+    plain_ = false;
 }
 
 Macro::Macro(const std::string& name, const TokenList& replist, const std::string& source, const Token& name_token) {
@@ -463,28 +618,145 @@ bool IncludeSpec::is_double_quoted_form() const {
 }
 
 
-Preprocessor::Preprocessor(const Options& opts, Diagnostics& diag, SourceFileStack& sources)
+bool ExpansionMemo::find(const Macro* macro, const TokenList& arg, const MacroNameSet& used_names, std::uint64_t generation, TokenList& expanded) {
+    if (generation != generation_) {
+        entries_.clear();
+        num_tokens_ = 0;
+        generation_ = generation;
+    }
+
+    auto [first, last] = entries_.equal_range(key_of(macro, arg, used_names));
+    for (auto it = first; it != last; ++it) {
+        const Entry& e = it->second;
+        if (e.macro == macro && token_list_same_spelling(e.arg, arg) && e.used_names == used_names) {
+            ++hits_;
+            expanded = e.expanded;
+            for (size_t i = 0; i < expanded.size(); i++) {
+                if (e.origins[i] >= 0) {
+                    const Token& from = arg[e.origins[i]];
+                    expanded[i].line(from.line());
+                    expanded[i].column(from.column());
+                }
+            }
+            return true;
+        }
+    }
+
+    ++misses_;
+    return false;
+}
+
+void ExpansionMemo::store(const Macro* macro, const TokenList& arg, const MacroNameSet& used_names, const TokenList& expanded) {
+    const auto n = arg.size() + used_names.size() + expanded.size();
+    if (n > kMaxTokens) {
+        //  1つで上限を超えるものは記録しない。
+        return;
+    }
+    if (num_tokens_ + n > kMaxTokens) {
+        entries_.clear();
+        num_tokens_ = 0;
+    }
+    num_tokens_ += n;
+    entries_.insert({ key_of(macro, arg, used_names), Entry{ macro, arg, used_names, expanded, origins_of(arg, expanded) } });
+}
+
+/**
+ * 展開結果の各トークンが、引数のどのトークンをコピーしたものかを調べる。
+ *
+ * コピーしたトークンは字句の値を共有し、位置も同じなので、その 2つで引数のトークンと対応付ける。
+ * 置換リストから来たトークンや、連結や文字列化で作ったトークンは -1にする。
+ */
+// static
+std::vector<std::int32_t> ExpansionMemo::origins_of(const TokenList& arg, const TokenList& expanded) {
+    using Key = std::tuple<const Token::TokenValue*, std::uint32_t, std::uint32_t>;
+    std::vector<std::pair<Key, std::int32_t>> index;
+    index.reserve(arg.size());
+    for (size_t i = 0; i < arg.size(); i++) {
+        index.push_back({ Key{ arg[i].value(), arg[i].line(), arg[i].column() }, static_cast<std::int32_t>(i) });
+    }
+    sort(index.begin(), index.end());
+
+    std::vector<std::int32_t> origins(expanded.size(), -1);
+    for (size_t i = 0; i < expanded.size(); i++) {
+        const Key key{ expanded[i].value(), expanded[i].line(), expanded[i].column() };
+        auto it = lower_bound(index.begin(), index.end(), key, [](const auto& e, const Key& k) { return e.first < k; });
+        if (it != index.end() && it->first == key) {
+            origins[i] = it->second;
+        }
+    }
+    return origins;
+}
+
+// static
+std::size_t ExpansionMemo::key_of(const Macro* macro, const TokenList& arg, const MacroNameSet& used_names) {
+    size_t h = token_list_hash(arg);
+    h ^= hash<const Macro*>()(macro) + 0x9e3779b9 + (h << 6) + (h >> 2);
+
+    // 集合の並びに依存しないように、単純に足し合わせる。
+    size_t names = 0;
+    for (const auto& name : used_names) {
+        names += hash<string>()(name);
+    }
+    h ^= names + 0x9e3779b9 + (h << 6) + (h >> 2);
+
+    return h;
+}
+
+
+Preprocessor::Preprocessor(const Options& opts, Diagnostics& diag, SourceFileStack& sources,
+                           std::shared_ptr<IncludeCache> include_cache,
+                           std::shared_ptr<FileCache> file_cache)
     : opts_(opts)
     , diag_(diag)
     , sources_(sources)
     , include_dirs_()
     , diag_level_(DiagLevel::kWarning)
-    , clock_start_()
-    , clock_end_()
+    , start_time_()
+    , profiler_()
     , stream_stack_()
+    , standard_output_(&cout)
+    , standard_error_output_(&cerr)
     , output_(&cout)
     , output_buffer_()
     , output_file_()
     , error_output_(&cerr)
     , error_output_buffer_()
     , error_file_()
+    , token_sink_()
+    , own_token_sink_()
+    , output_batch_()
+    , output_file_stack_()
+    , output_file_ids_()
+    , expansion_count_()
     , macros_()
+    , macro_snapshot_()
+    , snapshot_dependencies_()
+    , snapshot_dependency_set_()
+    , dependencies_()
+    , emit_output_(true)
+    , skip_text_lines_()
+    , resource_check_macros_()
+    , compact_output_()
+    , output_last_is_number_()
+    , output_last_char_('\n')
+    , line_markers_()
+    , marker_line_()
+    , marker_path_()
+    , marker_pending_()
     , predef_macro_names_()
     , used_macro_names_()
+    , macro_generation_()
     , included_files_()
     , rescan_count_()
+    , expansion_memo_()
+    , impure_expansion_()
+    , include_cache_(include_cache ? move(include_cache) : make_shared<IncludeCache>())
+    , include_search_path_id_()
+    , file_cache_(file_cache ? move(file_cache) : make_shared<FileCache>(opts.file_cache_size()))
+    , file_system_(file_cache_)
+    , guard_states_()
 {
-    clock_start_ = clock();
+    start_time_ = chrono::steady_clock::now();
 }
 
 Preprocessor::~Preprocessor() {
@@ -499,6 +771,50 @@ bool Preprocessor::has_error() {
     return diag_.error_count() > 0;
 }
 
+/**
+ * 出力先、エラー出力先が指定されなかったときに使うものを変える。(デフォルトは標準出力と標準エラー出力)
+ */
+void Preprocessor::standard_streams(std::ostream* output, std::ostream* error_output) {
+    standard_output_ = output;
+    standard_error_output_ = error_output;
+}
+
+/**
+ * ソースファイルの読み込み方を変える。(デフォルトは FileCacheでディスクから読み込む)
+ */
+void Preprocessor::file_system(std::shared_ptr<FileSystem> file_system) {
+    file_system_ = move(file_system);
+}
+
+/**
+ * 出力を、テキストの代わりに sinkに渡す。出力先のファイルには何も出力しない。
+ */
+void Preprocessor::token_sink(TokenSink* sink) {
+    token_sink_ = sink;
+}
+
+/**
+ * ソースの位置の無いエラー (入出力のファイルが開けないなど)。引数は Stringだけ。
+ * ライブラリーとして使うとき (診断メッセージを handlerに渡すとき)は診断メッセージにし、そうでなければログに出力する。
+ */
+template <class... Ts>
+void Preprocessor::report_error(const StringView& format, const Ts&... args) {
+    if (diag_.has_handler()) {
+        diag_.error(nullptr, Location(0, 0), without_new_line(format), source_from_internal(args)...);
+    } else {
+        log_error(format, args...);
+    }
+}
+
+template <class... Ts>
+void Preprocessor::report_warning(const StringView& format, const Ts&... args) {
+    if (diag_.has_handler()) {
+        diag_.warning(nullptr, Location(0, 0), without_new_line(format), source_from_internal(args)...);
+    } else {
+        log_warning(format, args...);
+    }
+}
+
 int Preprocessor::run() {
     //  TODO: コマンドラインで指定されたもの以外でインクルードパスを追加するならここで。
 
@@ -512,69 +828,134 @@ int Preprocessor::run() {
     for (const auto& d : dirs) {
         include_dirs_.push_back(IncludeDir{ IncludeDir::kUser, d });
     }
+    include_search_path_id_ = include_cache_->search_path_id(include_dirs_);
 
     //
     String err_path = opts_.error_log_filepath();
     if (err_path.empty()) {
         //error_output_buffer_.resize(4 * 1024);
         //cerr.rdbuf()->pubsetbuf(error_output_buffer_.data(), error_output_buffer_.size());
-        error_output_ = &cerr;
+        error_output_ = standard_error_output_;
     } else {
         error_file_ = make_shared<ofstream>(path_string(err_path), ios_base::binary);
         if (!*error_file_) {
-            log_error(kNoSuchFileError, err_path.c_str());
+            report_error(kNoSuchFileError, err_path);
             return 1;
         }
         error_output_ = error_file_.get();
-        Logger::instance().set_output_stream(error_file_);
+        // 複数の翻訳単位を並行して処理しているときは、ログの出力先は共有なので切り替えない。
+        if (!opts_.batch_translation_unit()) {
+            Logger::instance().set_output_stream(error_file_);
+        }
     }
+    diag_.format(opts_.diagnostics_format());
     diag_.set_output(error_output_);
+    diag_.message_limit(opts_.diagnostics_limit());
+
+    if (opts_.time_report() || !opts_.trace_includes_filepath().empty() || opts_.macro_stats()) {
+        if (PP_PROFILER_ENABLED) {
+            profiler_ = make_unique<Profiler>();
+            profiler_->record_trace(!opts_.trace_includes_filepath().empty());
+        } else {
+            report_warning(kProfilerDisabledWarning);
+        }
+    }
+    Profiler::Activation profiler_activation(profiler_.get());
 
     //
-    String out_path = opts_.output_filepath();
-    if (out_path.empty()) {
-        //output_buffer_.resize(64 * 1024);
-        //cout.rdbuf()->pubsetbuf(output_buffer_.data(), output_buffer_.size());
-        output_ = &cout;
-    } else {
-        output_file_.open(path_string(out_path), ios_base::binary);
-        if (!output_file_) {
-            log_error(kNoSuchFileError, out_path.c_str());
-            return 1;
+    //  -oには依存ファイルの一覧やスナップショットを出力するので、プリプロセスの結果は出力しない。
+    emit_output_ = !opts_.emit_macro_snapshot() && (opts_.dependency_output() != DependencyOutput::kOnly);
+    //  テキスト行のマクロ展開は出力にしか影響しないので、出力しないなら展開しなくてよい。
+    skip_text_lines_ = !emit_output_ && opts_.deps_fast_scan();
+    if (opts_.emit_macro_snapshot() && opts_.output_filepath().empty()) {
+        report_error(kNoSnapshotOutputError);
+        return 1;
+    }
+    if (emit_output_ && !token_sink_) {
+        String out_path = opts_.output_filepath();
+        if (out_path.empty()) {
+            //output_buffer_.resize(64 * 1024);
+            //cout.rdbuf()->pubsetbuf(output_buffer_.data(), output_buffer_.size());
+            output_ = standard_output_;
+        } else {
+            output_file_.open(path_string(out_path), ios_base::binary);
+            if (!output_file_) {
+                report_error(kNoSuchFileError, out_path);
+                return 1;
+            }
+            output_ = &output_file_;
         }
-        output_ = &output_file_;
+
+        if (opts_.token_output_format() == TokenOutputFormat::kBinary) {
+            own_token_sink_ = make_unique<BinaryTokenSink>(*output_);
+        } else {
+            own_token_sink_ = make_unique<TextTokenSink>(*output_);
+        }
+        token_sink_ = own_token_sink_.get();
     }
+    output_batch_.record_tokens(token_sink_ && token_sink_->wants_tokens());
+    //  トークン単位で出力するなら、位置はトークンごとに付いている。
+    line_markers_ = opts_.output_line_directive() && emit_output_ && !output_batch_.record_tokens();
+    compact_output_ = opts_.compact_output();
 
     //
     String in_path = opts_.input_filepath();
     if (in_path.empty()) {
-        log_error(kNoInputError);
+        report_error(kNoInputError);
         return 1;
     }
 
     Path in_full_path;
     Path in_parent_path;
     istream* in;
-    ifstream in_file;
+    unique_ptr<BufferInputStream> in_file;
     if (in_path != T_("-")) {
         in_full_path = filesystem::absolute(in_path);
-        in_file.open(in_full_path, ios_base::binary);
-        if (!in_file.is_open()) {
-            log_error(kNoSuchFileError, in_path.c_str());
+        auto buffer = file_system_->load(internal_string(in_full_path));
+        if (!buffer) {
+            report_error(kNoSuchFileError, in_path);
             return 1;
         }
+        if (profiler_) {
+            profiler_->count(ProfileCounter::kBytesRead, buffer->size());
+        }
+        in_file = make_unique<BufferInputStream>(move(buffer));
         in_parent_path = in_full_path.parent_path();
-        in = &in_file;
+        in = in_file.get();
+        add_dependency(internal_string(in_full_path));
     } else {
         in_full_path = in_path;
         in_parent_path = filesystem::current_path();
         in = &cin;
     }
 
-    prepare_predefined_macro();
-    preprocessing_file(in, internal_string(in_full_path), IncludeDir{ IncludeDir::kSource, internal_string(in_parent_path) });
+    try {
+        prepare_predefined_macro();
+        if (!opts_.macro_snapshot_path().empty()) {
+            load_macro_snapshot();
+        }
+        preprocessing_file(in, internal_string(in_full_path), IncludeDir{ IncludeDir::kSource, internal_string(in_parent_path) });
+    } catch (const FatalError&) {
+        //  メッセージは出力済み。処理途中の状態を捨てて、出力先を閉じる。
+        abandon_translation_unit();
+        cleanup();
+        return EXIT_FAILURE;
+    }
     //log_info("{} errors, {} warnings.\n", error_count_, warning_count_);
 
+    if (opts_.emit_macro_snapshot() && !has_error() && !write_macro_snapshot()) {
+        cleanup();
+        return 1;
+    }
+    if (opts_.dependency_output() != DependencyOutput::kNone && !write_dependencies()) {
+        cleanup();
+        return 1;
+    }
+    if (!opts_.trace_includes_filepath().empty() && !write_include_trace()) {
+        cleanup();
+        return 1;
+    }
+
     if (!cleanup()) {
         return 1;
     }
@@ -582,9 +963,211 @@ int Preprocessor::run() {
     return has_error() ? EXIT_FAILURE : 0;
 }
 
+/**
+ * --use-macro-snapshotで指定されたスナップショットを読み込む。
+ *
+ * 読み込めないか、依存するファイルが更新されているか、コマンドラインでのマクロの定義 (-D、-U)が
+ * 作成時と違えば、警告してスナップショット無しで処理する。
+ */
+void Preprocessor::load_macro_snapshot() {
+    const auto& path = opts_.macro_snapshot_path();
+    unique_ptr<MacroSnapshot> snapshot;
+    try {
+        snapshot = make_unique<MacroSnapshot>(path_string(path));
+    } catch (const exception& e) {
+        report_warning(kInvalidSnapshotWarning, internal_from_source(std::string(e.what())), path);
+        return;
+    }
+
+    if (snapshot->macro_operations() != macro_operation_strings(opts_)) {
+        report_warning(kSnapshotMacroOperationsWarning, path);
+        return;
+    }
+
+    String stale_path;
+    if (!snapshot->is_up_to_date(*file_system_, &stale_path)) {
+        report_warning(kStaleSnapshotWarning, stale_path);
+        return;
+    }
+
+    //  -Dで定義したマクロは、ヘッダーで再定義や削除されているかもしれないので、スナップショットの状態にする。
+    erase_if(macros_, [](const auto& kv) {
+        const auto& m = kv.second;
+        return !m->is_predefined() &&
+                (m->expantion_method() == MacroExpantionMethod::kDirectlyCopyable ||
+                 m->expantion_method() == MacroExpantionMethod::kNormal);
+    });
+
+    for (const auto& [guard_path, guard] : snapshot->include_guards()) {
+        include_cache_->add_include_guard(guard_path, guard);
+    }
+    for (const auto& d : snapshot->dependencies()) {
+        add_dependency(d.path);
+    }
+    resource_check_macros_ = resource_check_macros_ || snapshot->checks_resource();
+    ++macro_generation_;
+    macro_snapshot_ = move(snapshot);
+}
+
+/**
+ * --emit-macro-snapshotで、処理した後のマクロの状態を -oで指定されたファイルに書き込む。
+ */
+bool Preprocessor::write_macro_snapshot() {
+    vector<MacroSnapshot::Dependency> dependencies;
+    vector<pair<String, IncludeCache::IncludeGuard>> include_guards;
+    if (macro_snapshot_) {
+        //  スナップショットから始めたなら、その内容も引き継ぐ。
+        try {
+            macro_snapshot_->take_all(macros_);
+        } catch (const exception& e) {
+            report_error(kBrokenSnapshotError, internal_from_source(std::string(e.what())), opts_.macro_snapshot_path());
+            return false;
+        }
+        dependencies = macro_snapshot_->dependencies();
+        include_guards = macro_snapshot_->include_guards();
+    }
+    for (const auto& path : snapshot_dependencies_) {
+        auto content = file_system_->load(path);
+        if (!content) {
+            //  標準入力など。
+            continue;
+        }
+        dependencies.push_back(MacroSnapshot::make_dependency(path, *content));
+        if (auto guard = include_cache_->find_include_guard(path)) {
+            include_guards.push_back({ path, move(*guard) });
+        }
+    }
+
+    const auto& out_path = opts_.output_filepath();
+    ofstream output(path_string(out_path), ios_base::binary);
+    if (!output) {
+        report_error(kNoSuchFileError, out_path);
+        return false;
+    }
+    MacroSnapshot::write(output, macro_operation_strings(opts_), dependencies, include_guards, macros_);
+    output.close();
+    if (!output) {
+        report_error(kFileOutputError);
+        return false;
+    }
+    return true;
+}
+
+void Preprocessor::add_dependency(const String& path) {
+    if (opts_.dependency_output() != DependencyOutput::kNone) {
+        dependencies_.add(path);
+    }
+}
+
+/**
+ * 依存ファイルの一覧を出力する。
+ *
+ * 出力先は -MFで指定されたファイル。無ければ、-Mなら -oで指定されたファイルか標準出力、
+ * -MDなら出力先 (無ければ入力ファイル名)の拡張子を .dにしたもの。
+ */
+bool Preprocessor::write_dependencies() {
+    String target = opts_.dependency_target();
+    if (target.empty()) {
+        target = internal_string(Path(path_string(opts_.input_filepath())).filename().replace_extension(T_(".o")));
+    }
+
+    String path = opts_.dependency_filepath();
+    if (path.empty()) {
+        if (opts_.dependency_output() == DependencyOutput::kOnly) {
+            path = opts_.output_filepath();
+        } else {
+            const auto& base = opts_.output_filepath().empty() ? opts_.input_filepath() : opts_.output_filepath();
+            Path p(path_string(base));
+            if (opts_.output_filepath().empty()) {
+                p = p.filename();
+            }
+            path = internal_string(p.replace_extension(T_(".d")));
+        }
+    }
+
+    ofstream file;
+    ostream* output = standard_output_;
+    if (!path.empty()) {
+        file.open(path_string(path), ios_base::binary);
+        if (!file) {
+            report_error(kNoSuchFileError, path);
+            return false;
+        }
+        output = &file;
+    }
+
+    if (opts_.dependency_format() == DependencyFormat::kJson) {
+        dependencies_.write_json(*output, target);
+    } else {
+        dependencies_.write_make(*output, target);
+    }
+    output->flush();
+    if (!*output) {
+        report_error(kFileOutputError);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * ファイルごとの処理のトレースを --trace-includesで指定されたファイルに出力する。
+ */
+bool Preprocessor::write_include_trace() {
+    if (!profiler_) {
+        return true;
+    }
+    const auto& path = opts_.trace_includes_filepath();
+    ofstream file(path_string(path), ios_base::binary);
+    if (!file) {
+        report_error(kNoSuchFileError, path);
+        return false;
+    }
+    profiler_->write_trace(file);
+    file.flush();
+    if (!file) {
+        report_error(kFileOutputError);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * 致命的エラーで処理をやめたときに、途中までの状態を捨てる。
+ *
+ * SourceFile、TokenStream、GroupScopeなどは巻き戻しで解放されるので、それらを指しているものを空にする。
+ * マクロ展開のフレームは Preprocessorが持っているので、ここで空にする。
+ */
+void Preprocessor::abandon_translation_unit() {
+    if (profiler_) {
+        profiler_->abandon();
+    }
+    stream_stack_.clear();
+    //  展開の途中のフレームは、走査中のトークン列を捨ててからプールに戻す。
+    while (!expansion_frames_.empty()) {
+        ExpansionFrame& frame = *expansion_frames_.back();
+        if (frame.stream) {
+            frame.stream->discard_inserted();
+        }
+        frame.stream.reset();
+        frame.source.reset();
+        frame.scanning = false;
+        pop_expansion_frame();
+    }
+    macro_invocation_stack_.clear();
+    output_file_stack_.clear();
+    guard_states_.clear();
+    marker_pending_ = false;
+}
+
 bool Preprocessor::cleanup() {
     diag_.set_output(nullptr);
 
+    flush_output();
+    if (token_sink_) {
+        token_sink_->finish();
+        token_sink_ = nullptr;
+    }
+    own_token_sink_.reset();
     if (output_) {
         output_->flush();
         output_ = nullptr;
@@ -596,9 +1179,22 @@ bool Preprocessor::cleanup() {
     if (error_output_) {
         error_output_->flush();
 
-        // TODO: いつもの簡易プロファイラー的なものにする。
-        clock_end_ = clock() - clock_start_;
-        log_info(T_("elapsed: {}"), clock_end_);
+        log_info(T_("elapsed: {:.3f} ms"), chrono::duration<double, milli>(chrono::steady_clock::now() - start_time_).count());
+        if (profiler_ && opts_.time_report()) {
+            profiler_->write_report(*error_output_, opts_.input_filepath(), kTimeReportTopCount);
+        }
+        if (profiler_ && opts_.macro_stats()) {
+            profiler_->write_macro_stats(*error_output_, opts_.input_filepath());
+        }
+        if (opts_.memoize_expansion()) {
+            const auto lookups = expansion_memo_.hits() + expansion_memo_.misses();
+            log_info(T_("expansion memo: {} hits / {} lookups ({:.1f}%)"),
+                    expansion_memo_.hits(), lookups,
+                    (lookups == 0) ? 0.0 : (100.0 * static_cast<double>(expansion_memo_.hits()) / static_cast<double>(lookups)));
+        }
+        if (!opts_.batch_translation_unit()) {
+            log_info(T_("file cache: {} hits / {} loads"), file_cache_->hits(), file_cache_->hits() + file_cache_->misses());
+        }
         error_output_->flush();
 
         error_output_ = nullptr;
@@ -779,17 +1375,47 @@ void Preprocessor::prepare_predefined_macro() {
 }
 
 void Preprocessor::preprocessing_file(std::istream* input, const String& path, const IncludeDir& include_dir) {
+    ProfileFileScope profile_scope(path);
     SourceFile source(*input, path, include_dir, opts_, diag_, sources_);
     TokenStream stream(source);
     push_stream(stream);
 
+    std::uint32_t file_id = 0;
+    if (output_batch_.record_tokens()) {
+        auto [it, inserted] = output_file_ids_.insert({ path, static_cast<std::uint32_t>(output_file_ids_.size() + 1) });
+        if (inserted) {
+            output_batch_.add_file(it->second, path);
+        }
+        file_id = it->second;
+    }
+    output_file_stack_.push_back(file_id);
+    if (line_markers_) {
+        output_line_marker(1, path, (output_file_stack_.size() > 1) ? 1 : 0);
+    }
+
+    if (opts_.emit_macro_snapshot() && snapshot_dependency_set_.insert(path).second) {
+        snapshot_dependencies_.push_back(path);
+    }
+
     Group root(true, TokenType::kNull);
+    guard_states_.push_back({ IncludeGuardState::Phase::kBeforeGuard, {}, {} });
 
     //group()?;
     while (peek(1).type() != TokenType::kEndOfFile) {
         group(current_source(), root);
     }
 
+    IncludeGuardState guard = move(guard_states_.back());
+    guard_states_.pop_back();
+    if (guard.phase == IncludeGuardState::Phase::kAfterGuard) {
+        if (guard.first_text) {
+            //  スナップショットから始めると、このファイルはインクルードガードで読み飛ばすので、テキストが失われる。
+            error(*guard.first_text, kSnapshotTextError);
+        }
+        include_cache_->add_include_guard(path, { move(guard.macro_name), move(guard.outside_text) });
+    }
+
+    output_file_stack_.pop_back();
     pop_stream();
 }
 
@@ -813,6 +1439,7 @@ void Preprocessor::group(SourceFile& source, Group& group) {
 bool Preprocessor::group_part() {
     TokenList ws_tokens;
     skip_ws(&ws_tokens);
+    detect_include_guard(ws_tokens);
 
     if (peek(1).type() == TokenType::kHash) {
         match(TokenType::kHash);
@@ -833,6 +1460,15 @@ bool Preprocessor::group_part() {
             return false;
         }
 
+        if (!guard_states_.empty()) {
+            auto& guard = guard_states_.back();
+            if (guard.phase == IncludeGuardState::Phase::kBeforeGuard && dir == TokenType::kIfndef) {
+                guard.phase = IncludeGuardState::Phase::kOpening;
+            } else if (guard.phase == IncludeGuardState::Phase::kBeforeGuard || guard.phase == IncludeGuardState::Phase::kAfterGuard) {
+                guard.phase = IncludeGuardState::Phase::kNotGuarded;
+            }
+        }
+
         if (is_if_group_directive(dir)) {
             if_section();
         } else if (
@@ -867,6 +1503,39 @@ bool Preprocessor::group_part() {
     return true;
 }
 
+/**
+ * ファイル全体が #ifndef ～ #endifで囲まれているかを調べる。
+ *
+ * ガードの外側の空行は、ガードのマクロが定義済みでも出力しなければならないので、その出力も覚えておく。
+ */
+void Preprocessor::detect_include_guard(const TokenList& ws_tokens) {
+    if (guard_states_.empty()) {
+        return;
+    }
+
+    auto& guard = guard_states_.back();
+    if (guard.phase != IncludeGuardState::Phase::kBeforeGuard && guard.phase != IncludeGuardState::Phase::kAfterGuard) {
+        return;
+    }
+
+    const Token& t = peek(1);
+    if (t.type() == TokenType::kHash) {
+        return;
+    }
+    if (!t.is_eol()) {
+        guard.phase = IncludeGuardState::Phase::kNotGuarded;
+        return;
+    }
+
+    //  text_line()が空行に対して出力するものと同じにする。
+    for (const auto& ws : ws_tokens) {
+        guard.outside_text += ws.string();
+    }
+    if (t.type() == TokenType::kNewLine) {
+        guard.outside_text += t.string();
+    }
+}
+
 void Preprocessor::if_section() {
     skip_ws();
 
@@ -874,6 +1543,11 @@ void Preprocessor::if_section() {
     ConditionScope condition_scope(src);
     bool processed = false;
 
+    IncludeGuardState* guard = nullptr;
+    if (!guard_states_.empty() && guard_states_.back().phase == IncludeGuardState::Phase::kOpening) {
+        guard = &guard_states_.back();
+    }
+
     Token if_token = peek(1);
     TokenType dir = as_directive(if_token);
     if (is_if_group_directive(dir)) {
@@ -882,10 +1556,20 @@ void Preprocessor::if_section() {
         fatal_error(if_token, as_internal(__func__) /* ロジックエラーっぽい */);
     }
 
+    //  ファイル全体を囲む #ifndefなら、if_group()で kInGuardになっている。
+    if (guard && guard->phase != IncludeGuardState::Phase::kInGuard) {
+        guard->phase = IncludeGuardState::Phase::kNotGuarded;
+        guard = nullptr;
+    }
+
     //  ここに来た時点で "#"は consume済み。
     skip_ws();
 
     TokenType elif_dir = as_directive(peek(1));
+    if (guard && (is_elif_group_directive(elif_dir) || elif_dir == TokenType::kElse)) {
+        guard->phase = IncludeGuardState::Phase::kNotGuarded;
+        guard = nullptr;
+    }
     if (is_elif_group_directive(elif_dir)) {
         //processed = elif_groups(processed);
         Token t;
@@ -903,12 +1587,19 @@ void Preprocessor::if_section() {
     skip_ws();
     if (as_directive(peek(1)) == TokenType::kEndif) {
         endif_line();
+        if (guard) {
+            guard->phase = IncludeGuardState::Phase::kAfterGuard;
+        }
     } else {
         error(if_token, kUnterminatedIfError, if_token.line());
+        if (guard) {
+            guard->phase = IncludeGuardState::Phase::kNotGuarded;
+        }
     }
 }
 
 TokenList Preprocessor::make_constant_expression() {
+    ProfileScope profile_scope(ProfilePhase::kIfEvaluation);
     skip_ws();
 
     bool bad_expr = false;
@@ -1062,6 +1753,7 @@ TokenList Preprocessor::make_constant_expression() {
 }
 
 target_uintmax_t Preprocessor::constant_expression(const TokenList& expr_tokens, const Token& dir_token) {
+    ProfileScope profile_scope(ProfilePhase::kIfEvaluation);
     //  TODO: make_constant_expressionの中身をここに移して、ここの中身は calculator.cppにしたい。
 
 #if !defined(NDEBUG)
@@ -1594,6 +2286,11 @@ bool Preprocessor::if_group() {
                     error(name_token, kVaArgsIdentifierUsageError);
                 }
                 result = (find_macro(name) == nullptr);
+
+                if (!guard_states_.empty() && guard_states_.back().phase == IncludeGuardState::Phase::kOpening) {
+                    guard_states_.back().macro_name = name;
+                    guard_states_.back().phase = IncludeGuardState::Phase::kInGuard;
+                }
             }
         } else {
             fatal_error(dir_token, as_internal(__func__) /* ロジックエラー */);
@@ -1712,6 +2409,7 @@ void Preprocessor::endif_line() {
 }
 
 void Preprocessor::control_line(TokenType directive) {
+    ProfileScope profile_scope(ProfilePhase::kDirective);
     assert(directive == as_directive(peek(1)));
 
     //"#" "include" pp_tokens(TokenType::kHeaderName); new_line();
@@ -1812,6 +2510,7 @@ void Preprocessor::control_line(TokenType directive) {
         break;
     }
     case TokenType::kEmbed: {
+        const auto embed_line = peek(1).line();
         src.scanner_hint(ScannerHint::kHeaderName);
         match("embed");
         src.scanner_hint(ScannerHint::kInitial);
@@ -1865,7 +2564,16 @@ void Preprocessor::control_line(TokenType directive) {
             }
 
             if (succeeded) {
+                if (line_markers_) {
+                    sync_output_line(embed_line);
+                }
+                note_snapshot_text(resource_id_token);
                 execute_embed(spec, false);
+                if (line_markers_) {
+                    //  リソースの内容は複数行になるので、次のテキスト行は行マーカーで合わせる。
+                    output_text("\n", TokenType::kNewLine);
+                    marker_pending_ = true;
+                }
             }
         } else {
             error(peek(1), kNoEmbedResourceIdentifierError);
@@ -1998,49 +2706,96 @@ void Preprocessor::text_line(const TokenList& ws_tokens) {
     //}
     //new_line();
 
-    if (!cur_group->processing) {
+    if (!cur_group->processing || (skip_text_lines_ && !resource_check_macros_)) {
         while (!peek(1).is_eol()) {
+            if (cur_group->processing) {
+                note_snapshot_text(peek(1));
+            }
             consume();
         }
         new_line();
         return;
     }
 
+    if (line_markers_) {
+        //  空行は出力しない。次のテキスト行の前に、改行か行マーカーで行を合わせる。
+        if (peek(1).is_eol()) {
+            new_line();
+            return;
+        }
+        sync_output_line(ws_tokens.empty() ? peek(1).line() : ws_tokens.front().line());
+    }
+
     for (const auto& ws : ws_tokens) {
-        output_text(ws.string());
+        output_token(ws);
     }
 
+    //  マクロ展開の結果は、展開を始めたマクロ呼び出しの位置と展開の番号を付けて出力する。
+    Token origin;
+    std::uint32_t expansion = 0;
+
     Token t;
     while (!peek(1).is_eol()) {
+        const bool from_expansion = stream_stack_.back().get().has_inserted();
         t = peek(1);
         consume();
+        if (!from_expansion) {
+            origin = t;
+            expansion = 0;
+        }
 
         if (t.type() == TokenType::kComment) {
             continue;
         }
         if (t.type() != TokenType::kIdentifier) {
-            output_text(t.string());
+            output_token(t, origin, expansion);
             continue;
         }
         if (t.string() == kIdentVaArgs) {
             error(t, kVaArgsIdentifierUsageError);
-            output_text(t.string());
+            output_token(t, origin, expansion);
             continue;
         }
         if (t.string() == kIdentVaOpt) {
             error(t, kVaOptIdentifierUsageError);
-            output_text(t.string());
+            output_token(t, origin, expansion);
             continue;
         }
         if (t.string() == kIdentHasCAttribute || t.string() == kIdentHasInclude || t.string() == kIdentHasEmbed) {
             error(t, kConditionalInclusionOperatorUsageError, t.string());
-            output_text(t.string());
+            output_token(t, origin, expansion);
             continue;
         }
 
         MacroPtr m = find_macro(t.string());
         if (m == nullptr) {
-            output_text(t.string());
+            output_token(t, origin, expansion);
+            continue;
+        }
+
+        if (is_plain_object_macro(*m)) {
+            DEBUG(t, T_("[PLAIN]: {}"), m->name());
+            if (profiler_) {
+                //  置換リストをそのまま出力するだけなので、時間は計らない。
+                profiler_->add_macro(m->name(), Profiler::Clock::duration::zero(), Profiler::Clock::duration::zero(),
+                        m->replist().size(), 1);
+            }
+            if (!emit_output_) {
+                if (!m->replist().empty()) {
+                    note_snapshot_text(t);
+                }
+            } else if (!output_batch_.record_tokens() && !compact_output_) {
+                output_text(m->spelling(), TokenType::kNull);
+            } else {
+                if (expansion == 0) {
+                    expansion = ++expansion_count_;
+                }
+                for (const auto& t2 : m->replist()) {
+                    if (t2.type() != TokenType::kComment) {
+                        output_token(t2, origin, expansion);
+                    }
+                }
+            }
             continue;
         }
 
@@ -2080,17 +2835,20 @@ void Preprocessor::text_line(const TokenList& ws_tokens) {
         }
 
         if (!dont_replace) {
+            if (expansion == 0) {
+                expansion = ++expansion_count_;
+            }
             if (!dont_rescan) {
                 replace_stream(move(expanded));
             } else {
                 for (const auto& t2 : expanded) {
-                    output_text(t2.string());
+                    output_token(t2, origin, expansion);
                 }
             }
         } else {
-            output_text(t.string());
+            output_token(t, origin, expansion);
             for (const auto& t2 : expanded) {
-                output_text(t2.string());
+                output_token(t2, origin, expansion);
             }
         }
     }
@@ -2098,33 +2856,97 @@ void Preprocessor::text_line(const TokenList& ws_tokens) {
     Token nl = peek(1);
     new_line();
     if (nl.type() == TokenType::kNewLine) {
-        output_text(nl.string());
+        output_token(nl);
+        ++marker_line_;
+    }
+}
+
+/**
+ * --emit-macro-snapshotで、出力されるはずのテキストが有ったことを、処理中のファイルに記録する。
+ * ファイルにインクルードガードが有れば、処理し終わったときにエラーにする。
+ */
+void Preprocessor::note_snapshot_text(const Token& token) {
+    if (!opts_.emit_macro_snapshot() || token.is_ws_nl()) {
+        return;
+    }
+    auto& guard = guard_states_.back();
+    if (!guard.first_text) {
+        guard.first_text = token;
     }
 }
 
 const TokenList& Preprocessor::get_expanded_arg(size_t n, const TokenList& arg, Macro::ArgList& cache) {
-    if (!arg.empty() && cache[n].empty()) {
+    ArgExpansionState state;
+    if (start_arg_expansion(n, arg, cache, &state)) {
         SourceTokenList source(arg);
         TokenStream stream(source);
         push_stream(stream);
         scan(cache[n]);
         pop_stream();
 
-        DEBUG(kTokenNull, T_("{}{}: {} --> {}"), Indent::tab(), n, Token::concat_string(arg), Token::concat_string(cache[n]));
+        finish_arg_expansion(n, arg, cache, state);
     }
 
     return cache[n];
 }
 
+/**
+ * 引数の展開を始める。走査が必要なければ falseを返す。
+ */
+bool Preprocessor::start_arg_expansion(size_t n, const TokenList& arg, Macro::ArgList& cache, ArgExpansionState* state) {
+    if (arg.empty() || !cache[n].empty()) {
+        return false;
+    }
+
+    if (opts_.memoize_expansion()) {
+        const Macro* macro = macro_invocation_stack_.empty() ? nullptr : macro_invocation_stack_.back().macro;
+        if (expansion_memo_.find(macro, arg, used_macro_names_, macro_generation_, cache[n])) {
+            return false;
+        }
+    }
+
+    // 入れ子の展開で純粋でなくなった場合は、外側の展開も純粋ではなくなる。
+    state->outer_impure = impure_expansion_;
+    state->diag_count = diag_.warning_count() + diag_.error_count();
+    impure_expansion_ = false;
+
+    return true;
+}
+
+void Preprocessor::finish_arg_expansion(size_t n, const TokenList& arg, Macro::ArgList& cache, const ArgExpansionState& state) {
+    // 診断メッセージを出した展開を再利用すると、2回目以降にそれが出なくなるので純粋ではないものとする。
+    const bool pure = !impure_expansion_ && (state.diag_count == diag_.warning_count() + diag_.error_count());
+    impure_expansion_ = state.outer_impure || !pure;
+    if (opts_.memoize_expansion() && pure) {
+        const Macro* macro = macro_invocation_stack_.empty() ? nullptr : macro_invocation_stack_.back().macro;
+        expansion_memo_.store(macro, arg, used_macro_names_, cache[n]);
+    }
+
+    DEBUG(kTokenNull, T_("{}{}: {} --> {}"), indent_tab(), n, Token::concat_string(arg), Token::concat_string(cache[n]));
+}
+
 bool Preprocessor::expand(const Macro& macro, const Macro::ArgList& macro_args, TokenList& result_expanded) {
-#if !defined(NDEBUG)
-    Indent indent;
-#endif
+    if (macro.expantion_method() == MacroExpantionMethod::kNormal) {
+        // 呼び出し履歴は expand_normalのフレームが管理する。
+        return expand_normal(macro, macro_args, result_expanded);
+    }
 
+    if (profiler_) {
+        profiler_->begin(ProfilePhase::kMacroExpansion);
+    }
     Macro::ArgList expanded_args(macro_args.size());
     macro_invocation_stack_.push_back({ &macro, &macro_args, &expanded_args });
     auto ord = enum_ordinal(macro.expantion_method());
     bool dont_rescan = (this->*expantion_methods_[ord])(macro, macro_args, result_expanded);
+    if (profiler_) {
+        Profiler::Clock::duration exclusive;
+        const auto inclusive = profiler_->end(&exclusive);
+        profiler_->add_macro(macro.name(), inclusive, exclusive, result_expanded.size(), macro_invocation_stack_.size());
+        if (!dont_rescan) {
+            //  再走査は呼び出し元でする。
+            profiler_->add_macro_rescan(macro.name());
+        }
+    }
     macro_invocation_stack_.pop_back();
 
     return dont_rescan;
@@ -2136,39 +2958,233 @@ bool Preprocessor::expand_directly_copyable(const Macro& macro, const Macro::Arg
 }
 
 bool Preprocessor::expand_normal(const Macro& macro, const Macro::ArgList& macro_args, TokenList& result_expanded) {
-    // 使われている引数を展開する。
-    Macro::ArgList& expanded_args = *macro_invocation_stack_.back().expanded_args;
-    const TokenList& list = macro.replist();
-    bool used_va_args = false;
-    for (auto it = macro.replist().begin(); it != macro.replist().end(); ++it) {
-        const Token& t = *it;
-        if (t.type() != TokenType::kIdentifier) {
-            continue;
-        }
-        if (macro.has_va_args() && (t.string() == kIdentVaArgs || t.string() == kIdentVaOpt)) {
-            used_va_args = true;
-            continue;
+    const auto base = expansion_frames_.size();
+    start_expand_frame(macro, &macro_args, nullptr, &result_expanded);
+    run_expansion_frames(base);
+
+    return false;
+}
+
+Preprocessor::ExpansionFrame& Preprocessor::push_expansion_frame(ExpansionFrame::Kind kind, TokenList* result) {
+    std::unique_ptr<ExpansionFrame> frame;
+    if (expansion_frame_pool_.empty()) {
+        frame = make_unique<ExpansionFrame>();
+    } else {
+        frame = move(expansion_frame_pool_.back());
+        expansion_frame_pool_.pop_back();
+    }
+
+    frame->kind = kind;
+    frame->result = result;
+    expansion_frames_.push_back(move(frame));
+
+    return *expansion_frames_.back();
+}
+
+void Preprocessor::pop_expansion_frame() {
+    assert(!expansion_frames_.empty());
+
+    // 確保済みの領域を残したまま、フレームを初期状態に戻してプールに返す。
+    std::unique_ptr<ExpansionFrame> frame = move(expansion_frames_.back());
+    expansion_frames_.pop_back();
+
+    assert(!frame->scanning && !frame->stream.has_value() && !frame->source.has_value());
+
+    // 大きな領域はプールに溜め込まない。
+    constexpr size_t kMaxPooledTokens = 1024;
+    if (frame->expanded.capacity() > kMaxPooledTokens) {
+        TokenList().swap(frame->expanded);
+    }
+    if (frame->substituted.capacity() > kMaxPooledTokens) {
+        TokenList().swap(frame->substituted);
+    }
+
+    frame->result = nullptr;
+    frame->expanded.clear();
+    frame->waiting = false;
+    frame->phase = ExpansionFrame::Phase::kExpandArgs;
+    frame->macro_holder.reset();
+    frame->macro = nullptr;
+    frame->own_args.clear();
+    frame->args = nullptr;
+    frame->expanded_args.clear();
+    frame->arg_expanded.clear();
+    frame->replist_pos = 0;
+    frame->used_va_args = false;
+    frame->arg_index = 0;
+    frame->arg_state = {};
+    frame->substituted.clear();
+
+    expansion_frame_pool_.push_back(move(frame));
+}
+
+/**
+ * マクロの展開のフレームを積む。own_argsが指定されたら、引数はフレームに移して保持する。
+ */
+Preprocessor::ExpansionFrame& Preprocessor::start_expand_frame(const Macro& macro, const Macro::ArgList* args, Macro::ArgList* own_args, TokenList* result) {
+    ExpansionFrame& frame = push_expansion_frame(ExpansionFrame::Kind::kExpand, result);
+    frame.macro = &macro;
+    if (own_args) {
+        frame.own_args = move(*own_args);
+        frame.args = &frame.own_args;
+    } else {
+        frame.args = args;
+    }
+    frame.expanded_args.resize(frame.args->size());
+    frame.arg_expanded.assign(frame.args->size(), false);
+
+    macro_invocation_stack_.push_back({ frame.macro, frame.args, &frame.expanded_args });
+    //  フレームは積んだ順に終わるので、区間も入れ子になる。
+    if (profiler_) {
+        profiler_->begin(ProfilePhase::kMacroExpansion);
+    }
+
+    return frame;
+}
+
+/**
+ * n番目の引数の走査を子のフレームで始める。走査が必要なければ falseを返す。
+ */
+bool Preprocessor::start_frame_arg_scan(ExpansionFrame& frame, size_t n) {
+    if (frame.arg_expanded[n]) {
+        return false;
+    }
+    frame.arg_expanded[n] = true;
+
+    const TokenList& arg = (*frame.args)[n];
+    if (!start_arg_expansion(n, arg, frame.expanded_args, &frame.arg_state)) {
+        return false;
+    }
+
+    frame.arg_index = n;
+    start_frame_scan(frame, arg, &frame.expanded_args[n]);
+
+    return true;
+}
+
+void Preprocessor::start_frame_scan(ExpansionFrame& frame, const TokenList& tokens, TokenList* result) {
+    frame.source.emplace(tokens);
+    frame.stream.emplace(*frame.source);
+    push_stream(*frame.stream);
+    frame.scanning = true;
+
+    push_expansion_frame(ExpansionFrame::Kind::kScan, result);
+}
+
+/**
+ * 作業スタックのフレームが baseの数に戻るまで展開を進める。
+ */
+void Preprocessor::run_expansion_frames(size_t base) {
+    while (expansion_frames_.size() > base) {
+        ExpansionFrame& frame = *expansion_frames_.back();
+        if (frame.kind == ExpansionFrame::Kind::kScan) {
+            step_scan_frame(frame);
+        } else {
+            step_expand_frame(frame);
         }
+    }
+}
+
+void Preprocessor::step_expand_frame(ExpansionFrame& frame) {
+    const Macro& macro = *frame.macro;
+    const Macro::ArgList& macro_args = *frame.args;
 
-        auto i = macro.param_index_of(t.string());
-        if (i != macro.params().size()) {
-            get_expanded_arg(i, macro_args[i], expanded_args);
+    if (frame.scanning) {
+        // 子のフレームの走査が終わった。
+        pop_stream();
+        frame.stream.reset();
+        frame.source.reset();
+        frame.scanning = false;
+
+        if (frame.phase == ExpansionFrame::Phase::kDone) {
+            // 再走査が終わった。
+            used_macro_names_.erase(macro.name());
+            rescan_count_--;
+        } else {
+            finish_arg_expansion(frame.arg_index, macro_args[frame.arg_index], frame.expanded_args, frame.arg_state);
         }
     }
 
-    // 可変引数を展開する。
-    // 引数そのものが使われていなくても (__VA_ARGS__が現れなくても)、__VA_OPT__が有れば、その判断に
-    // 利用されるので、やはり展開しておく。
-    if (used_va_args) {
-        const auto i0 = macro.params().size() - 1;  // マクロの仮引数の数 - 1: 即ち、"..."のオフセット
-        const auto end = macro_args.size();
-        if (i0 < end) {
-            get_expanded_arg(i0, macro_args[i0], expanded_args);
+    switch (frame.phase) {
+    case ExpansionFrame::Phase::kExpandArgs:
+        // 使われている引数を展開する。
+        while (frame.replist_pos < macro.replist().size()) {
+            const Token& t = macro.replist()[frame.replist_pos++];
+            if (t.type() != TokenType::kIdentifier) {
+                continue;
+            }
+            if (macro.has_va_args() && (t.string() == kIdentVaArgs || t.string() == kIdentVaOpt)) {
+                frame.used_va_args = true;
+                continue;
+            }
+
+            auto i = macro.param_index_of(t.string());
+            if (i != macro.params().size() && start_frame_arg_scan(frame, i)) {
+                return;
+            }
+        }
+        frame.phase = ExpansionFrame::Phase::kExpandVaArgs;
+        [[fallthrough]];
+
+    case ExpansionFrame::Phase::kExpandVaArgs:
+        // 可変引数を展開する。
+        // 引数そのものが使われていなくても (__VA_ARGS__が現れなくても)、__VA_OPT__が有れば、その判断に
+        // 利用されるので、やはり展開しておく。
+        frame.phase = ExpansionFrame::Phase::kSubstitute;
+        if (frame.used_va_args) {
+            const auto i0 = macro.params().size() - 1;  // マクロの仮引数の数 - 1: 即ち、"..."のオフセット
+            const auto end = macro_args.size();
+            if (i0 < end && start_frame_arg_scan(frame, i0)) {
+                return;
+            }
+        }
+        [[fallthrough]];
+
+    case ExpansionFrame::Phase::kSubstitute:
+        frame.substituted = substitute_macro_args(macro, macro_args, frame.expanded_args);
+        frame.phase = ExpansionFrame::Phase::kDone;
+
+        // 再走査中に引数を参照するのは __VA_OPT__だけなので、可変引数が無ければここで解放しておく。
+        // 呼び出しが深く入れ子になったときに、各段の引数を最後まで抱えないようにするため。
+        if (!macro.has_va_args()) {
+            if (frame.args == &frame.own_args) {
+                Macro::ArgList().swap(frame.own_args);
+            }
+            Macro::ArgList().swap(frame.expanded_args);
         }
+
+        if (frame.substituted.empty()) {
+            frame.result->clear();
+        } else {
+            rescan_count_++;
+            used_macro_names_.insert(macro.name());
+            if (profiler_) {
+                profiler_->add_macro_rescan(macro.name());
+            }
+
+            //  rescan
+            start_frame_scan(frame, frame.substituted, frame.result);
+            return;
+        }
+        break;
+
+    case ExpansionFrame::Phase::kDone:
+        break;
     }
 
+    if (profiler_) {
+        Profiler::Clock::duration exclusive;
+        const auto inclusive = profiler_->end(&exclusive);
+        profiler_->add_macro(macro.name(), inclusive, exclusive, frame.result->size(), macro_invocation_stack_.size());
+    }
+    macro_invocation_stack_.pop_back();
+    pop_expansion_frame();
+}
+
+TokenList Preprocessor::substitute_macro_args(const Macro& macro, const Macro::ArgList& macro_args, const Macro::ArgList& expanded_args) {
     //  パラメーターのトークンを展開済み引数に置き換える。
-    //  引数は必要時に展開される。
+    //  引数は前の段階で展開済みである。
+    const TokenList& list = macro.replist();
     TokenList substituted;
     for (auto it = list.begin(); it != list.end(); ++it) {
         const Token& t = *it;
@@ -2191,7 +3207,7 @@ bool Preprocessor::expand_normal(const Macro& macro, const Macro::ArgList& macro
                         const auto i0 = macro.params().size() - 1;  // マクロの仮引数の数 - 1、即ち、"..."のオフセット
                         const auto end = macro_args.size();
                         if (i0 < end) {
-                            const auto& a0 = get_expanded_arg(i0, macro_args[i0], expanded_args);
+                            const auto& a0 = expanded_args[i0];
                             substituted.insert(substituted.end(), a0.begin(), a0.end());
                         }
                     } else {
@@ -2199,7 +3215,7 @@ bool Preprocessor::expand_normal(const Macro& macro, const Macro::ArgList& macro
                         if (i == macro.params().size()) {
                             substituted.push_back(t);
                         } else {
-                            const auto& a = get_expanded_arg(i, macro_args[i], expanded_args);
+                            const auto& a = expanded_args[i];
                             substituted.insert(substituted.end(), a.begin(), a.end());
                         }
                     }
@@ -2232,7 +3248,7 @@ bool Preprocessor::expand_normal(const Macro& macro, const Macro::ArgList& macro
                 }
 
                 it = substituted.erase(it, next(next_it));
-                it = substituted.insert(it, Token(s, TokenType::kStringLiteral));
+                it = substituted.insert(it, Token(move(s), TokenType::kStringLiteral));
             }
         }
     }
@@ -2292,7 +3308,11 @@ bool Preprocessor::expand_normal(const Macro& macro, const Macro::ArgList& macro
                 //        しても、それは結合できたということなので、特に問題は無いだろうか。ただ、numは
                 //        あくまでも pp-numberなのでパーサーがエラーにする可能性は残る。
                 Token t2 = concat_result.front();
-                if (t2.type() == TokenType::kHashHash || t2.is_ws()) {
+                if (t2.type() == TokenType::kHashHash) {
+                    //  # ## #の結果の ##は正しいトークンだが、演算子としては扱わない。(C17 6.10.3.3 EXAMPLE)
+                    concat_result.pop_back();
+                    concat_result.push_back(Token(t2.string(), TokenType::kNonReplacementTarget));
+                } else if (t2.is_ws()) {
                     error(r, kGeneratedInvalidPpTokenError2, l.string(), r.string());
                     concat_result.pop_back();
                     concat_result.push_back(Token(t2.string(), TokenType::kNonReplacementTarget));
@@ -2312,30 +3332,14 @@ bool Preprocessor::expand_normal(const Macro& macro, const Macro::ArgList& macro
         }
     }
 
-    DEBUG(kTokenNull, T_("{} --> {}"), Indent::tab(), Token::concat_string(substituted));
-
-    if (substituted.empty()) {
-        result_expanded.clear();
-    } else {
-        rescan_count_++;
-        used_macro_names_.insert(macro.name());
-
-        SourceTokenList source(substituted);
-        TokenStream stream(source);
-        push_stream(stream);
-
-        //  rescan
-        scan(result_expanded);
+    DEBUG(kTokenNull, T_("{} --> {}"), indent_tab(), Token::concat_string(substituted));
 
-        pop_stream();
-        used_macro_names_.erase(macro.name());
-        rescan_count_--;
-    }
-
-    return false;
+    return substituted;
 }
 
 bool Preprocessor::expand_op_pragma(const Macro& /*macro*/, const Macro::ArgList& macro_args, TokenList& /*result_expanded*/) {
+    impure_expansion_ = true;
+
     Macro::ArgList expanded_args(macro_args.size());
 
     if (macro_args.empty() || macro_args[0].empty()) {
@@ -2369,6 +3373,9 @@ bool Preprocessor::expand_op_pragma(const Macro& /*macro*/, const Macro::ArgList
 }
 
 bool Preprocessor::expand_va_opt(const Macro& /*macro*/, const Macro::ArgList& macro_args, TokenList& result_expanded) {
+    // 結果が呼び出し元の可変引数に依存するので、引数の展開としては再利用できない。
+    impure_expansion_ = true;
+
     if (macro_invocation_stack_.size() < 2) {
         fatal_error(kTokenNull, as_internal(__func__));
     }
@@ -2452,6 +3459,8 @@ bool Preprocessor::expand_op_has_c_attribute(const Macro& /*macro*/, const Macro
 
 
 bool Preprocessor::expand_op_has_include(const Macro& /*macro*/, const Macro::ArgList& macro_args, TokenList& result_expanded) {
+    impure_expansion_ = true;
+
     Macro::ArgList expanded_args(macro_args.size());
 
     if (macro_args.size() != 1 || macro_args[0].empty()) {
@@ -2475,7 +3484,10 @@ bool Preprocessor::expand_op_has_include(const Macro& /*macro*/, const Macro::Ar
     }
 
     IncludeSpec spec(header_name);
-    if (search_include_file(spec, nullptr, nullptr)) {
+    String path_str;
+    if (search_include_file(spec, &path_str, nullptr)) {
+        //  見つかったファイルが変われば結果も変わるので、依存ファイルに含める。
+        add_dependency(path_str);
         result_expanded.push_back(kTokenPpNumberOne);
     } else {
         result_expanded.push_back(kTokenPpNumberZero);
@@ -2485,6 +3497,8 @@ bool Preprocessor::expand_op_has_include(const Macro& /*macro*/, const Macro::Ar
 }
 
 bool Preprocessor::expand_op_has_embed(const Macro& /*macro*/, const Macro::ArgList& macro_args, TokenList& result_expanded) {
+    impure_expansion_ = true;
+
     Macro::ArgList expanded_args(macro_args.size());
 
     if (macro_args.size() != 1 || macro_args[0].empty()) {
@@ -2588,6 +3602,7 @@ TokenList Preprocessor::expand_directive_line() {
 }
 
 bool Preprocessor::search_include_file(const IncludeSpec& include_spec, String* file_path_str, IncludeDir* include_dir) {
+    ProfileScope profile_scope(ProfilePhase::kIncludeSearch);
     String name = internal_from_source(include_spec.header_name());
     if (name.empty()) {
         return false;
@@ -2595,27 +3610,53 @@ bool Preprocessor::search_include_file(const IncludeSpec& include_spec, String*
     String path_str;
     IncludeDir result_inc_dir;
     bool exist = false;
+    //  ファイルが更新されうるなら、後で前のディレクトリに作られていないかを確かめられるように、無かったパスを覚えておく。
+    vector<String> earlier_paths;
+    const bool record_earlier = include_cache_->revalidates();
+
+    const bool double_quoted = include_spec.is_double_quoted_form();
+    const String source_dir = double_quoted ? current_source().parent_dir() : String();
+    const String key = IncludeCache::resolution_key(include_search_path_id_, name, double_quoted, source_dir);
+    auto cached = include_cache_->find_resolution(key);
+    if (cached) {
+        if (cached->exists) {
+            if (file_path_str) {
+                *file_path_str = cached->path;
+            }
+            if (include_dir) {
+                *include_dir = cached->include_dir;
+            }
+        }
+        return cached->exists;
+    }
 
-    if (include_spec.is_double_quoted_form()) {
-        auto source_dir = current_source().parent_dir();
+    if (double_quoted) {
         path_str = source_dir + kPathDelimiter + name;
         path_str = normalize_path(path_str);
-        exist = file_exists(path_string(path_str));
+        exist = file_system_->exists(path_str);
         result_inc_dir = IncludeDir{ IncludeDir::kSource, source_dir };
+        if (!exist && record_earlier) {
+            earlier_paths.push_back(path_str);
+        }
     }
 
     if (!exist) {
         for (const auto& dir : include_dirs_) {
             path_str = dir.path() + kPathDelimiter + name;
             path_str = normalize_path(path_str);
-            exist = file_exists(path_string(path_str));
+            exist = file_system_->exists(path_str);
             if (exist) {
                 result_inc_dir = dir;
                 break;
             }
+            if (record_earlier) {
+                earlier_paths.push_back(path_str);
+            }
         }
     }
 
+    include_cache_->add_resolution(key, { exist, path_str, result_inc_dir, move(earlier_paths) });
+
     if (exist) {
         if (file_path_str) {
             *file_path_str = move(path_str);
@@ -2664,6 +3705,21 @@ TokenList Preprocessor::substitute_by_arg_if_need(const Macro& macro, const Macr
 }
 
 void Preprocessor::scan(TokenList& result_expanded) {
+    const auto base = expansion_frames_.size();
+    push_expansion_frame(ExpansionFrame::Kind::kScan, &result_expanded);
+    run_expansion_frames(base);
+}
+
+void Preprocessor::step_scan_frame(ExpansionFrame& frame) {
+    TokenList& result_expanded = *frame.result;
+
+    if (frame.waiting) {
+        // 子のフレームで展開したマクロの結果を再走査する。
+        frame.waiting = false;
+        replace_stream(move(frame.expanded));
+        frame.expanded.clear();
+    }
+
     Token t;
 
     while (!peek(1).is_eol()) {
@@ -2696,7 +3752,7 @@ void Preprocessor::scan(TokenList& result_expanded) {
             }
         }
         if (used_macro_names_.find(t.string()) != used_macro_names_.end()) {
-            DEBUG(t, T_("{}[USED]: {}"), Indent::tab(), t.string());
+            DEBUG(t, T_("{}[USED]: {}"), indent_tab(), t.string());
             result_expanded.push_back(Token(t.string(), TokenType::kNonReplacementTarget));
             continue;
         }
@@ -2706,11 +3762,21 @@ void Preprocessor::scan(TokenList& result_expanded) {
             continue;
         }
 
+        // 呼び出しの入れ子が深すぎる場合は展開せずにそのまま残す。
+        const auto max_depth = opts_.max_expansion_depth();
+        const bool too_deep = (max_depth != 0 && macro_invocation_stack_.size() >= max_depth);
+
         bool dont_replace = false;
         bool dont_rescan = false;
         TokenList expanded;
+        std::optional<Macro::ArgList> args;
         if (!m->is_function()) {
-            dont_rescan = expand(*m, Macro::kNoArgs, expanded);
+            if (too_deep) {
+                error(t, kMacroExpansionTooDeepError, t.string(), max_depth);
+                dont_replace = true;
+            } else {
+                args.emplace();
+            }
         } else {
             TokenList ws;
             skip_ws(&ws);
@@ -2720,18 +3786,31 @@ void Preprocessor::scan(TokenList& result_expanded) {
                 dont_replace = true;
             } else {
                 TokenList read_tokens;
-                auto args = read_macro_args(*m, &read_tokens);
+                args = read_macro_args(*m, &read_tokens);
+                if (args.has_value() && too_deep) {
+                    error(t, kMacroExpansionTooDeepError, t.string(), max_depth);
+                    args.reset();
+                }
                 if (!args.has_value()) {
                     expanded.reserve(ws.size() + read_tokens.size());
                     move(ws.begin(), ws.end(), back_inserter(expanded));
                     move(read_tokens.begin(), read_tokens.end(), back_inserter(expanded));
                     dont_replace = true;
-                } else {
-                    dont_rescan = expand(*m, *args, expanded);
                 }
             }
         }
 
+        if (!dont_replace) {
+            if (m->expantion_method() == MacroExpantionMethod::kNormal) {
+                // 子のフレームで展開して、終わったらその結果を再走査する。
+                frame.waiting = true;
+                ExpansionFrame& child = start_expand_frame(*m, nullptr, &*args, &frame.expanded);
+                child.macro_holder = m;
+                return;
+            }
+            dont_rescan = expand(*m, *args, expanded);
+        }
+
         if (!dont_replace) {
             if (!dont_rescan) {
                 replace_stream(move(expanded));
@@ -2745,6 +3824,8 @@ void Preprocessor::scan(TokenList& result_expanded) {
             move(expanded.begin(), expanded.end(), back_inserter(result_expanded));
         }
     }
+
+    pop_expansion_frame();
 }
 
 void Preprocessor::non_directive() {
@@ -2927,7 +4008,11 @@ Token Preprocessor::read_macro_arg_loop(TokenList* read_tokens, TokenList& resul
     Token t = peek(1);
     while (nest > 0 || !end_condition(t)) {
         if (t.type() == TokenType::kEndOfFile) {
-            error(t, kBadMacroArgumentError);
+            //  置換リストや引数の走査では、呼び出しが続くトークン列の終わりまでしか読めない。
+            //  (例: #define h g(~ と h 5))  呼び出しは外側の走査で改めて読むので、エラーにしない。
+            if (expansion_frames_.empty() || expansion_frames_.back()->kind != ExpansionFrame::Kind::kScan) {
+                error(t, kBadMacroArgumentError);
+            }
             succeeded = false;
             break;
         }
@@ -3296,14 +4381,27 @@ void Preprocessor::match(const char* seq) {
 }
 
 std::string Preprocessor::execute_stringize(const Macro::ArgList& args, Macro::ArgList::size_type first, Macro::ArgList::size_type last) {
+    // 結果の長さの上限を先に求めて、領域を一度に確保する。
+    // 文字列リテラルと文字定数は、全ての文字がエスケープされても収まるようにしておく。
+    size_t capacity = 2;
+    for (auto i = first; i < last; i++) {
+        for (const auto& t : args[i]) {
+            const auto len = t.string().length();
+            const bool escapable = (t.type() == TokenType::kStringLiteral || t.type() == TokenType::kCharacterConstant);
+            capacity += escapable ? (len * 2) : len;
+        }
+        capacity += 2;
+    }
+
     string result;
+    result.reserve(capacity);
 
     result += "\"";
     for (auto i = first; i < last; i++) {
         const auto& arg = args[i];
         for (const auto& t : arg) {
             if (t.type() == TokenType::kStringLiteral || t.type() == TokenType::kCharacterConstant) {
-                result += escape_string(t.string());
+                append_escaped(result, t.string());
             } else {
                 result += t.string();
             }
@@ -3322,13 +4420,32 @@ bool Preprocessor::execute_include(const std::string& header_name, const Token&
     IncludeSpec spec(header_name);
     String path_str;
     IncludeDir include_dir;
-    ifstream next_input;
+    FileSystem::Buffer buffer;
     if (search_include_file(spec, &path_str, &include_dir)) {
-        next_input.open(path_string(path_str), ios_base::binary);
+        //  インクルードガードのマクロが定義済みなら、中身は全て読み飛ばされるのでファイルを開くまでもない。
+        add_dependency(path_str);
+
+        auto guard = include_cache_->find_include_guard(path_str);
+        if (guard && find_macro_entry(guard->macro_name) != macros_.end()) {
+            DEBUG(header_name_token, T_("Skip file {} (guarded by {})"), path_str, guard->macro_name);
+            if (profiler_) {
+                profiler_->add_guarded_include(path_str);
+            }
+            //  行マーカーを出力するなら、空行は行マーカーで合わせるので要らない。
+            if (!line_markers_) {
+                output_whitespace_text(guard->outside_text);
+            }
+            return true;
+        }
+
+        buffer = file_system_->load(path_str);
+        if (buffer && profiler_) {
+            profiler_->count(ProfileCounter::kBytesRead, buffer->size());
+        }
     }
 
-    if (!next_input.is_open()) {
-        fatal_error(header_name_token, kNoSuchFileError, spec.header_name().c_str());
+    if (!buffer) {
+        fatal_error(header_name_token, kIncludeFileNotFoundError, spec.header_name().c_str());
         return false;
     }
 
@@ -3337,9 +4454,15 @@ bool Preprocessor::execute_include(const std::string& header_name, const Token&
     if (included_files_ > kMinSpecSourceFileInclusion) {
         info(header_name_token, kMinSpecSourceFileInclusionWarning, kMinSpecSourceFileInclusion, included_files_);
     }
+    BufferInputStream next_input(move(buffer));
     preprocessing_file(&next_input, path_str, include_dir);
     included_files_--;
 
+    //  #includeの行は処理済みなので、戻り先は次の行から。
+    if (line_markers_) {
+        output_line_marker(header_name_token.line() + 1, current_source_path(), 2);
+    }
+
     return true;
 }
 
@@ -3358,17 +4481,18 @@ EmbedResult Preprocessor::execute_embed(EmbedSpec& spec, bool has_embed_context)
         }
         return EmbedResult::kErrorOrUnsupportedParameter;
     }
+    add_dependency(path_str);
 
-    Path path = path_string(path_str);
-    ifstream resource_file(path, ios_base::binary);
-    if (!resource_file) {
+    auto resource = file_system_->load(path_str);
+    if (!resource) {
         if (!has_embed_context) {
             fatal_error(peek(1), kEmbedResoruceOpeningFailureError, spec.resource_id());
         }
         return EmbedResult::kErrorOrUnsupportedParameter;
     }
 
-    const auto size = filesystem::file_size(path);
+    const auto size = resource->size();
+    BufferInputStream resource_file(move(resource));
     if (size > (numeric_limits<int>::max() >> kEmbedElementWidth)) {
         if (!has_embed_context) {
             error(peek(1), as_internal(__func__) /* 実装上の都合、オーバーフローしそう */);
@@ -3411,7 +4535,7 @@ EmbedResult Preprocessor::execute_embed(EmbedSpec& spec, bool has_embed_context)
     } else {
         if (file_size > kMaxResourceSizeInBytes) {
             if (!has_embed_context) {
-                error(peek(0), as_internal(__func__) /* 独自の制限 {kMaxResourceSizeInBytes}以下のリソースしか取り扱えない */);
+                error(peek(1), as_internal(__func__) /* 独自の制限 {kMaxResourceSizeInBytes}以下のリソースしか取り扱えない */);
             }
             return EmbedResult::kErrorOrUnsupportedParameter;
         }
@@ -3442,7 +4566,7 @@ EmbedResult Preprocessor::execute_embed(EmbedSpec& spec, bool has_embed_context)
             if (if_empty_ref.has_value()) {
                 auto& if_empty = if_empty_ref->get();
                 for (auto& t : if_empty.value()) {
-                    output_text(t.string());
+                    output_token(t);
                 }
             }
         } else {
@@ -3450,7 +4574,7 @@ EmbedResult Preprocessor::execute_embed(EmbedSpec& spec, bool has_embed_context)
             if (prefix_ref.has_value()) {
                 auto& prefix = prefix_ref->get();
                 for (auto& t : prefix.value()) {
-                    output_text(t.string());
+                    output_token(t);
                 }
             }
 
@@ -3462,23 +4586,25 @@ EmbedResult Preprocessor::execute_embed(EmbedSpec& spec, bool has_embed_context)
                 return EmbedResult::kErrorOrUnsupportedParameter;
             }
 
-            char dec[6] = ", XXX";
-            sprintf_s(dec, "%d", (static_cast<unsigned char>(buf[0])));
-            output_text(dec);
-            for (int i = 1; i < bytes; ++i) {
-                if ((i % 16) == 0) {
-                    sprintf_s(dec, ",\n%d", (static_cast<unsigned char>(buf[i])));
-                } else {
-                    sprintf_s(dec, ", %d", (static_cast<unsigned char>(buf[i])));
+            char dec[4] = "XXX";
+            for (int i = 0; i < bytes; ++i) {
+                if (i > 0) {
+                    output_text(",", TokenType::kComma);
+                    if ((i % 16) == 0) {
+                        output_text("\n", TokenType::kNewLine);
+                    } else {
+                        output_text(" ", TokenType::kWhiteSpace);
+                    }
                 }
-                output_text(dec);
+                sprintf_s(dec, "%d", (static_cast<unsigned char>(buf[i])));
+                output_text(dec, TokenType::kPpNumber);
             }
 
             auto suffix_ref = spec.parameter(EmbedParameter::kIdentSuffix);
             if (suffix_ref.has_value()) {
                 auto& suffix = suffix_ref->get();
                 for (auto& t : suffix.value()) {
-                    output_text(t.string());
+                    output_token(t);
                 }
             }
         }
@@ -3591,6 +4717,7 @@ bool Preprocessor::execute_line(const std::string& line, const std::optional<std
     if (path) {
         current_source_path(internal_from_source(unquote_string(path.value())));
     }
+    marker_pending_ = true;
 
     return true;
 }
@@ -3616,22 +4743,141 @@ bool Preprocessor::execute_pragma(const TokenList& tokens, const Token& location
     }
 }
 
-void Preprocessor::output_text(std::string_view text) {
-    output_->write(text.data(), text.length());
+/**
+ * 行マーカー (# 行番号 "ファイル名" フラグ)を出力する。フラグは GCCと同じで、1はファイルに入った、
+ * 2はファイルから戻った。0なら付けない。
+ */
+void Preprocessor::output_line_marker(std::uint32_t line, const String& path, int flag) {
+    auto marker = format("# {} {}", line, quote_string(source_string(path)));
+    if (flag != 0) {
+        marker += format(" {}", flag);
+    }
+    marker += '\n';
+    output_text(marker, TokenType::kNull);
+
+    marker_line_ = line;
+    marker_path_ = path;
+    marker_pending_ = false;
+}
+
+/**
+ * 次に出力する行を、ソースファイルの lineに合わせる。
+ *
+ * 空いている行が少なければ空行で、多ければ (読み飛ばしたグループなど)行マーカーで合わせる。
+ */
+void Preprocessor::sync_output_line(std::uint32_t line) {
+    const auto path = current_source_path();
+    if (marker_pending_ || path != marker_path_ || line < marker_line_ ||
+        (line - marker_line_) > kMaxBlankLinesWithoutMarker) {
+        output_line_marker(line, path, 0);
+        return;
+    }
+    for (; marker_line_ < line; ++marker_line_) {
+        output_text("\n", TokenType::kNewLine);
+    }
+}
+
+/**
+ * トークンを出力する。マクロ展開の結果 (expansionが 0以外)なら、位置は locationのものにする。
+ */
+void Preprocessor::output_token(const Token& token, const Token& location, std::uint32_t expansion) {
+    if (!emit_output_) {
+        if (!token.is_ws_nl()) {
+            note_snapshot_text((expansion == 0) ? token : location);
+        }
+        return;
+    }
+    if (compact_output_) {
+        if (token.is_ws()) {
+            return;
+        }
+        output_separator_if_needed(token);
+    }
+    const Token& at = (expansion == 0) ? token : location;
+    output_batch_.add_token(token.type(), token.string(),
+            output_file_stack_.empty() ? 0 : output_file_stack_.back(),
+            at.line(), at.column(), expansion);
+    if (output_batch_.full()) {
+        flush_output();
+    }
 #if !defined(NDEBUG)
-    output_->flush();
+    flush_output();
 #endif
 }
 
-void Preprocessor::output_text(const char* text) {
-    if (!text) {
-        output_->write("(NUL)", 5);
+/**
+ * 空白を詰めて出力するときに、tokenが前に出力したものとくっついてしまうなら、間に空白を 1つ出力する。
+ */
+void Preprocessor::output_separator_if_needed(const Token& token) {
+    const auto& s = token.string();
+    if (s.empty()) {
         return;
     }
+    if (tokens_would_merge(output_last_is_number_, output_last_char_, s)) {
+        output_text(" ", TokenType::kWhiteSpace);
+    }
+    output_last_is_number_ = is_pp_number_spelling(s);
+    output_last_char_ = s.back();
+}
 
-    output_->write(text, strlen(text));
+/**
+ * トークンではないものから作った出力。位置は無い。
+ */
+void Preprocessor::output_text(std::string_view text, TokenType type) {
+    if (!emit_output_) {
+        return;
+    }
+    if (!text.empty()) {
+        output_last_is_number_ = is_pp_number_spelling(text);
+        output_last_char_ = text.back();
+    }
+    output_batch_.add_token(type, text,
+            output_file_stack_.empty() ? 0 : output_file_stack_.back(),
+            0, 0, 0);
+    if (output_batch_.full()) {
+        flush_output();
+    }
+#if !defined(NDEBUG)
+    flush_output();
+#endif
+}
+
+/**
+ * 空白と改行だけのテキストを出力する。トークンが必要なら改行とそれ以外に分ける。
+ */
+void Preprocessor::output_whitespace_text(std::string_view text) {
+    if (!output_batch_.record_tokens()) {
+        output_text(text, TokenType::kWhiteSpace);
+        return;
+    }
+
+    while (!text.empty()) {
+        auto pos = text.find('\n');
+        if (pos == 0) {
+            output_text(text.substr(0, 1), TokenType::kNewLine);
+            text.remove_prefix(1);
+        } else {
+            pos = min(pos, text.size());
+            output_text(text.substr(0, pos), TokenType::kWhiteSpace);
+            text.remove_prefix(pos);
+        }
+    }
+}
+
+void Preprocessor::flush_output() {
+    if (!token_sink_) {
+        return;
+    }
+    if (!output_batch_.empty()) {
+        ProfileScope profile_scope(ProfilePhase::kOutput);
+        if (profiler_) {
+            profiler_->count(ProfileCounter::kBytesWritten, output_batch_.text().size());
+        }
+        token_sink_->write(output_batch_);
+        output_batch_.clear();
+    }
 #if !defined(NDEBUG)
-    output_->flush();
+    token_sink_->flush();
 #endif
 }
 
@@ -3657,7 +4903,6 @@ std::uint32_t Preprocessor::current_source_line_number() {
 
 void Preprocessor::current_source_line_number(std::uint32_t value) {
     SourceFile& source = current_source();
-    source.reset_line_number(value);
 
     // XXX: 従来の処理が Sourceに対するものであって、TokenStreamに対するものではなかったので、不格好な
     //      形での暫定対応。恐らく、TokenStreamに対して行うようにしても問題は無い気がする。
@@ -3668,7 +4913,8 @@ void Preprocessor::current_source_line_number(std::uint32_t value) {
     if (it == stream_stack_.rend()) {
         throw runtime_error(__func__);
     }
-    (*it).get().reset_line_number(value);
+    //  スキャナーは先読みした分だけ先に進んでいるので、その続きの行番号にする。
+    source.reset_line_number((*it).get().reset_line_number(value));
 }
 
 void Preprocessor::add_predefined_macro(const std::string& name, const std::string& value, const TokenType type) {
@@ -3708,13 +4954,15 @@ MacroPtr Preprocessor::add_macro(const Token& name, const TokenList& replist) {
         return nullptr;
     }
 
-    auto it = macros_.find(name.string());
+    auto it = find_macro_entry(name.string());
     if (it != macros_.end()) {
         MacroPtr m = it->second;
         if (m->is_function() || !token_list_equal(m->replist(), replist)) {
             warning(name, kMacroRedefinitionWarning, name.string(), m->source(), m->line(), m->column());
         }
         m->reset(replist, source_from_internal(current_source_path()), name);
+        ++macro_generation_;
+        resource_check_macros_ = resource_check_macros_ || m->checks_resource();
         DEBUG(name, T_("[REDEF] {}"), macro_def_string(MacroForm::kObjectLike, name, Macro::kNoParams, replist));
 
         return m;
@@ -3724,6 +4972,8 @@ MacroPtr Preprocessor::add_macro(const Token& name, const TokenList& replist) {
         if (!inserted) {
             fatal_error(name, as_internal(__func__) /* ロジックエラーかメモリーが足りないか？ */);
         }
+        ++macro_generation_;
+        resource_check_macros_ = resource_check_macros_ || new_it->second->checks_resource();
         DEBUG(name, T_("[DEF] {}"), macro_def_string(MacroForm::kObjectLike, name, Macro::kNoParams, replist));
 
         return new_it->second;
@@ -3735,13 +4985,15 @@ MacroPtr Preprocessor::add_macro(const Token& name, const Macro::ParamList& para
         return nullptr;
     }
 
-    auto it = macros_.find(name.string());
+    auto it = find_macro_entry(name.string());
     if (it != macros_.end()) {
         MacroPtr m = it->second;
         if (m->is_object() || (m->params() != params) || !token_list_equal(m->replist(), replist)) {
             warning(name, kMacroRedefinitionWarning, name.string(), m->source(), m->line(), m->column());
         }
         m->reset(params, replist, source_from_internal(current_source_path()), name);
+        ++macro_generation_;
+        resource_check_macros_ = resource_check_macros_ || m->checks_resource();
         DEBUG(name, T_("[REDEF] {}"), macro_def_string(MacroForm::kFunctionLike, name, params, replist));
 
         return m;
@@ -3751,6 +5003,8 @@ MacroPtr Preprocessor::add_macro(const Token& name, const Macro::ParamList& para
         if (!inserted) {
             fatal_error(name, as_internal(__func__) /* ロジックエラー */);
         }
+        ++macro_generation_;
+        resource_check_macros_ = resource_check_macros_ || new_it->second->checks_resource();
         DEBUG(name, T_("[DEF] {}"), macro_def_string(MacroForm::kFunctionLike, name, params, replist));
 
         return new_it->second;
@@ -3787,31 +5041,98 @@ void Preprocessor::remove_macro(const Token& name) {
         return;
     }
 
-    auto it = macros_.find(name.string());
+    auto it = find_macro_entry(name.string());
     if (it == macros_.end()) {
         warning(name, kUndefineNondefinedMacroWarning, name.string());
     } else {
         macros_.erase(it);
+        ++macro_generation_;
         DEBUG(name, T_("[UNDEF] {}"), name.string());
     }
 }
 
-MacroPtr Preprocessor::find_macro(const std::string& name) {
+/**
+ * オブジェクト形式マクロで、その置換リストを再走査しても何も置き換えられないかどうか。
+ *
+ * 置換リストの識別子がどれも現在のマクロ名でなければ、置換リストをそのまま出力すればよい。
+ * 判定結果はマクロ定義が変わるまで (macro_generation_が進むまで) マクロに保持する。
+ */
+bool Preprocessor::is_plain_object_macro(Macro& macro) {
+    if (macro.is_function()) {
+        return false;
+    }
+    if (macro.expantion_method() != MacroExpantionMethod::kDirectlyCopyable &&
+        macro.expantion_method() != MacroExpantionMethod::kNormal) {
+        return false;
+    }
+
+    auto cached = macro.plain(macro_generation_);
+    if (cached.has_value()) {
+        return *cached;
+    }
+
+    bool plain = true;
+    for (const auto& t : macro.replist()) {
+        if (t.type() == TokenType::kHashHash) {
+            plain = false;
+            break;
+        }
+        if (t.type() != TokenType::kIdentifier) {
+            continue;
+        }
+        if (t.string() == kIdentVaArgs || t.string() == kIdentVaOpt || find_macro_entry(t.string()) != macros_.end()) {
+            plain = false;
+            break;
+        }
+    }
+    macro.plain(macro_generation_, plain);
+
+    return plain;
+}
+
+/**
+ * マクロの表から nameを探す。無ければスナップショットから取り出して表に加える。
+ */
+MacroSet::iterator Preprocessor::find_macro_entry(const std::string& name) {
     auto it = macros_.find(name);
+    if (it != macros_.end() || !macro_snapshot_) {
+        return it;
+    }
+
+    MacroPtr m;
+    try {
+        m = macro_snapshot_->take(name);
+    } catch (const exception& e) {
+        //  形式はコンストラクターで確かめてあるので、ここに来るのはメモリーが足りないときなど。
+        fatal_error(kTokenNull, kBrokenSnapshotError, internal_from_source(std::string(e.what())), opts_.macro_snapshot_path());
+    }
+    if (!m) {
+        return it;
+    }
+    return macros_.insert({ name, move(m) }).first;
+}
+
+MacroPtr Preprocessor::find_macro(const std::string& name) {
+    auto it = find_macro_entry(name);
     if (it == macros_.end()) {
         return nullptr;
     }
     MacroPtr m = it->second;
     if (name == "__FILE__") {
         m->reset({ Token(quote_string(source_string(current_source_path())), TokenType::kStringLiteral) }, "", kTokenNull);
+        impure_expansion_ = true;
     } else if (name == "__LINE__") {
         m->reset({ Token(to_string(current_source_line_number()), TokenType::kPpNumber)}, "", kTokenNull);
+        impure_expansion_ = true;
     }
 
     return m;
 }
 
 void Preprocessor::print_macros() {
+    if (macro_snapshot_) {
+        macro_snapshot_->take_all(macros_);
+    }
     for (const auto& kv : macros_) {
         auto& m = kv.second;
         log_debug(T_("{}"), m->name());
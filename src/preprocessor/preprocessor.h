@@ -3,9 +3,11 @@
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cinttypes>
 #include <ctime>
 #include <cstdarg>
+#include <deque>
 #include <fstream>
 #include <memory>
 #include <optional>
@@ -22,17 +24,22 @@
 
 #include "pp_config.h"
 #include "calculator.h"
+#include "dependencies.h"
 #include "diagnostics.h"
+#include "filecache.h"
+#include "includecache.h"
 #include "input.h"
 #include "options.h"
+#include "profiler.h"
 #include "scanner.h"
+#include "tokensink.h"
 #include "sourcefilestack.h"
 
 #if defined(NDEBUG)
 #define DEBUG(t, ...)
 #define DEBUG_EXPR(expr)
 #else
-#define DEBUG(t, ...)       debug(t, __VA_ARGS__)
+#define DEBUG(t, ...)       do { if (diag_level_ <= DiagLevel::kDebug) { debug(t, __VA_ARGS__); } } while (false)
 #define DEBUG_EXPR(expr)    expr
 #endif
 
@@ -112,6 +119,19 @@ public:
     const std::string& source() const { return source_; }
     std::uint32_t line() const { return line_; }
     std::uint32_t column() const { return column_; }
+    // 置換リストを連結した文字列。
+    const std::string& spelling() const { return spelling_; }
+    // 置換リストに __has_includeか __has_embedを含むか。展開すると依存ファイルが増えうる。
+    bool checks_resource() const { return checks_resource_; }
+
+    // マクロ定義の世代generationにおいて、置換リストにマクロ名が含まれていないかどうか (判定済みの場合)。
+    std::optional<bool> plain(std::uint64_t generation) const {
+        return (plain_generation_ == generation) ? std::optional<bool>(plain_) : std::nullopt;
+    }
+    void plain(std::uint64_t generation, bool value) {
+        plain_generation_ = generation;
+        plain_ = value;
+    }
 
     std::size_t param_index_of(const std::string& param_name) const;
     void reset(const TokenList& replist, const std::string& source, const Token& name_token);
@@ -136,6 +156,10 @@ private:
     std::string source_;
     std::uint32_t line_;
     std::uint32_t column_;
+    std::string spelling_;
+    bool checks_resource_;
+    std::uint64_t plain_generation_;
+    bool plain_;
 };
 
 /**
@@ -280,26 +304,95 @@ enum class EmbedResult {
 };
 
 
+/**
+ * マクロ引数の展開結果を、同じマクロの同じ引数による呼び出しの間で共有するキャッシュ。
+ *
+ * 展開結果はマクロ定義と、その時点で再置換の対象外になっているマクロ名にも依存するので、
+ * それらもキーに含める。マクロ定義が変われば (generationが進めば)、全て破棄する。
+ * 引数は代替つづりも区別して比べる。引数から来たトークンの位置は、再利用する呼び出しの引数の位置に付け替える。
+ * 持っているトークンの数が kMaxTokensを超えそうになったら、それまでの結果を全て破棄する。
+ */
+class ExpansionMemo {
+public:
+    using MacroNameSet = std::unordered_set<std::string>;
+
+    // 引数、展開結果、マクロ名を合わせて、キャッシュに持つトークンの数の上限。
+    static constexpr std::size_t kMaxTokens = 1024 * 1024;
+
+    ExpansionMemo()
+        : generation_()
+        , entries_()
+        , num_tokens_()
+        , hits_()
+        , misses_() {
+    }
+
+    ExpansionMemo(const ExpansionMemo&) = delete;
+    ~ExpansionMemo() = default;
+
+    ExpansionMemo& operator=(const ExpansionMemo&) = delete;
+
+    bool find(const Macro* macro, const TokenList& arg, const MacroNameSet& used_names, std::uint64_t generation, TokenList& expanded);
+    void store(const Macro* macro, const TokenList& arg, const MacroNameSet& used_names, const TokenList& expanded);
+
+    std::uint64_t hits() const { return hits_; }
+    std::uint64_t misses() const { return misses_; }
+
+private:
+    struct Entry {
+        const Macro* macro;
+        TokenList arg;
+        MacroNameSet used_names;
+        TokenList expanded;
+        std::vector<std::int32_t> origins;  // expandedの各トークンが argの何番目から来たか。引数以外なら -1。
+    };
+
+    static std::vector<std::int32_t> origins_of(const TokenList& arg, const TokenList& expanded);
+    static std::size_t key_of(const Macro* macro, const TokenList& arg, const MacroNameSet& used_names);
+
+    std::uint64_t generation_;
+    std::unordered_multimap<std::size_t, Entry> entries_;
+    std::size_t num_tokens_;
+    std::uint64_t hits_;
+    std::uint64_t misses_;
+};
+
+class MacroSnapshot;
+
 /**
  */
 class Preprocessor {
 public:
-    explicit Preprocessor(const Options& opts, Diagnostics& diag, SourceFileStack& sources);
+    explicit Preprocessor(const Options& opts, Diagnostics& diag, SourceFileStack& sources,
+                          std::shared_ptr<IncludeCache> include_cache = nullptr,
+                          std::shared_ptr<FileCache> file_cache = nullptr);
     Preprocessor(const Preprocessor&) = delete;
     ~Preprocessor();
 
     Preprocessor& operator=(const Preprocessor&) = delete;
 
     bool has_error();
+    void standard_streams(std::ostream* output, std::ostream* error_output);
+    void file_system(std::shared_ptr<FileSystem> file_system);
+    void token_sink(TokenSink* sink);
     int run();
 
 private:
+    void abandon_translation_unit();
     bool cleanup();
     void prepare_predefined_macro();
+    void load_macro_snapshot();
+    bool write_macro_snapshot();
+    void add_dependency(const String& path);
+    bool write_dependencies();
+    bool write_include_trace();
+    void output_line_marker(std::uint32_t line, const String& path, int flag);
+    void sync_output_line(std::uint32_t line);
     void preprocessing_file(std::istream* input, const String& path, const IncludeDir& include_dir);
     void group(SourceFile& source, Group& group);
     bool group_part();
     void if_section();
+    void detect_include_guard(const TokenList& ws_tokens);
     TokenList make_constant_expression();
     target_uintmax_t constant_expression(const TokenList& expr_tokens, const Token& dir_token);
     bool calc(std::stack<Operator>& ops, std::stack<Integer>& nums, const Operator& next_op, const Token& dir_token);
@@ -313,34 +406,81 @@ private:
     void endif_line();
     void control_line(TokenType directive);
     void text_line(const TokenList& ws_tokens);
+    void note_snapshot_text(const Token& token);
 
     const TokenList& get_expanded_arg(std::size_t n, const TokenList& arg, Macro::ArgList& cache);
 
-#if !defined(NDEBUG)
-    class Indent {
-    public:
-        static inline int indent_level_ = 0;
-
-        explicit Indent(bool inc = true)
-            : inc_(inc)
-        {
-            if (inc_) {
-                ++indent_level_;
-            }
-        }
-        ~Indent() {
-            if (inc_) {
-                --indent_level_;
-            }
-        }
-
-        static std::string tab() {
-            return std::string(Indent::indent_level_ * 1, ' ');
-        }
+    /**
+     * 引数の展開を始める前の状態。展開が終わったときに、結果を再利用できるかの判断に使う。
+     */
+    struct ArgExpansionState {
+        bool outer_impure;
+        int diag_count;
+    };
 
-    private:
-        bool inc_;
+    bool start_arg_expansion(std::size_t n, const TokenList& arg, Macro::ArgList& cache, ArgExpansionState* state);
+    void finish_arg_expansion(std::size_t n, const TokenList& arg, Macro::ArgList& cache, const ArgExpansionState& state);
+
+    /**
+     * マクロ展開の作業スタックに積むフレーム。
+     *
+     * scanと expand_normalを再帰呼び出しではなく作業スタックで行い、マクロ呼び出しの入れ子の深さが
+     * ネイティブのスタックに制限されないようにする。フレームはヒープに確保し、使い終わったものは再利用する。
+     */
+    struct ExpansionFrame {
+        enum class Kind {
+            kScan,
+            kExpand,
+        };
+
+        enum class Phase {
+            kExpandArgs,
+            kExpandVaArgs,
+            kSubstitute,
+            kDone,
+        };
+
+        Kind kind = Kind::kScan;
+        TokenList* result = nullptr;
+
+        // kScan: 子のフレームで展開中のマクロの結果を受け取る。
+        TokenList expanded;
+        bool waiting = false;
+
+        // kExpand
+        Phase phase = Phase::kExpandArgs;
+        MacroPtr macro_holder;
+        const Macro* macro = nullptr;
+        Macro::ArgList own_args;
+        const Macro::ArgList* args = nullptr;
+        Macro::ArgList expanded_args;
+        std::vector<bool> arg_expanded;
+        std::size_t replist_pos = 0;
+        bool used_va_args = false;
+        std::size_t arg_index = 0;
+        ArgExpansionState arg_state = {};
+        TokenList substituted;
+
+        // 子のフレームで走査中のトークン列。
+        bool scanning = false;
+        std::optional<SourceTokenList> source;
+        std::optional<TokenStream> stream;
     };
+
+    ExpansionFrame& push_expansion_frame(ExpansionFrame::Kind kind, TokenList* result);
+    void pop_expansion_frame();
+    ExpansionFrame& start_expand_frame(const Macro& macro, const Macro::ArgList* args, Macro::ArgList* own_args, TokenList* result);
+    bool start_frame_arg_scan(ExpansionFrame& frame, std::size_t n);
+    void start_frame_scan(ExpansionFrame& frame, const TokenList& tokens, TokenList* result);
+    void run_expansion_frames(std::size_t base);
+    void step_scan_frame(ExpansionFrame& frame);
+    void step_expand_frame(ExpansionFrame& frame);
+    TokenList substitute_macro_args(const Macro& macro, const Macro::ArgList& macro_args, const Macro::ArgList& expanded_args);
+
+#if !defined(NDEBUG)
+    std::string indent_tab() const {
+        return std::string(macro_invocation_stack_.size(), ' ');
+    }
 #endif
 
     bool expand(const Macro& macro, const Macro::ArgList& macro_args, TokenList& result_expanded);
@@ -439,8 +579,14 @@ private:
     bool execute_line(const std::string& line, const std::optional<std::string>& path);
     bool execute_pragma(const TokenList& tokens, const Token& location);
 
-    void output_text(std::string_view text);
-    void output_text(const char* text);
+    void output_token(const Token& token) {
+        output_token(token, token, 0);
+    }
+    void output_token(const Token& token, const Token& location, std::uint32_t expansion);
+    void output_separator_if_needed(const Token& token);
+    void output_text(std::string_view text, TokenType type);
+    void output_whitespace_text(std::string_view text);
+    void flush_output();
 
     template <class... Ts>
     void debug(const Token& token, const StringView& format, const Ts&... args) {
@@ -473,10 +619,16 @@ private:
     template <class... Ts>
     [[noreturn]]
     void fatal_error(const Token& token, const StringView& format, const Ts&... args) {
+        flush_output();
         auto src = current_source_pointer();
         diag_.fatal_error(src, Location::from_source(src, token), format, args...);
     }
 
+    template <class... Ts>
+    void report_error(const StringView& format, const Ts&... args);
+    template <class... Ts>
+    void report_warning(const StringView& format, const Ts&... args);
+
     SourceFile& current_source();
     SourceFile* current_source_pointer();
     String current_source_path();
@@ -494,6 +646,8 @@ private:
     MacroPtr add_macro(const Token& name, const Macro::ParamList& params, const TokenList& replist);
     std::string macro_def_string(MacroForm form, const Token& name, const Macro::ParamList& params, const TokenList& replist);
     void remove_macro(const Token& name);
+    bool is_plain_object_macro(Macro& macro);
+    MacroSet::iterator find_macro_entry(const std::string& name);
     MacroPtr find_macro(const std::string& name);
     void print_macros();
 
@@ -503,29 +657,98 @@ private:
 
     std::vector<IncludeDir> include_dirs_;
     DiagLevel diag_level_;
-    clock_t clock_start_;
-    clock_t clock_end_;
+    std::chrono::steady_clock::time_point start_time_;
+    // --time-reportのときだけ作る。
+    std::unique_ptr<Profiler> profiler_;
     std::vector<std::reference_wrapper<TokenStream>> stream_stack_;
 
+    std::ostream* standard_output_;
+    std::ostream* standard_error_output_;
     std::ostream* output_;
     std::vector<char> output_buffer_;
     std::ofstream output_file_;
     std::ostream* error_output_;
     std::vector<char> error_output_buffer_;
     std::shared_ptr<std::ofstream> error_file_;
+    TokenSink* token_sink_;
+    std::unique_ptr<TokenSink> own_token_sink_;
+    TokenBatch output_batch_;
+    // 出力するトークンのファイル番号。処理中のファイルごとに積む。
+    std::vector<std::uint32_t> output_file_stack_;
+    std::unordered_map<String, std::uint32_t> output_file_ids_;
+    std::uint32_t expansion_count_;
     MacroSet macros_;
+    // --use-macro-snapshotで読み込んだマクロ。macros_に無いマクロは、ここから取り出す。
+    std::unique_ptr<MacroSnapshot> macro_snapshot_;
+    // --emit-macro-snapshotで、スナップショットが依存するファイル。
+    std::vector<String> snapshot_dependencies_;
+    std::unordered_set<String> snapshot_dependency_set_;
+    DependencyCollector dependencies_;
+    // falseなら何も出力しない。(-M、--emit-macro-snapshot)
+    bool emit_output_;
+    // trueならテキスト行を偽のグループと同じように読み飛ばす。(-fdeps-fast-scan)
+    bool skip_text_lines_;
+    // 置換リストに __has_include、__has_embedを含むマクロが定義されたか。
+    // テキスト行からそれに届くと依存ファイルが増えるので、定義された後は skip_text_lines_でもテキスト行を展開する。
+    bool resource_check_macros_;
+    // 空白を詰めて出力するか。(-fcompact-output)
+    bool compact_output_;
+    // 最後に出力したものが pp-numberか、と最後の文字。続くトークンとくっつくかどうかを調べるためのもの。
+    bool output_last_is_number_;
+    char output_last_char_;
+    // 行マーカーを出力するか。(-Pが無く、テキストとして出力するとき)
+    bool line_markers_;
+    // 次に出力する行が対応する、ソースファイルの行とパス。
+    std::uint32_t marker_line_;
+    String marker_path_;
+    // 次のテキスト行の前に、行マーカーが必要か。(#line、#embedの後)
+    bool marker_pending_;
     std::vector<std::string> predef_macro_names_;
     std::unordered_set<std::string> used_macro_names_;
+    std::uint64_t macro_generation_;
 
     int included_files_;
     int rescan_count_;
 
+    ExpansionMemo expansion_memo_;
+    // 展開中に __FILE__などの、その時々で結果が変わるものを使ったかどうか。
+    bool impure_expansion_;
+
     struct MacroInvocation {
         const Macro* macro;
         const Macro::ArgList* args;
         Macro::ArgList* expanded_args;
     };
     std::vector<MacroInvocation> macro_invocation_stack_;
+
+    std::vector<std::unique_ptr<ExpansionFrame>> expansion_frames_;
+    std::vector<std::unique_ptr<ExpansionFrame>> expansion_frame_pool_;
+
+    std::shared_ptr<IncludeCache> include_cache_;
+    std::size_t include_search_path_id_;
+    std::shared_ptr<FileCache> file_cache_;
+    std::shared_ptr<FileSystem> file_system_;
+
+    /**
+     * インクルードガードの検出状態。処理中のファイルごとに積む。
+     */
+    struct IncludeGuardState {
+        enum class Phase {
+            kBeforeGuard,
+            kOpening,
+            kInGuard,
+            kAfterGuard,
+            kNotGuarded,
+        };
+
+        Phase phase;
+        std::string macro_name;
+        std::string outside_text;
+        // --emit-macro-snapshotで、最初に出力されるはずだったテキストのトークン。
+        std::optional<Token> first_text;
+    };
+    // if_section()が要素を指したまま入れ子のファイルを処理するので、要素が移動しない dequeにする。
+    std::deque<IncludeGuardState> guard_states_;
 };
 
 /**
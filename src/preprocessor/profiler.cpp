@@ -0,0 +1,280 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <format>
+#include <ostream>
+
+#include "util/utility.h"
+
+using namespace lib::util;
+using namespace std;
+
+namespace {
+
+using namespace pp;
+
+const char* const kPhaseName[] = {
+    "ファイル",
+    "字句解析",
+    "ディレクティブ",
+    "#ifの評価",
+    "インクルードの検索",
+    "マクロ展開",
+    "出力",
+};
+
+double to_milliseconds(Profiler::Clock::duration d) {
+    return chrono::duration<double, milli>(d).count();
+}
+
+/**
+ * 合計時間の長い順に上位 top_n個を返す。
+ */
+template <class Map>
+std::vector<typename Map::const_pointer> top_entries(const Map& map, std::size_t top_n) {
+    std::vector<typename Map::const_pointer> entries;
+    entries.reserve(map.size());
+    for (const auto& entry : map) {
+        entries.push_back(&entry);
+    }
+    const auto n = std::min(top_n, entries.size());
+    partial_sort(entries.begin(), entries.begin() + n, entries.end(),
+            [](auto a, auto b) { return a->second.inclusive > b->second.inclusive; });
+    entries.resize(n);
+    return entries;
+}
+
+}   // anonymous namespace
+
+namespace pp {
+
+#if PP_PROFILER_ENABLED
+thread_local Profiler* Profiler::current_ = nullptr;
+#endif
+
+Profiler::Activation::Activation(Profiler* profiler)
+    : previous_(Profiler::current()) {
+#if PP_PROFILER_ENABLED
+    current_ = profiler;
+#endif
+}
+
+Profiler::Activation::~Activation() {
+#if PP_PROFILER_ENABLED
+    current_ = previous_;
+#endif
+}
+
+Profiler::Profiler()
+    : start_(Clock::now())
+    , scopes_()
+    , depth_()
+    , phases_()
+    , counters_()
+    , macros_()
+    , files_stack_()
+    , files_()
+    , record_trace_()
+    , trace_events_() {
+}
+
+Profiler::~Profiler() {
+}
+
+void Profiler::begin(ProfilePhase phase) {
+    ++depth_[static_cast<std::size_t>(phase)];
+    scopes_.push_back({ phase, Clock::now(), Clock::duration::zero() });
+}
+
+/**
+ * 最後に始めた区間を終え、その時間を返す。exclusiveには入れ子の区間を除いた時間を返す。
+ */
+Profiler::Clock::duration Profiler::end(Clock::duration* exclusive) {
+    const auto now = Clock::now();
+    if (scopes_.empty()) {
+        if (exclusive) {
+            *exclusive = Clock::duration::zero();
+        }
+        return Clock::duration::zero();
+    }
+    const Scope scope = scopes_.back();
+    scopes_.pop_back();
+
+    const auto elapsed = now - scope.start;
+    auto& stats = phases_[static_cast<std::size_t>(scope.phase)];
+    ++stats.calls;
+    stats.exclusive += elapsed - scope.children;
+    //  同じ区分の区間の中なら、外側の区間の時間に含まれている。
+    if (--depth_[static_cast<std::size_t>(scope.phase)] == 0) {
+        stats.inclusive += elapsed;
+    }
+    if (!scopes_.empty()) {
+        scopes_.back().children += elapsed;
+    }
+    if (exclusive) {
+        *exclusive = elapsed - scope.children;
+    }
+    return elapsed;
+}
+
+void Profiler::begin_file(const String& path) {
+    begin(ProfilePhase::kFile);
+    auto it = files_.try_emplace(path).first;
+    files_stack_.push_back({ &it->first, &it->second, Clock::now(), Clock::duration::zero(), 0, 0 });
+}
+
+void Profiler::end_file() {
+    end();
+    if (files_stack_.empty()) {
+        return;
+    }
+    const OpenFile file = files_stack_.back();
+    files_stack_.pop_back();
+
+    const auto elapsed = Clock::now() - file.start;
+    auto& stats = *file.stats;
+    ++stats.count;
+    stats.tokens += file.tokens;
+    stats.skipped_tokens += file.skipped_tokens;
+    stats.exclusive += elapsed - file.children;
+    //  同じファイルが入れ子でインクルードされていたら、外側の時間に含まれている。
+    const bool nested = any_of(files_stack_.begin(), files_stack_.end(),
+            [&](const OpenFile& f) { return f.stats == file.stats; });
+    if (!nested) {
+        stats.inclusive += elapsed;
+    }
+    if (!files_stack_.empty()) {
+        files_stack_.back().children += elapsed;
+    }
+
+    if (record_trace_) {
+        trace_events_.push_back({ file.path, file.start, elapsed, file.tokens, file.skipped_tokens });
+    }
+}
+
+/**
+ * インクルードガードのマクロが定義済みなので、ファイルを開かずに済ませた。
+ */
+void Profiler::add_guarded_include(const String& path) {
+    auto it = files_.try_emplace(path).first;
+    ++it->second.guarded;
+    if (record_trace_) {
+        trace_events_.push_back({ &it->first, Clock::now(), Clock::duration(-1), 0, 0 });
+    }
+}
+
+void Profiler::add_macro(const std::string& name, Clock::duration inclusive, Clock::duration exclusive,
+        std::size_t tokens, std::size_t depth) {
+    auto& stats = macros_[name];
+    ++stats.calls;
+    stats.tokens += tokens;
+    stats.max_depth = std::max(stats.max_depth, depth);
+    stats.inclusive += inclusive;
+    stats.exclusive += exclusive;
+}
+
+/**
+ * 致命的エラーで処理をやめたときに、終わっていない区間を捨てる。
+ */
+void Profiler::abandon() {
+    scopes_.clear();
+    depth_.fill(0);
+    files_stack_.clear();
+}
+
+/**
+ * 区分ごとの時間、カウンター、時間のかかったマクロとファイルの上位 top_n個を出力する。
+ *
+ * マクロの時間は、引数に現れた同じマクロの展開も含む。
+ */
+void Profiler::write_report(std::ostream& output, const String& title, std::size_t top_n) const {
+    std::string report = std::format("{}: 時間の内訳\n", as_narrow(title));
+    std::format_to(back_inserter(report), "  全体: {:.3f} ms\n", to_milliseconds(Clock::now() - start_));
+    std::format_to(back_inserter(report), "  {:>10} {:>12} {:>12}  {}\n", "回数", "合計 (ms)", "自身 (ms)", "区分");
+    for (std::size_t i = 0; i < kNumProfilePhases; i++) {
+        const auto& stats = phases_[i];
+        std::format_to(back_inserter(report), "  {:>10} {:>12.3f} {:>12.3f}  {}\n",
+                stats.calls, to_milliseconds(stats.inclusive), to_milliseconds(stats.exclusive), kPhaseName[i]);
+    }
+    std::format_to(back_inserter(report), "  トークン: {}、読み込み: {} バイト、書き込み: {} バイト\n",
+            counters_[static_cast<std::size_t>(ProfileCounter::kTokens)],
+            counters_[static_cast<std::size_t>(ProfileCounter::kBytesRead)],
+            counters_[static_cast<std::size_t>(ProfileCounter::kBytesWritten)]);
+
+    std::format_to(back_inserter(report), "  マクロ (合計時間の上位 {}):\n", top_n);
+    for (const auto* entry : top_entries(macros_, top_n)) {
+        std::format_to(back_inserter(report), "  {:>10} {:>12.3f}  {}\n",
+                entry->second.calls, to_milliseconds(entry->second.inclusive), entry->first);
+    }
+
+    std::format_to(back_inserter(report), "  ファイル (合計時間の上位 {}):\n", top_n);
+    std::format_to(back_inserter(report), "  {:>10} {:>10} {:>12} {:>12} {:>12} {:>12}  {}\n",
+            "回数", "ガード", "トークン", "読み飛ばし", "合計 (ms)", "自身 (ms)", "パス");
+    for (const auto* entry : top_entries(files_, top_n)) {
+        const auto& stats = entry->second;
+        std::format_to(back_inserter(report), "  {:>10} {:>10} {:>12} {:>12} {:>12.3f} {:>12.3f}  {}\n",
+                stats.count, stats.guarded, stats.tokens, stats.skipped_tokens,
+                to_milliseconds(stats.inclusive), to_milliseconds(stats.exclusive), as_narrow(entry->first));
+    }
+
+    output.write(report.data(), report.size());
+}
+
+/**
+ * 展開したマクロ全ての統計を、自身の時間 (入れ子の展開を除く)の長い順に出力する。
+ *
+ * トークンの数と時間は、入れ子の展開の分も外側のマクロに含まれる。
+ */
+void Profiler::write_macro_stats(std::ostream& output, const String& title) const {
+    std::vector<decltype(macros_)::const_pointer> entries;
+    entries.reserve(macros_.size());
+    for (const auto& entry : macros_) {
+        entries.push_back(&entry);
+    }
+    sort(entries.begin(), entries.end(), [](auto a, auto b) {
+        if (a->second.exclusive != b->second.exclusive) {
+            return a->second.exclusive > b->second.exclusive;
+        }
+        return a->first < b->first;
+    });
+
+    std::string report = std::format("{}: マクロの統計 ({}個)\n", as_narrow(title), entries.size());
+    std::format_to(back_inserter(report), "  {:>10} {:>12} {:>10} {:>8} {:>12} {:>12}  {}\n",
+            "回数", "トークン", "再走査", "深さ", "合計 (ms)", "自身 (ms)", "マクロ");
+    for (const auto* entry : entries) {
+        const auto& stats = entry->second;
+        std::format_to(back_inserter(report), "  {:>10} {:>12} {:>10} {:>8} {:>12.3f} {:>12.3f}  {}\n",
+                stats.calls, stats.tokens, stats.rescans, stats.max_depth,
+                to_milliseconds(stats.inclusive), to_milliseconds(stats.exclusive), entry->first);
+    }
+    output.write(report.data(), report.size());
+}
+
+/**
+ * ファイルの処理を Chromeのトレースの形式 (JSON)で出力する。chrome://tracingや Perfettoで読み込める。
+ *
+ * 処理は完了イベント ("X")で、入れ子は時間の包含で表す。インクルードガードで省いたものは瞬間イベント ("i")にする。
+ */
+void Profiler::write_trace(std::ostream& output) const {
+    std::string trace = "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    for (std::size_t i = 0; i < trace_events_.size(); i++) {
+        const auto& event = trace_events_[i];
+        const auto ts = chrono::duration<double, micro>(event.start - start_).count();
+        trace += (i == 0) ? "\n" : ",\n";
+        if (event.duration < Clock::duration::zero()) {
+            std::format_to(back_inserter(trace),
+                    "{{\"name\": {}, \"cat\": \"guarded\", \"ph\": \"i\", \"s\": \"t\", \"ts\": {:.3f}, \"pid\": 1, \"tid\": 1}}",
+                    quote_json_string(as_narrow(*event.path)), ts);
+        } else {
+            std::format_to(back_inserter(trace),
+                    "{{\"name\": {}, \"cat\": \"include\", \"ph\": \"X\", \"ts\": {:.3f}, \"dur\": {:.3f}, \"pid\": 1, \"tid\": 1, "
+                    "\"args\": {{\"tokens\": {}, \"skipped_tokens\": {}}}}}",
+                    quote_json_string(as_narrow(*event.path)), ts, chrono::duration<double, micro>(event.duration).count(),
+                    event.tokens, event.skipped_tokens);
+        }
+    }
+    trace += "\n]}\n";
+    output.write(trace.data(), trace.size());
+}
+
+}   // namespace pp
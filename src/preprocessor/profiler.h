@@ -0,0 +1,250 @@
+#ifndef CC_PREPROCESSOR_PROFILER_H_
+#define CC_PREPROCESSOR_PROFILER_H_
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "pp_config.h"
+
+//  0なら計測のコードを組み込まない。(CMakeの PP_ENABLE_PROFILER)
+#if !defined(PP_PROFILER_ENABLED)
+#define PP_PROFILER_ENABLED 1
+#endif
+
+namespace pp {
+
+/**
+ * 時間を計る処理の区分。
+ */
+enum class ProfilePhase {
+    // 1つのファイルの処理全体
+    kFile,
+    // ソースファイルのトークンの切り出し
+    kScan,
+    // ディレクティブ (#if群を除く)
+    kDirective,
+    // #if、#elifの式の展開と評価
+    kIfEvaluation,
+    // インクルードファイルの検索
+    kIncludeSearch,
+    kMacroExpansion,
+    // TokenSinkへの書き込み
+    kOutput,
+};
+
+constexpr std::size_t kNumProfilePhases = 7;
+
+enum class ProfileCounter {
+    // ソースファイルから切り出したトークン
+    kTokens,
+    kBytesRead,
+    kBytesWritten,
+};
+
+constexpr std::size_t kNumProfileCounters = 3;
+
+/**
+ * 簡易プロファイラー。(--time-report)
+ *
+ * 区間は入れ子にでき、区分ごとに回数、合計時間 (入れ子の同じ区分は数えない)、自身の時間 (入れ子の区間を除く)を集計する。
+ * マクロ展開はマクロの名前ごとに、ファイルの処理はパスごとに集計する。
+ * マクロごとに、展開結果のトークンの数、再走査の回数、呼び出しの入れ子の最大の深さも数える。(--macro-stats)
+ * ファイルごとに、トークンの数 (うち偽のグループで読み飛ばしたもの)、インクルードされた回数、
+ * インクルードガードでインクルードを省いた回数も数える。
+ * record_trace(true)なら、ファイルの処理をインクルードの入れ子が分かるように記録し、Chromeのトレースの形式で出力する。
+ * 計測するのは current()が有るスレッドだけで、無ければ計測のコードはポインターの比較だけになる。
+ */
+class Profiler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * このスレッドで計測に使う Profilerを設定し、破棄されたら元に戻す。
+     */
+    class Activation {
+    public:
+        explicit Activation(Profiler* profiler);
+        Activation(const Activation&) = delete;
+        ~Activation();
+
+        Activation& operator=(const Activation&) = delete;
+
+    private:
+        Profiler* previous_;
+    };
+
+    static Profiler* current() {
+#if PP_PROFILER_ENABLED
+        return current_;
+#else
+        return nullptr;
+#endif
+    }
+
+    Profiler();
+    Profiler(const Profiler&) = delete;
+    ~Profiler();
+
+    Profiler& operator=(const Profiler&) = delete;
+
+    void begin(ProfilePhase phase);
+    Clock::duration end(Clock::duration* exclusive = nullptr);
+    void record_trace(bool value) { record_trace_ = value; }
+    void begin_file(const String& path);
+    void end_file();
+    void add_guarded_include(const String& path);
+    void count_file_token(bool skipped) {
+        if (!files_stack_.empty()) {
+            ++files_stack_.back().tokens;
+            if (skipped) {
+                ++files_stack_.back().skipped_tokens;
+            }
+        }
+    }
+    void count(ProfileCounter counter, std::uint64_t n) {
+        counters_[static_cast<std::size_t>(counter)] += n;
+    }
+    void add_macro(const std::string& name, Clock::duration inclusive, Clock::duration exclusive,
+            std::size_t tokens, std::size_t depth);
+    void add_macro_rescan(const std::string& name) {
+        ++macros_[name].rescans;
+    }
+    void abandon();
+
+    void write_report(std::ostream& output, const String& title, std::size_t top_n) const;
+    void write_trace(std::ostream& output) const;
+    void write_macro_stats(std::ostream& output, const String& title) const;
+
+private:
+    struct Scope {
+        ProfilePhase phase;
+        Clock::time_point start;
+        // 入れ子の区間の時間
+        Clock::duration children;
+    };
+
+    struct PhaseStats {
+        std::uint64_t calls;
+        Clock::duration inclusive;
+        Clock::duration exclusive;
+    };
+
+    struct MacroStats {
+        std::uint64_t calls;
+        // 展開結果のトークンの数の合計
+        std::uint64_t tokens;
+        std::uint64_t rescans;
+        // 呼び出しの入れ子の最大の深さ (1が一番外側)
+        std::size_t max_depth;
+        Clock::duration inclusive;
+        Clock::duration exclusive;
+    };
+
+    struct FileStats {
+        std::uint64_t count;
+        // インクルードガードで省いた回数
+        std::uint64_t guarded;
+        std::uint64_t tokens;
+        std::uint64_t skipped_tokens;
+        Clock::duration inclusive;
+        Clock::duration exclusive;
+    };
+
+    struct OpenFile {
+        // パスは files_のキー
+        const String* path;
+        FileStats* stats;
+        Clock::time_point start;
+        // インクルードしたファイルの処理の時間
+        Clock::duration children;
+        std::uint64_t tokens;
+        std::uint64_t skipped_tokens;
+    };
+
+    /**
+     * ファイルの処理 1回分。durationが 0未満ならインクルードガードで省いたもの。
+     */
+    struct TraceEvent {
+        const String* path;
+        Clock::time_point start;
+        Clock::duration duration;
+        std::uint64_t tokens;
+        std::uint64_t skipped_tokens;
+    };
+
+#if PP_PROFILER_ENABLED
+    static thread_local Profiler* current_;
+#endif
+
+    Clock::time_point start_;
+    std::vector<Scope> scopes_;
+    std::array<std::uint32_t, kNumProfilePhases> depth_;
+    std::array<PhaseStats, kNumProfilePhases> phases_;
+    std::array<std::uint64_t, kNumProfileCounters> counters_;
+    std::unordered_map<std::string, MacroStats> macros_;
+    std::vector<OpenFile> files_stack_;
+    std::unordered_map<String, FileStats> files_;
+    bool record_trace_;
+    std::vector<TraceEvent> trace_events_;
+};
+
+/**
+ * 区間の時間を計る。current()が無ければ何もしない。
+ */
+class ProfileScope {
+public:
+    explicit ProfileScope(ProfilePhase phase)
+        : profiler_(Profiler::current()) {
+        if (profiler_) {
+            profiler_->begin(phase);
+        }
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+
+    ~ProfileScope() {
+        if (profiler_) {
+            profiler_->end();
+        }
+    }
+
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    Profiler* profiler_;
+};
+
+/**
+ * 1つのファイルの処理の時間を計る。
+ */
+class ProfileFileScope {
+public:
+    explicit ProfileFileScope(const String& path)
+        : profiler_(Profiler::current()) {
+        if (profiler_) {
+            profiler_->begin_file(path);
+        }
+    }
+
+    ProfileFileScope(const ProfileFileScope&) = delete;
+
+    ~ProfileFileScope() {
+        if (profiler_) {
+            profiler_->end_file();
+        }
+    }
+
+    ProfileFileScope& operator=(const ProfileFileScope&) = delete;
+
+private:
+    Profiler* profiler_;
+};
+
+}   // namespace pp
+
+#endif  // CC_PREPROCESSOR_PROFILER_H_
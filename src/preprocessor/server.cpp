@@ -0,0 +1,360 @@
+#include "server.h"
+
+#include <exception>
+#include <iostream>
+#include <streambuf>
+#include <thread>
+
+#include "util/logger.h"
+#include "util/utility.h"
+
+#include "batchrunner.h"
+#include "diagnostics.h"
+#include "preprocessor.h"
+#include "sourcefilestack.h"
+
+using namespace lib::util;
+using namespace std;
+
+namespace {
+
+using namespace pp;
+
+const StringView kServerOptionError = T_("オプションが正しくない。\n");
+const StringView kServerStdinError = T_("サーバーには標準入力 (-)は指定できない。\n");
+const StringView kServerModeError = T_("サーバーには --serverや --connectは指定できない。\n");
+const StringView kServerRequestError = T_("依頼の処理中にエラーが発生した: {}\n");
+const StringView kServerStartMessage = T_("{}で待機する。({}スレッド)\n");
+const StringView kServerDisconnectedError = T_("サーバーとの接続が切れた。\n");
+const StringView kServerPeerRejected = T_("別のユーザーからの接続を拒否した。\n");
+
+//  通信の形式
+//
+//  依頼: マジックナンバー、引数の数、引数..., カレントディレクトリ、環境変数の数、(名前、値)...
+//  応答: (種類 1バイト、サイズ、内容)の繰り返しで、終了コードで終わる。
+//  数値は 4バイトのリトルエンディアン。文字列はサイズと内容。
+constexpr std::uint32_t kProtocolMagic = 0x31505043;    // "CPP1"
+constexpr std::uint32_t kMaxStringSize = 64 * 1024 * 1024;
+
+enum class FrameType : char {
+    kOutput = 'o',
+    kErrorOutput = 'e',
+    kExitCode = 'x',
+};
+
+void store_u32(unsigned char* bytes, std::uint32_t value) {
+    bytes[0] = static_cast<unsigned char>(value);
+    bytes[1] = static_cast<unsigned char>(value >> 8);
+    bytes[2] = static_cast<unsigned char>(value >> 16);
+    bytes[3] = static_cast<unsigned char>(value >> 24);
+}
+
+std::uint32_t load_u32(const unsigned char* bytes) {
+    return static_cast<std::uint32_t>(bytes[0]) |
+        (static_cast<std::uint32_t>(bytes[1]) << 8) |
+        (static_cast<std::uint32_t>(bytes[2]) << 16) |
+        (static_cast<std::uint32_t>(bytes[3]) << 24);
+}
+
+void write_u32(LocalSocket& s, std::uint32_t value) {
+    unsigned char bytes[4];
+    store_u32(bytes, value);
+    s.write(bytes, sizeof(bytes));
+}
+
+bool read_u32(LocalSocket& s, std::uint32_t* value) {
+    unsigned char bytes[4];
+    if (!s.read(bytes, sizeof(bytes))) {
+        return false;
+    }
+    *value = load_u32(bytes);
+    return true;
+}
+
+void write_string(LocalSocket& s, const String& value) {
+    write_u32(s, static_cast<std::uint32_t>(value.size()));
+    s.write(value.data(), value.size());
+}
+
+bool read_string(LocalSocket& s, String* value) {
+    std::uint32_t size;
+    if (!read_u32(s, &size) || size > kMaxStringSize) {
+        return false;
+    }
+    value->resize(size);
+    return s.read(value->data(), size);
+}
+
+void write_frame(LocalSocket& s, FrameType type, const void* data, std::size_t size) {
+    const char t = static_cast<char>(type);
+    s.write(&t, 1);
+    write_u32(s, static_cast<std::uint32_t>(size));
+    s.write(data, size);
+}
+
+/**
+ * 書き込まれた内容を、応答の 1つの種類としてクライアントに送る。
+ */
+class FrameStreamBuf
+    : public std::streambuf {
+public:
+    FrameStreamBuf(LocalSocket& socket, FrameType type)
+        : socket_(socket)
+        , type_(type)
+        , buffer_(64 * 1024) {
+        setp(buffer_.data(), buffer_.data() + buffer_.size());
+    }
+
+protected:
+    virtual int_type overflow(int_type c) override {
+        send();
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    virtual int sync() override {
+        send();
+        return 0;
+    }
+
+private:
+    void send() {
+        auto size = static_cast<std::size_t>(pptr() - pbase());
+        if (size > 0) {
+            write_frame(socket_, type_, pbase(), size);
+        }
+        setp(buffer_.data(), buffer_.data() + buffer_.size());
+    }
+
+    LocalSocket& socket_;
+    FrameType type_;
+    std::vector<char> buffer_;
+};
+
+}   // anonymous namespace
+
+namespace pp {
+
+Server::Server(const Options& opts)
+    : opts_(opts)
+    , include_cache_(make_shared<IncludeCache>(true))
+    , file_cache_(make_shared<FileCache>(opts.file_cache_size()))
+    , mutex_()
+    , connection_ready_()
+    , connections_() {
+}
+
+Server::~Server() {
+}
+
+/**
+ * 依頼を待ち続ける。
+ */
+int Server::run() {
+    LocalSocket listener = LocalSocket::listen(path_string(opts_.server_socket_path()));
+
+    const size_t num_threads = max<size_t>(opts_.jobs(), 1);
+    vector<thread> threads;
+    threads.reserve(num_threads);
+    for (size_t i = 0; i < num_threads; i++) {
+        threads.emplace_back(&Server::worker, this);
+    }
+    log_info(kServerStartMessage, opts_.server_socket_path(), num_threads);
+
+    try {
+        for (;;) {
+            LocalSocket connection = listener.accept();
+            if (!connection.is_peer_same_user()) {
+                //  相手の名前で任意のファイルを読み書きできてしまうので、サーバーと同じユーザーに限る。
+                log_warning(kServerPeerRejected);
+                continue;
+            }
+            {
+                lock_guard lock(mutex_);
+                connections_.push_back(move(connection));
+            }
+            connection_ready_.notify_one();
+        }
+    } catch (...) {
+        //  待機を続けられないので、処理中のものは放っておいて終了する。
+        for (auto& t : threads) {
+            t.detach();
+        }
+        throw;
+    }
+}
+
+void Server::worker() {
+    for (;;) {
+        LocalSocket connection;
+        {
+            unique_lock lock(mutex_);
+            connection_ready_.wait(lock, [this] { return !connections_.empty(); });
+            connection = move(connections_.front());
+            connections_.pop_front();
+        }
+
+        try {
+            handle_request(connection);
+        } catch (const exception& e) {
+            log_error(kServerRequestError, e.what());
+        }
+    }
+}
+
+void Server::handle_request(LocalSocket& connection) {
+    std::uint32_t magic;
+    if (!read_u32(connection, &magic) || magic != kProtocolMagic) {
+        return;
+    }
+
+    std::uint32_t argc;
+    if (!read_u32(connection, &argc)) {
+        return;
+    }
+    vector<String> args(argc);
+    for (auto& arg : args) {
+        if (!read_string(connection, &arg)) {
+            return;
+        }
+    }
+
+    Environment env;
+    if (!read_string(connection, &env.working_dir)) {
+        return;
+    }
+    std::uint32_t num_vars;
+    if (!read_u32(connection, &num_vars)) {
+        return;
+    }
+    for (std::uint32_t i = 0; i < num_vars; i++) {
+        String name, value;
+        if (!read_string(connection, &name) || !read_string(connection, &value)) {
+            return;
+        }
+        env.variables[name] = value;
+    }
+
+    FrameStreamBuf output_buf(connection, FrameType::kOutput);
+    FrameStreamBuf error_output_buf(connection, FrameType::kErrorOutput);
+    ostream output(&output_buf);
+    ostream error_output(&error_output_buf);
+
+    int exit_code = preprocess(args, env, output, error_output);
+
+    output.flush();
+    error_output.flush();
+    unsigned char bytes[4];
+    store_u32(bytes, static_cast<std::uint32_t>(exit_code));
+    write_frame(connection, FrameType::kExitCode, bytes, sizeof(bytes));
+}
+
+/**
+ * 依頼を 1つ処理する。キャッシュは他の依頼と共有する。
+ */
+int Server::preprocess(const std::vector<String>& args, const Environment& env,
+                       std::ostream& output, std::ostream& error_output) {
+    Options opts;
+    if (!opts.parse_options(args, &env)) {
+        error_output << as_narrow(kServerOptionError);
+        return EXIT_FAILURE;
+    }
+    if (!opts.server_socket_path().empty() || !opts.connect_socket_path().empty()) {
+        error_output << as_narrow(kServerModeError);
+        return EXIT_FAILURE;
+    }
+
+    if (opts.batch_mode()) {
+        BatchRunner runner(opts, include_cache_, file_cache_);
+        return runner.run();
+    }
+
+    if (opts.input_filepath() == T_("-")) {
+        error_output << as_narrow(kServerStdinError);
+        return EXIT_FAILURE;
+    }
+
+    Options tu_opts = opts.translation_unit_options(opts.input_filepath(), opts.output_filepath(), opts.error_log_filepath());
+    Diagnostics diag;
+    SourceFileStack sources;
+    Preprocessor pp(tu_opts, diag, sources, include_cache_, file_cache_);
+    pp.standard_streams(&output, &error_output);
+    return pp.run();
+}
+
+
+Client::Client(const Options& opts)
+    : opts_(opts) {
+}
+
+Client::~Client() {
+}
+
+/**
+ * --connectを除いた引数で、サーバーに処理を依頼する。
+ */
+int Client::run(const std::vector<String>& args) {
+    LocalSocket connection = LocalSocket::connect(path_string(opts_.connect_socket_path()));
+
+    vector<String> forwarded;
+    forwarded.reserve(args.size());
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == T_("--connect")) {
+            i++;
+            continue;
+        }
+        forwarded.push_back(args[i]);
+    }
+
+    write_u32(connection, kProtocolMagic);
+    write_u32(connection, static_cast<std::uint32_t>(forwarded.size()));
+    for (const auto& arg : forwarded) {
+        write_string(connection, arg);
+    }
+    write_string(connection, get_current_dir());
+
+    vector<pair<String, String>> vars;
+    for (const auto& name : Options::include_env_var_names()) {
+        if (auto value = get_env_var(name.c_str())) {
+            vars.push_back({ name, *value });
+        }
+    }
+    write_u32(connection, static_cast<std::uint32_t>(vars.size()));
+    for (const auto& [name, value] : vars) {
+        write_string(connection, name);
+        write_string(connection, value);
+    }
+
+    String payload;
+    for (;;) {
+        char type;
+        if (!connection.read(&type, 1) || !read_string(connection, &payload)) {
+            break;
+        }
+
+        switch (static_cast<FrameType>(type)) {
+        case FrameType::kOutput:
+            cout.write(as_narrow(payload.c_str()), ssize(payload));
+            break;
+        case FrameType::kErrorOutput:
+            cerr.write(as_narrow(payload.c_str()), ssize(payload));
+            break;
+        case FrameType::kExitCode:
+            if (payload.size() == 4) {
+                cout.flush();
+                cerr.flush();
+                return static_cast<int>(load_u32(reinterpret_cast<const unsigned char*>(payload.data())));
+            }
+            break;
+        }
+    }
+
+    cout.flush();
+    log_error(kServerDisconnectedError);
+    return EXIT_FAILURE;
+}
+
+}   // namespace pp
@@ -0,0 +1,71 @@
+#ifndef CC_PREPROCESSOR_SERVER_H_
+#define CC_PREPROCESSOR_SERVER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "pp_config.h"
+#include "filecache.h"
+#include "includecache.h"
+#include "localsocket.h"
+#include "options.h"
+
+namespace pp {
+
+/**
+ * 常駐して、クライアント (cpp --connect)から依頼された処理を行う。
+ *
+ * 依頼はコマンドライン引数、カレントディレクトリ、インクルードパスの環境変数で、
+ * 出力とエラー出力はクライアントに送り返す。-oや -eが指定されたら、サーバーがファイルに出力する。
+ * -jで指定された数のスレッドで、依頼を並行して処理する。
+ *
+ * ファイルの内容、インクルードの検索結果、インクルードガードのキャッシュは依頼をまたいで使い続ける。
+ * ファイルの更新は、更新日時とサイズで検出する。
+ */
+class Server {
+public:
+    explicit Server(const Options& opts);
+    Server(const Server&) = delete;
+    ~Server();
+
+    Server& operator=(const Server&) = delete;
+
+    int run();
+
+private:
+    void worker();
+    void handle_request(LocalSocket& connection);
+    int preprocess(const std::vector<String>& args, const Environment& env,
+                   std::ostream& output, std::ostream& error_output);
+
+    const Options& opts_;
+    std::shared_ptr<IncludeCache> include_cache_;
+    std::shared_ptr<FileCache> file_cache_;
+    std::mutex mutex_;
+    std::condition_variable connection_ready_;
+    std::deque<LocalSocket> connections_;
+};
+
+/**
+ * サーバーに処理を依頼し、結果を標準出力、標準エラー出力に出力する。
+ */
+class Client {
+public:
+    explicit Client(const Options& opts);
+    Client(const Client&) = delete;
+    ~Client();
+
+    Client& operator=(const Client&) = delete;
+
+    int run(const std::vector<String>& args);
+
+private:
+    const Options& opts_;
+};
+
+}   // namespace pp
+
+#endif  // CC_PREPROCESSOR_SERVER_H_
@@ -107,6 +107,42 @@ bool token_list_equal(const TokenList& lhs, const TokenList& rhs) {
     return true;
 }
 
+/**
+ * token_list_equalと違い、[と <:、#と %:のような代替つづりも区別する。
+ * 代替つづりは文字列化すると違う文字列になるので、展開結果を再利用するときはこちらで比べる。
+ */
+bool token_list_same_spelling(const TokenList& lhs, const TokenList& rhs) {
+    if (lhs.size() != rhs.size()) {
+        return false;
+    }
+
+    auto l = lhs.begin();
+    auto r = rhs.begin();
+    for (; l != lhs.end(); ++l, ++r) {
+        if (l->type() != r->type() || l->string() != r->string()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::size_t token_list_hash(const TokenList& tokens) {
+    // FNV-1a。token_list_same_spellingで等しいものは同じ値になる。
+    constexpr std::uint64_t kOffsetBasis = 14695981039346656037ULL;
+    constexpr std::uint64_t kPrime = 1099511628211ULL;
+
+    std::uint64_t h = kOffsetBasis;
+    for (const auto& t : tokens) {
+        h = (h ^ static_cast<std::uint64_t>(t.type())) * kPrime;
+        for (auto c : t.string()) {
+            h = (h ^ static_cast<unsigned char>(c)) * kPrime;
+        }
+    }
+
+    return static_cast<std::size_t>(h);
+}
+
 const Token kTokenNull("", TokenType::kNull);
 const Token kTokenEndOfFile("", TokenType::kEndOfFile);
 const Token kTokenPpNumberZero("0", TokenType::kPpNumber);
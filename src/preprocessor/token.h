@@ -80,6 +80,11 @@ public:
             , type_(type) {
         }
 
+        TokenValue(std::string&& string, TokenType type)
+            : string_(std::move(string))
+            , type_(type) {
+        }
+
         ~TokenValue() {
         }
 
@@ -110,6 +115,10 @@ public:
         return std::make_shared<TokenValue>(string, type);
     }
 
+    static std::shared_ptr<TokenValue> make_value(std::string&& string, TokenType type) {
+        return std::make_shared<TokenValue>(std::move(string), type);
+    }
+
     Token()
         : value_(kTokenValueNull)
         , line_()
@@ -122,6 +131,12 @@ public:
         , column_() {
     }
 
+    Token(std::string&& string, TokenType type)
+        : value_(Token::make_value(std::move(string), type))
+        , line_()
+        , column_() {
+    }
+
     Token(const std::string& string, TokenType type, std::uint32_t line, std::uint32_t column)
         : value_(Token::make_value(string, type))
         , line_(line)
@@ -163,6 +178,17 @@ public:
         return column_;
     }
 
+    void column(std::uint32_t value) {
+        column_ = value;
+    }
+
+    /**
+     * 字句の値。コピーしたトークンは同じ値を共有するので、トークンの出所を調べるのに使う。
+     */
+    const TokenValue* value() const {
+        return value_.get();
+    }
+
     bool is_null() const {
         return type() == TokenType::kNull;
     }
@@ -187,6 +213,8 @@ private:
 
 using TokenList = std::vector<Token>;
 bool token_list_equal(const TokenList& lhs, const TokenList& rhs);
+bool token_list_same_spelling(const TokenList& lhs, const TokenList& rhs);
+std::size_t token_list_hash(const TokenList& tokens);
 
 extern const Token kTokenNull;
 extern const Token kTokenEndOfFile;
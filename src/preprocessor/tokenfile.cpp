@@ -0,0 +1,187 @@
+#include "tokenfile.h"
+
+#include <algorithm>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+#include "util/utility.h"
+
+#include "mappedfile.h"
+
+using namespace lib::util;
+using namespace std;
+
+namespace {
+
+using namespace pp;
+
+[[noreturn]]
+void raise_format_error() {
+    throw runtime_error("invalid token file");
+}
+
+[[noreturn]]
+void raise_byte_order_error() {
+    throw runtime_error("token file was written with a different byte order");
+}
+
+/**
+ * offsetから count個の要素が、データの範囲内に 4バイト境界で置かれているか。
+ */
+bool is_valid_section(std::size_t size, std::uint32_t offset, std::uint64_t count, std::size_t element_size) {
+    return (offset % 4) == 0 && static_cast<std::uint64_t>(offset) + count * element_size <= size;
+}
+
+}   // anonymous namespace
+
+namespace pp {
+
+/**
+ * トークンの綴りを 1行に収まるように、改行、タブ、'\\'をエスケープする。
+ */
+std::string escape_spelling(std::string_view spelling) {
+    std::string result;
+    result.reserve(spelling.size());
+    for (char c : spelling) {
+        switch (c) {
+        case '\n': result += "\\n"; break;
+        case '\r': result += "\\r"; break;
+        case '\t': result += "\\t"; break;
+        case '\\': result += "\\\\"; break;
+        default: result += c; break;
+        }
+    }
+    return result;
+}
+
+TokenFileReader::Iterator::Iterator(const TokenFileReader& reader, std::size_t index)
+    : reader_(&reader)
+    , index_(index)
+    , line_() {
+}
+
+TokenFileReader::TokenView TokenFileReader::Iterator::operator*() const {
+    return reader_->make_view(index_, line_);
+}
+
+TokenFileReader::Iterator& TokenFileReader::Iterator::operator++() {
+    ++index_;
+    const auto num_lines = reader_->header_->num_lines;
+    while ((line_ + 1) < num_lines && reader_->lines_[line_ + 1].first_token <= index_) {
+        ++line_;
+    }
+    return *this;
+}
+
+
+TokenFileReader::TokenFileReader(const char* data, std::size_t size)
+    : data_(data)
+    , header_()
+    , string_offsets_()
+    , string_data_()
+    , files_()
+    , lines_()
+    , tokens_() {
+    if (!data || size < sizeof(TokenFileHeader) || (reinterpret_cast<std::uintptr_t>(data) % 4) != 0) {
+        raise_format_error();
+    }
+
+    header_ = reinterpret_cast<const TokenFileHeader*>(data);
+    if (header_->byte_order != TokenFileHeader::kByteOrder) {
+        //  magicも逆順に見えるので、先に調べる。
+        if (header_->byte_order == 0x04030201) {
+            raise_byte_order_error();
+        }
+        raise_format_error();
+    }
+    if (header_->magic != TokenFileHeader::kMagic || header_->version != TokenFileHeader::kVersion) {
+        raise_format_error();
+    }
+    if (!is_valid_section(size, header_->string_offsets, static_cast<std::uint64_t>(header_->num_strings) + 1, sizeof(std::uint32_t)) ||
+        !is_valid_section(size, header_->files, header_->num_files, sizeof(std::uint32_t)) ||
+        !is_valid_section(size, header_->lines, header_->num_lines, sizeof(TokenLineRecord)) ||
+        !is_valid_section(size, header_->tokens, header_->num_tokens, sizeof(TokenRecord)) ||
+        static_cast<std::uint64_t>(header_->string_data) + header_->string_data_size > size) {
+        raise_format_error();
+    }
+
+    string_offsets_ = reinterpret_cast<const std::uint32_t*>(data + header_->string_offsets);
+    string_data_ = data + header_->string_data;
+    files_ = reinterpret_cast<const std::uint32_t*>(data + header_->files);
+    lines_ = reinterpret_cast<const TokenLineRecord*>(data + header_->lines);
+    tokens_ = reinterpret_cast<const TokenRecord*>(data + header_->tokens);
+}
+
+std::string_view TokenFileReader::string(std::uint32_t id) const {
+    if (id >= header_->num_strings) {
+        raise_format_error();
+    }
+    auto first = string_offsets_[id];
+    auto last = string_offsets_[id + 1];
+    if (first > last || last > header_->string_data_size) {
+        raise_format_error();
+    }
+    return std::string_view(string_data_ + first, last - first);
+}
+
+/**
+ * ファイル番号 fileのパス。0は位置の無いトークンで、使われなかった番号と同じく空を返す。
+ */
+std::string_view TokenFileReader::file_path(std::uint32_t file) const {
+    if (file == 0) {
+        return std::string_view();
+    }
+    if (file > header_->num_files) {
+        raise_format_error();
+    }
+    if (files_[file - 1] == TokenFileHeader::kNoString) {
+        return std::string_view();
+    }
+    return string(files_[file - 1]);
+}
+
+/**
+ * index番目のトークン。行の表を二分探索する。
+ */
+TokenFileReader::TokenView TokenFileReader::token(std::size_t index) const {
+    auto last = lines_ + header_->num_lines;
+    auto it = upper_bound(lines_, last, index,
+            [](std::size_t i, const TokenLineRecord& r) {
+                return i < r.first_token;
+            });
+    return make_view(index, (it == lines_) ? 0 : static_cast<std::size_t>(it - lines_ - 1));
+}
+
+TokenFileReader::TokenView TokenFileReader::make_view(std::size_t index, std::size_t line) const {
+    if (index >= header_->num_tokens) {
+        raise_format_error();
+    }
+
+    const TokenRecord& t = tokens_[index];
+    TokenView view{ static_cast<TokenType>(t.type), string(t.spelling), 0, 0, t.column, t.expansion };
+    if (line < header_->num_lines && lines_[line].first_token <= index) {
+        view.file = lines_[line].file;
+        view.line = lines_[line].line;
+    }
+    return view;
+}
+
+/**
+ * トークンファイルの内容を、1行に 1トークンずつテキストで出力する。(cpp --dump)
+ */
+int dump_token_file(const String& path, std::ostream& output) {
+    MappedFile file(path_string(path));
+    TokenFileReader reader(file.data(), file.size());
+
+    for (const auto& t : reader) {
+        output << reader.file_path(t.file) << ':' << t.line << ':' << t.column << '\t'
+               << Token::type_to_string(t.type) << '\t' << t.expansion << '\t'
+               << escape_spelling(t.spelling) << '\n';
+    }
+    output.flush();
+
+    return 0;
+}
+
+}   // namespace pp
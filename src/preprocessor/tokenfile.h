@@ -0,0 +1,142 @@
+#ifndef CC_PREPROCESSOR_TOKENFILE_H_
+#define CC_PREPROCESSOR_TOKENFILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <iterator>
+#include <string_view>
+
+#include "pp_config.h"
+#include "token.h"
+
+namespace pp {
+
+/**
+ * トークンファイル (-ftoken-output=binary)の形式。
+ *
+ * ファイル全体をメモリーにマップして、そのまま配列として読めるようにしてある。
+ * 数値は全て書き込んだホストのバイト順で、各セクションは 4バイト境界に置く。
+ * バイト順の違うホストで読むと、ヘッダーの byte_orderが kByteOrderと一致しないのでエラーにする。
+ *
+ *   ヘッダー       TokenFileHeader
+ *   文字列の位置   u32 [num_strings + 1]   (string_dataからの位置。i番目の長さは [i + 1] - [i])
+ *   ファイル       u32 [num_files]         (パスの文字列番号。ファイル番号は 1から。使われない番号は kNoString)
+ *   行             TokenLineRecord [num_lines]
+ *   トークン       TokenRecord [num_tokens]
+ *   文字列の内容   char [string_data_size]
+ *
+ * 綴りは重複しないように文字列表にまとめ、トークンは文字列番号で参照する。
+ * ファイルと行はトークンごとには持たず、変わったところだけを行の表に記録する。
+ */
+struct TokenFileHeader {
+    static constexpr std::uint32_t kMagic = 0x54505043;     // "CPPT"
+    static constexpr std::uint32_t kVersion = 3;
+    static constexpr std::uint32_t kByteOrder = 0x01020304;
+    static constexpr std::uint32_t kNoString = 0xFFFFFFFF;
+
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint32_t num_strings;
+    std::uint32_t string_offsets;
+    std::uint32_t string_data;
+    std::uint32_t string_data_size;
+    std::uint32_t num_files;
+    std::uint32_t files;
+    std::uint32_t num_lines;
+    std::uint32_t lines;
+    std::uint32_t num_tokens;
+    std::uint32_t tokens;
+};
+static_assert(sizeof(TokenFileHeader) == 52);
+
+/**
+ * first_token以降のトークンのファイルと行。
+ */
+struct TokenLineRecord {
+    std::uint32_t first_token;
+    std::uint32_t file;
+    std::uint32_t line;
+};
+static_assert(sizeof(TokenLineRecord) == 12);
+
+struct TokenRecord {
+    std::uint32_t spelling;
+    std::uint16_t type;
+    std::uint16_t reserved;
+    std::uint32_t column;
+    // マクロ展開の結果なら、展開ごとに 1から振られる番号。
+    std::uint32_t expansion;
+};
+static_assert(sizeof(TokenRecord) == 16);
+
+/**
+ * メモリー上のトークンファイルを、コピーせずに読む。
+ *
+ * データは読み終わるまで呼び出し側で保持すること。形式が正しくなければ std::runtime_errorを送出する。
+ */
+class TokenFileReader {
+public:
+    struct TokenView {
+        TokenType type;
+        std::string_view spelling;
+        std::uint32_t file;
+        std::uint32_t line;
+        std::uint32_t column;
+        std::uint32_t expansion;
+    };
+
+    /**
+     * トークンを先頭から順に読む。行の表も順にたどるので、探索はしない。
+     */
+    class Iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = TokenView;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const TokenView*;
+        using reference = TokenView;
+
+        Iterator(const TokenFileReader& reader, std::size_t index);
+
+        TokenView operator*() const;
+        Iterator& operator++();
+        bool operator==(const Iterator& rhs) const { return index_ == rhs.index_; }
+        bool operator!=(const Iterator& rhs) const { return index_ != rhs.index_; }
+
+    private:
+        const TokenFileReader* reader_;
+        std::size_t index_;
+        std::size_t line_;
+    };
+
+    TokenFileReader(const char* data, std::size_t size);
+
+    std::size_t num_tokens() const { return header_->num_tokens; }
+    std::size_t num_files() const { return header_->num_files; }
+    std::string_view string(std::uint32_t id) const;
+    std::string_view file_path(std::uint32_t file) const;
+    TokenView token(std::size_t index) const;
+
+    Iterator begin() const { return Iterator(*this, 0); }
+    Iterator end() const { return Iterator(*this, num_tokens()); }
+
+private:
+    TokenView make_view(std::size_t index, std::size_t line) const;
+
+    const char* data_;
+    const TokenFileHeader* header_;
+    const std::uint32_t* string_offsets_;
+    const char* string_data_;
+    const std::uint32_t* files_;
+    const TokenLineRecord* lines_;
+    const TokenRecord* tokens_;
+};
+
+std::string escape_spelling(std::string_view spelling);
+int dump_token_file(const String& path, std::ostream& output);
+
+}   // namespace pp
+
+#endif  // CC_PREPROCESSOR_TOKENFILE_H_
@@ -0,0 +1,165 @@
+#include "tokensink.h"
+
+#include <algorithm>
+#include <ostream>
+
+#include "util/utility.h"
+
+using namespace lib::util;
+using namespace std;
+
+namespace {
+
+void write_u32s(std::ostream& output, const std::uint32_t* values, std::size_t count) {
+    output.write(reinterpret_cast<const char*>(values), static_cast<std::streamsize>(count * sizeof(std::uint32_t)));
+}
+
+template <typename T>
+void write_records(std::ostream& output, const std::vector<T>& records) {
+    output.write(reinterpret_cast<const char*>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(T)));
+}
+
+}   // anonymous namespace
+
+namespace pp {
+
+TokenBatch::TokenBatch()
+    : record_tokens_()
+    , text_()
+    , tokens_()
+    , files_() {
+    text_.reserve(kMaxTextSize + 1024);
+}
+
+TokenBatch::~TokenBatch() {
+}
+
+void TokenBatch::add_file(std::uint32_t id, const String& path) {
+    files_.push_back({ id, path });
+}
+
+/**
+ * 確保したメモリーは次のバッチで使い回す。
+ */
+void TokenBatch::clear() {
+    text_.clear();
+    tokens_.clear();
+    files_.clear();
+}
+
+
+TokenSink::~TokenSink() {
+}
+
+void TokenSink::finish() {
+}
+
+
+TextTokenSink::TextTokenSink(std::ostream& output)
+    : output_(output) {
+}
+
+TextTokenSink::~TextTokenSink() {
+}
+
+bool TextTokenSink::wants_tokens() const {
+    return false;
+}
+
+void TextTokenSink::write(const TokenBatch& batch) {
+    auto text = batch.text();
+    output_.write(text.data(), text.size());
+}
+
+void TextTokenSink::flush() {
+    output_.flush();
+}
+
+
+BinaryTokenSink::BinaryTokenSink(std::ostream& output)
+    : output_(output)
+    , string_ids_()
+    , string_offsets_()
+    , string_data_()
+    , files_()
+    , lines_()
+    , tokens_()
+    , finished_() {
+    string_offsets_.push_back(0);
+}
+
+BinaryTokenSink::~BinaryTokenSink() {
+}
+
+bool BinaryTokenSink::wants_tokens() const {
+    return true;
+}
+
+void BinaryTokenSink::write(const TokenBatch& batch) {
+    for (const auto& f : batch.files()) {
+        //  ファイル番号は 1から振られる。バッチに現れなかった番号は kNoStringのままにする。
+        files_.resize(max<size_t>(files_.size(), f.id), TokenFileHeader::kNoString);
+        files_[f.id - 1] = intern(as_narrow(f.path));
+    }
+
+    tokens_.reserve(tokens_.size() + batch.tokens().size());
+    for (const auto& t : batch.tokens()) {
+        if (lines_.empty() || lines_.back().file != t.file || lines_.back().line != t.line) {
+            lines_.push_back({ static_cast<std::uint32_t>(tokens_.size()), t.file, t.line });
+        }
+        tokens_.push_back({ intern(batch.spelling(t)), static_cast<std::uint16_t>(t.type), 0, t.column, t.expansion });
+    }
+}
+
+void BinaryTokenSink::flush() {
+}
+
+/**
+ * 各セクションを順に書き込む。要素は全て 4バイトの倍数なので、境界の調整は文字列の内容の後だけでよい。
+ */
+void BinaryTokenSink::finish() {
+    if (finished_) {
+        return;
+    }
+    finished_ = true;
+
+    TokenFileHeader header{};
+    header.magic = TokenFileHeader::kMagic;
+    header.version = TokenFileHeader::kVersion;
+    header.byte_order = TokenFileHeader::kByteOrder;
+    header.num_strings = static_cast<std::uint32_t>(string_offsets_.size() - 1);
+    header.string_offsets = sizeof(TokenFileHeader);
+    header.num_files = static_cast<std::uint32_t>(files_.size());
+    header.files = header.string_offsets + static_cast<std::uint32_t>(string_offsets_.size() * sizeof(std::uint32_t));
+    header.num_lines = static_cast<std::uint32_t>(lines_.size());
+    header.lines = header.files + static_cast<std::uint32_t>(files_.size() * sizeof(std::uint32_t));
+    header.num_tokens = static_cast<std::uint32_t>(tokens_.size());
+    header.tokens = header.lines + static_cast<std::uint32_t>(lines_.size() * sizeof(TokenLineRecord));
+    header.string_data = header.tokens + static_cast<std::uint32_t>(tokens_.size() * sizeof(TokenRecord));
+    header.string_data_size = static_cast<std::uint32_t>(string_data_.size());
+
+    output_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    write_u32s(output_, string_offsets_.data(), string_offsets_.size());
+    write_u32s(output_, files_.data(), files_.size());
+    write_records(output_, lines_);
+    write_records(output_, tokens_);
+    output_.write(string_data_.data(), static_cast<std::streamsize>(string_data_.size()));
+    const char padding[4] = {};
+    output_.write(padding, (4 - string_data_.size() % 4) % 4);
+    output_.flush();
+}
+
+std::uint32_t BinaryTokenSink::intern(std::string_view s) {
+    auto it = string_ids_.find(s);
+    if (it != string_ids_.end()) {
+        return it->second;
+    }
+
+    auto id = static_cast<std::uint32_t>(string_offsets_.size() - 1);
+    string_ids_.emplace(std::string(s), id);
+    string_data_.append(s);
+    string_offsets_.push_back(static_cast<std::uint32_t>(string_data_.size()));
+    return id;
+}
+
+}   // namespace pp
@@ -0,0 +1,180 @@
+#ifndef CC_PREPROCESSOR_TOKENSINK_H_
+#define CC_PREPROCESSOR_TOKENSINK_H_
+
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "pp_config.h"
+#include "token.h"
+#include "tokenfile.h"
+
+namespace pp {
+
+/**
+ * 出力するトークンを、まとめて TokenSinkに渡すためのもの。
+ *
+ * トークンの綴りは 1つのバッファーに出力順に連結して持つので、text()がそのままテキストの出力になる。
+ * トークン単位の情報が不要なら (record_tokens()が false)、綴りだけを連結する。
+ */
+class TokenBatch {
+public:
+    struct Entry {
+        TokenType type;
+        std::uint32_t spelling_offset;
+        std::uint32_t spelling_length;
+        // ファイルの番号。files()で番号とパスを知らせる。
+        std::uint32_t file;
+        // マクロ展開の結果なら、マクロを呼び出した位置。0なら位置は無い。
+        std::uint32_t line;
+        std::uint32_t column;
+        // マクロ展開の結果なら、展開ごとに 1から振られる番号。展開の結果でなければ 0。
+        std::uint32_t expansion;
+    };
+
+    struct FileEntry {
+        std::uint32_t id;
+        String path;
+    };
+
+    static constexpr std::size_t kMaxTokens = 4096;
+    static constexpr std::size_t kMaxTextSize = 64 * 1024;
+
+    TokenBatch();
+    TokenBatch(const TokenBatch&) = delete;
+    ~TokenBatch();
+
+    TokenBatch& operator=(const TokenBatch&) = delete;
+
+    bool record_tokens() const { return record_tokens_; }
+    void record_tokens(bool value) { record_tokens_ = value; }
+
+    bool empty() const { return text_.empty() && tokens_.empty() && files_.empty(); }
+    bool full() const { return tokens_.size() >= kMaxTokens || text_.size() >= kMaxTextSize; }
+
+    std::string_view text() const { return text_; }
+    const std::vector<Entry>& tokens() const { return tokens_; }
+    const std::vector<FileEntry>& files() const { return files_; }
+
+    std::string_view spelling(const Entry& entry) const {
+        return std::string_view(text_).substr(entry.spelling_offset, entry.spelling_length);
+    }
+
+    void add_text(std::string_view text) {
+        text_.append(text);
+    }
+
+    void add_token(TokenType type, std::string_view spelling, std::uint32_t file,
+                   std::uint32_t line, std::uint32_t column, std::uint32_t expansion) {
+        if (!record_tokens_) {
+            text_.append(spelling);
+            return;
+        }
+        tokens_.push_back({ type, static_cast<std::uint32_t>(text_.size()), static_cast<std::uint32_t>(spelling.size()),
+                            file, line, column, expansion });
+        text_.append(spelling);
+    }
+
+    void add_file(std::uint32_t id, const String& path);
+    void clear();
+
+private:
+    bool record_tokens_;
+    std::string text_;
+    std::vector<Entry> tokens_;
+    std::vector<FileEntry> files_;
+};
+
+/**
+ * Preprocessorが出力するトークンを受け取るもの。
+ *
+ * 仮想関数の呼び出しはトークンごとではなく、TokenBatchごとに行う。
+ */
+class TokenSink {
+public:
+    virtual ~TokenSink();
+
+    /**
+     * トークン単位の情報 (種類、位置など)が必要か。falseならテキストだけを渡す。
+     */
+    virtual bool wants_tokens() const = 0;
+
+    /**
+     * batchの内容は呼び出しの後で消されるので、必要ならコピーしておくこと。
+     */
+    virtual void write(const TokenBatch& batch) = 0;
+    virtual void flush() = 0;
+
+    /**
+     * 1つの翻訳単位の出力が終わった。
+     */
+    virtual void finish();
+};
+
+/**
+ * テキストとして出力する。
+ */
+class TextTokenSink
+    : public TokenSink {
+public:
+    explicit TextTokenSink(std::ostream& output);
+    TextTokenSink(const TextTokenSink&) = delete;
+    virtual ~TextTokenSink() override;
+
+    TextTokenSink& operator=(const TextTokenSink&) = delete;
+
+    virtual bool wants_tokens() const override;
+    virtual void write(const TokenBatch& batch) override;
+    virtual void flush() override;
+
+private:
+    std::ostream& output_;
+};
+
+/**
+ * トークンファイル (tokenfile.hを参照)として出力する。受け取る側は字句解析をし直さずに済む。
+ *
+ * 文字列表を作るために翻訳単位の全体を覚えておき、finish()でまとめて書き込む。
+ */
+class BinaryTokenSink
+    : public TokenSink {
+public:
+    explicit BinaryTokenSink(std::ostream& output);
+    BinaryTokenSink(const BinaryTokenSink&) = delete;
+    virtual ~BinaryTokenSink() override;
+
+    BinaryTokenSink& operator=(const BinaryTokenSink&) = delete;
+
+    virtual bool wants_tokens() const override;
+    virtual void write(const TokenBatch& batch) override;
+    virtual void flush() override;
+    virtual void finish() override;
+
+private:
+    struct StringHash {
+        using is_transparent = void;
+
+        std::size_t operator()(std::string_view s) const {
+            return std::hash<std::string_view>()(s);
+        }
+    };
+
+    std::uint32_t intern(std::string_view s);
+
+    std::ostream& output_;
+    std::unordered_map<std::string, std::uint32_t, StringHash, std::equal_to<>> string_ids_;
+    std::vector<std::uint32_t> string_offsets_;
+    std::string string_data_;
+    std::vector<std::uint32_t> files_;
+    std::vector<TokenLineRecord> lines_;
+    std::vector<TokenRecord> tokens_;
+    bool finished_;
+};
+
+}   // namespace pp
+
+#endif  // CC_PREPROCESSOR_TOKENSINK_H_
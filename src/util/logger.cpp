@@ -1,6 +1,7 @@
 #include "logger.h"
 
 #include <iostream>
+#include <mutex>
 
 using namespace std;
 
@@ -15,6 +16,7 @@ Logger::~Logger() {
 }
 
 void Logger::set_output_stream(const std::shared_ptr<std::ostream>& output) {
+    lock_guard<mutex> lock(mutex_);
     output_ = output;
 }
 
@@ -26,6 +28,9 @@ void Logger::output_log_with_args(LogLevel level, const StringView& format,
 
     //vformat_to(BufferedOutputIterator(cerr), format, args);
     auto s = vformat(as_narrow(format), args);
+
+    // 複数のスレッドから呼ばれても、1つのログが混ざらないようにする。
+    lock_guard<mutex> lock(mutex_);
     if (output_) {
         output_->write(s.data(), ssize(s));
     } else {
@@ -35,6 +40,7 @@ void Logger::output_log_with_args(LogLevel level, const StringView& format,
 
 Logger::Logger()
     : min_level_(LogLevel::kWarning)
+    , mutex_()
     , output_() {
 }
 
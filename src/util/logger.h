@@ -5,6 +5,7 @@
 #include <iostream>
 #include <iterator>
 #include <memory>
+#include <mutex>
 
 #include "config.h"
 #include "utility.h"
@@ -89,6 +90,7 @@ protected:
 
 private:
     LogLevel min_level_;
+    std::mutex mutex_;
     std::shared_ptr<std::ostream> output_;
 };
 
@@ -3,6 +3,7 @@
 #if HOST_PLATFORM != PLATFORM_WINDOWS
 #include <cstdlib>
 #endif
+#include <format>
 #include <iostream>
 #include <system_error>
 #if HOST_PLATFORM == PLATFORM_WINDOWS
@@ -114,6 +115,30 @@ std::string normalize_string(const std::string& s) {
 #endif
 }
 
+std::string quote_json_string(std::string_view s) {
+    std::string result;
+    result.reserve(s.size() + 2);
+    result += '"';
+    for (auto c : s) {
+        switch (c) {
+        case '"':   result += "\\\""; break;
+        case '\\':  result += "\\\\"; break;
+        case '\n':  result += "\\n"; break;
+        case '\r':  result += "\\r"; break;
+        case '\t':  result += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                result += format("\\u{:04x}", static_cast<unsigned int>(c));
+            } else {
+                result += c;
+            }
+            break;
+        }
+    }
+    result += '"';
+    return result;
+}
+
 std::optional<String> get_env_var(const Char* name) {
     if (!name) {
         throw invalid_argument("get_env_var(!name)");
@@ -281,6 +281,11 @@ void raise_generic_error(const char* message, std::errc error);
 
 std::string normalize_string(const std::string& s);
 
+/**
+ * JSONの文字列 (前後の "を含む)にします。
+ */
+std::string quote_json_string(std::string_view s);
+
 
 /**
  */
@@ -0,0 +1,9 @@
+/*  -fcompact-outputで空白を除いても、トークンがくっつかないこと */
+#define NUM 1.
+#define EXP 1e
+#define F f
+#define DOT .
+#define PLUS +
+NUM F NUM DOT NUM 5 NUM NUM
+EXP PLUS 2 EXP F
+a b + + - > . 5 L "s"
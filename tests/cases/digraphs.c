@@ -0,0 +1,8 @@
+/* 代替つづりは文字列化で区別される。引数の展開を再利用しても変わらない。 */
+#define str(x) #x
+#define xstr(x) str(x)
+#define id(x) x
+#define wrap(x) id(x)
+const char* brackets[] = { xstr(wrap([)), xstr(wrap(<:)), xstr(wrap([)), xstr(wrap(<:)) };
+const char* braces[] = { xstr(wrap({)), xstr(wrap(<%)), xstr(wrap(})), xstr(wrap(%>)) };
+int a<:2:> = <% wrap(1), wrap(2) %>;
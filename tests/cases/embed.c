@@ -0,0 +1,25 @@
+/*  #embedの引数: limit、prefix、suffix、if_empty */
+const unsigned char a[] = {
+#embed "three.bin"
+};
+const unsigned char b[] = {
+#embed "three.bin" limit(2)
+};
+const unsigned char c[] = {
+#embed "three.bin" prefix(0, ) suffix(, 0)
+};
+const unsigned char d[] = {
+#embed "empty.bin" prefix(0, ) suffix(, 0) if_empty(-1)
+};
+#if __has_embed("three.bin") == __STDC_EMBED_FOUND__
+int e;
+#endif
+#if __has_embed("empty.bin") == __STDC_EMBED_EMPTY__
+int f;
+#endif
+#if __has_embed("no_such_file.bin") == __STDC_EMBED_NOT_FOUND__
+int g;
+#endif
+#if __has_embed("three.bin" limit(0)) == __STDC_EMBED_EMPTY__
+int h;
+#endif
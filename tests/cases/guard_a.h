@@ -0,0 +1,6 @@
+#ifndef GUARD_A
+#define GUARD_A 1
+#include "guard_b.h"
+#include "guard_b.h"
+int a;
+#endif
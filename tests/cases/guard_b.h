@@ -0,0 +1,5 @@
+#ifndef GUARD_B
+#define GUARD_B 2
+#include "guard_c.h"
+int b;
+#endif
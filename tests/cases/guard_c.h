@@ -0,0 +1,4 @@
+#ifndef GUARD_C
+#define GUARD_C 4
+int c;
+#endif
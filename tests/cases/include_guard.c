@@ -0,0 +1,5 @@
+/*  インクルードガードの有るヘッダーが、さらにガードの有るヘッダーをインクルードする。 */
+#include "guard_a.h"
+#include "guard_a.h"
+#include "guard_c.h"
+int main_c = GUARD_A + GUARD_B + GUARD_C;
@@ -0,0 +1,13 @@
+/*  ##の境界: 空の引数、プレースマーカー、連結後の再走査 */
+#define CAT(a, b) a ## b
+#define XCAT(a, b) CAT(a, b)
+#define EMPTY
+#define ONE 1
+#define ONETWO 12
+CAT(, x) CAT(x, ) CAT(, )
+CAT(ONE, TWO)
+XCAT(ONE, 2)
+CAT(<, <=) CAT(-, >) CAT(+, +) CAT(., 5e+) CAT(L, 'a') CAT(u8, "s")
+CAT(EMPTY, ONE) XCAT(EMPTY, ONE)
+#define VCAT(a, ...) a ## __VA_ARGS__
+VCAT(x) VCAT(x, y) VCAT(, y, z)
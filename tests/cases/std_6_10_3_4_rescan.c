@@ -0,0 +1,4 @@
+/*  C17 6.10.3.4 EXAMPLE: 再走査で後ろのトークンを取り込む。 */
+#define f(a) a*g
+#define g(a) f(a)
+f(2)(9)
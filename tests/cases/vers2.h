@@ -0,0 +1 @@
+int vers2;
@@ -0,0 +1,44 @@
+﻿# 再走査の中で 10000段に入れ子になったマクロの呼び出しと、引数の中で 1000段に入れ子になった呼び出しを
+# 処理できることを確かめます。
+# 展開はネイティブのスタックで再帰しないので、入れ子の深さはメモリーと -fmax-expansion-depthだけで制限されます。
+# cmake -DCPP=<cpp> -DWORK_DIR=<dir> -P deep_nesting.cmake
+#
+cmake_minimum_required(VERSION 3.8)
+
+set(depth 10000)
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+# 再走査の入れ子: f9999(x)が f9998(x)に置き換わり、その再走査の中で f9998を展開する。
+set(source "#define f0(x) x\n")
+math(EXPR last "${depth} - 1")
+foreach (i RANGE 1 ${last})
+    math(EXPR prev "${i} - 1")
+    string(APPEND source "#define f${i}(x) f${prev}(x)\n")
+endforeach ()
+string(APPEND source "f${last}(chain)\n")
+
+# 引数の入れ子: g(g(g(...)))。引数の展開の中で次の呼び出しを展開する。
+# 各段が残りの引数のコピーを持つので、時間とメモリーは段数の 2乗に比例する。(10000段では数 GBになる)
+# 再帰しないことは上の再走査の入れ子で確かめるので、こちらは 1000段にする。
+set(open "")
+set(close "")
+foreach (i RANGE 1 1000)
+    string(APPEND open "g(")
+    string(APPEND close ")")
+endforeach ()
+string(APPEND source "#define g(x) x\n${open}arg${close}\n")
+
+file(WRITE "${WORK_DIR}/deep_nesting.c" "${source}")
+
+execute_process(COMMAND "${CPP}" -P "${WORK_DIR}/deep_nesting.c"
+                RESULT_VARIABLE result
+                OUTPUT_VARIABLE output
+                ERROR_VARIABLE errors)
+if (NOT result STREQUAL "0")
+    message(FATAL_ERROR "cpp exited with ${result}\n${errors}")
+endif ()
+string(REGEX REPLACE "[ \t\r\n]+" " " output "${output}")
+string(STRIP "${output}" output)
+if (NOT output STREQUAL "chain arg")
+    message(FATAL_ERROR "unexpected output: ${output}")
+endif ()
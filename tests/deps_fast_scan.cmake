@@ -0,0 +1,60 @@
+﻿# -fdeps-fast-scanで、-Mの依存ファイルの一覧が変わらないことを確かめます。
+# テキスト行のマクロから __has_include、__has_embedに届くものは、読み飛ばさずに展開しなければなりません。
+# cmake -DCPP=<cpp> -DWORK_DIR=<dir> -P deps_fast_scan.cmake
+#
+cmake_minimum_required(VERSION 3.8)
+
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+file(WRITE "${WORK_DIR}/included.h" "int included;\n")
+file(WRITE "${WORK_DIR}/probed.h" "int probed;\n")
+file(WRITE "${WORK_DIR}/probed_in_prefix.h" "int probed_in_prefix;\n")
+file(WRITE "${WORK_DIR}/data.bin" "abc")
+file(WRITE "${WORK_DIR}/prefix.h" [[
+#ifndef PREFIX_H
+#define PREFIX_H
+#define PROBE_PREFIX __has_include("probed_in_prefix.h")
+#endif
+]])
+file(WRITE "${WORK_DIR}/main.c" [[
+#include "prefix.h"
+#include "included.h"
+#define HAS(h) __has_include(h)
+#define PROBE HAS("probed.h")
+#define HAS_DATA __has_embed("data.bin")
+int plain = 1;
+int probe = PROBE;
+int data = HAS_DATA;
+int probe_prefix = PROBE_PREFIX;
+]])
+
+function(run_cpp out_var)
+    execute_process(COMMAND "${CPP}" ${ARGN}
+                    WORKING_DIRECTORY "${WORK_DIR}"
+                    RESULT_VARIABLE result
+                    OUTPUT_VARIABLE output
+                    ERROR_VARIABLE errors)
+    if (NOT result STREQUAL "0")
+        message(FATAL_ERROR "cpp ${ARGN} exited with ${result}\n${errors}")
+    endif ()
+    set(${out_var} "${output}" PARENT_SCOPE)
+endfunction()
+
+function(check_same_deps)
+    run_cpp(expected -M ${ARGN} main.c)
+    run_cpp(actual -M -fdeps-fast-scan ${ARGN} main.c)
+    foreach (name included.h probed.h data.bin probed_in_prefix.h)
+        if (NOT expected MATCHES "${name}")
+            message(FATAL_ERROR "${name} is missing from -M ${ARGN}\n${expected}")
+        endif ()
+    endforeach ()
+    if (NOT actual STREQUAL expected)
+        message(FATAL_ERROR "dependencies differ with -fdeps-fast-scan ${ARGN}\n--- without:\n${expected}\n--- with:\n${actual}")
+    endif ()
+endfunction()
+
+check_same_deps()
+
+# スナップショットから来たマクロでも同じ。
+run_cpp(ignored --emit-macro-snapshot prefix.h -o prefix.ppsnap)
+check_same_deps(--use-macro-snapshot prefix.ppsnap)
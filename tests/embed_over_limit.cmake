@@ -0,0 +1,26 @@
+﻿# 64 KiBの制限を超える #embedが、異常終了せずにエラーになることを確かめます。
+# cmake -DCPP=<cpp> -DWORK_DIR=<dir> -P embed_over_limit.cmake
+#
+cmake_minimum_required(VERSION 3.8)
+
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+# 0x10000 + 1バイト
+set(content "xxxxxxxx")
+foreach (i RANGE 1 13)
+    set(content "${content}${content}")
+endforeach ()
+file(WRITE "${WORK_DIR}/large.bin" "${content}x")
+file(WRITE "${WORK_DIR}/embed_over_limit.c" "#embed \"large.bin\"\n")
+
+execute_process(COMMAND "${CPP}" -P "${WORK_DIR}/embed_over_limit.c"
+                WORKING_DIRECTORY "${WORK_DIR}"
+                RESULT_VARIABLE result
+                OUTPUT_QUIET
+                ERROR_VARIABLE errors)
+if (NOT result STREQUAL "1")
+    message(FATAL_ERROR "cpp exited with ${result}, expected 1\n${errors}")
+endif ()
+if (NOT errors MATCHES "embed_over_limit\\.c")
+    message(FATAL_ERROR "no error reported for the over-limit #embed\n${errors}")
+endif ()
@@ -0,0 +1,120 @@
+﻿# --use-macro-snapshotで処理した出力が、スナップショット無しで処理した出力と同じことを確かめます。
+# スナップショットの後でヘッダーを変えたら、警告してスナップショット無しで処理することも確かめます。
+# cmake -DCPP=<cpp> -DWORK_DIR=<dir> -P macro_snapshot.cmake
+#
+cmake_minimum_required(VERSION 3.8)
+
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+# スナップショットから始めるとインクルードガードの有るヘッダーは読み飛ばすので、ヘッダーは指令だけにする。
+# テキストの有るヘッダーは、最後にスナップショットにできないことを確かめる。
+file(WRITE "${WORK_DIR}/prefix.h" [[
+#ifndef PREFIX_H
+#define PREFIX_H
+#include "prefix_sub.h"
+#define VERSION 3
+#define CAT(a, b) a ## b
+#define XCAT(a, b) CAT(a, b)
+#define STR(x) #x
+#define XSTR(x) STR(x)
+#define CALL(f, ...) f(__VA_ARGS__ __VA_OPT__(,) VERSION)
+#define LATER
+#undef LATER
+#if SUB_LEVEL > 1
+#define LEVEL_NAME "deep"
+#else
+#define LEVEL_NAME "shallow"
+#endif
+#endif
+]])
+file(WRITE "${WORK_DIR}/prefix_sub.h" [[
+#ifndef PREFIX_SUB_H
+#define PREFIX_SUB_H
+#define SUB_LEVEL 2
+#define twice(x) ((x) + (x))
+#endif
+]])
+file(WRITE "${WORK_DIR}/main.c" [[
+#include "prefix.h"
+int XCAT(v, VERSION) = twice(VERSION);
+const char* name = LEVEL_NAME " " XSTR(SUB_LEVEL);
+int r = CALL(g) + CALL(g, 1, 2);
+#ifdef LATER
+#error LATER must stay undefined
+#endif
+#include "prefix_sub.h"
+#undef VERSION
+#define VERSION 4
+int w = twice(VERSION);
+]])
+
+function(run_cpp out_var err_var)
+    execute_process(COMMAND "${CPP}" ${ARGN}
+                    WORKING_DIRECTORY "${WORK_DIR}"
+                    RESULT_VARIABLE result
+                    OUTPUT_VARIABLE output
+                    ERROR_VARIABLE errors)
+    if (NOT result STREQUAL "0")
+        message(FATAL_ERROR "cpp ${ARGN} exited with ${result}\n${errors}")
+    endif ()
+    set(${out_var} "${output}" PARENT_SCOPE)
+    set(${err_var} "${errors}" PARENT_SCOPE)
+endfunction()
+
+run_cpp(ignored errors --emit-macro-snapshot prefix.h -o prefix.ppsnap)
+run_cpp(expected errors -P main.c)
+if (NOT expected MATCHES "int v3 = \\(\\(3\\) \\+ \\(3\\)\\);")
+    message(FATAL_ERROR "unexpected output without the snapshot:\n${expected}")
+endif ()
+
+# 警告が有れば、スナップショットは使われていない。
+run_cpp(actual errors -P --use-macro-snapshot prefix.ppsnap main.c)
+if (NOT errors STREQUAL "")
+    message(FATAL_ERROR "the snapshot was not used:\n${errors}")
+endif ()
+if (NOT actual STREQUAL expected)
+    message(FATAL_ERROR "output differs with the snapshot\n--- without:\n${expected}\n--- with:\n${actual}")
+endif ()
+
+# スナップショットの後で変えたヘッダーは、スナップショットを無効にする。
+file(WRITE "${WORK_DIR}/prefix_sub.h" [[
+#ifndef PREFIX_SUB_H
+#define PREFIX_SUB_H
+#define SUB_LEVEL 1
+#define twice(x) (2 * (x))
+#endif
+]])
+run_cpp(expected errors -P main.c)
+run_cpp(actual errors -P --use-macro-snapshot prefix.ppsnap main.c)
+if (NOT errors MATCHES "prefix_sub\\.h")
+    message(FATAL_ERROR "no warning for the stale snapshot\n${errors}")
+endif ()
+if (NOT actual STREQUAL expected)
+    message(FATAL_ERROR "output differs with a stale snapshot\n--- without:\n${expected}\n--- with:\n${actual}")
+endif ()
+
+# インクルードガードの中に宣言の有るヘッダーは、スナップショットから始めると宣言が失われるのでエラーにする。
+file(WRITE "${WORK_DIR}/decl.h" [[
+#ifndef DECL_H
+#define DECL_H
+#include "prefix_sub.h"
+#define EMPTY
+EMPTY
+typedef int decl_t;
+#endif
+]])
+file(REMOVE "${WORK_DIR}/decl.ppsnap")
+execute_process(COMMAND "${CPP}" --emit-macro-snapshot decl.h -o decl.ppsnap
+                WORKING_DIRECTORY "${WORK_DIR}"
+                RESULT_VARIABLE result
+                OUTPUT_QUIET
+                ERROR_VARIABLE errors)
+if (result STREQUAL "0")
+    message(FATAL_ERROR "a snapshot of a header with a declaration was accepted\n${errors}")
+endif ()
+if (NOT errors MATCHES "decl\\.h:6:")
+    message(FATAL_ERROR "the declaration was not reported\n${errors}")
+endif ()
+if (EXISTS "${WORK_DIR}/decl.ppsnap")
+    message(FATAL_ERROR "a snapshot was written for a header with a declaration")
+endif ()